@@ -15,68 +15,22 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "io.h"
 
 
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
-{
-  struct stat statbuf;
-  int size;
-  uint8_t *image_buf;
-  char pathname[MAXPATHLEN+1];
-
-  /* If filename isn't an absolute pathname, then we'd better prepend
-     the current working directory to it */
-  if (filename[0] == '/') {
-    strncpy(pathname, filename, MAXPATHLEN);
-  } else {
-    getcwd(pathname, MAXPATHLEN);
-    if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) {
-      fprintf(stderr, "Filename too long\n");
-      exit(1);
-    }
-    strcat(pathname, "/");
-    strcat(pathname, filename);
-  }
-
-  /* Step 2: find out how big the disk image file is */
-  /* we can use "stat" to do this, by checking the file status */
-  if (stat(pathname, &statbuf) < 0) {
-    fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
-      pathname, strerror(errno));
-    exit(1);
-  }
-
-  size = statbuf.st_size;
-
-  /* Step 3: open the file for read/write */
-  *fd = open(pathname, O_RDWR);
-  if (*fd < 0) {
-    fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
-      pathname, strerror(errno));
-    exit(1);
-  }
-
-  /* Step 3: we memory map the file */
-
-  image_buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
-  if (image_buf == MAP_FAILED) {
-    fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
-    exit(1);
-  }
-  return image_buf;
-}
+static void set_geometry(struct fat_disk *disk);
 
 /* read the bootsector from the disk, and check that it is sane */
 /* define DEBUG to see what the disk parameters actually are */
 
-struct bpb33* check_bootsector(uint8_t *image_buf)
+struct bpb710* check_bootsector(struct image_io *io)
 {
   struct bootsector33* bootsect;
-  struct byte_bpb33* bpb;  /* BIOS parameter block */
-  struct bpb33* bpb2;
+  struct byte_bpb710* bpb;  /* BIOS parameter block */
+  struct fat_disk* disk;
+  struct bpb710* bpb2;
 
-  bootsect = (struct bootsector33*)image_buf;
+  bootsect = (struct bootsector33*)io_get(io, 0, 512);
   if (bootsect->bsJump[0] == 0xe9 ||
     (bootsect->bsJump[0] == 0xeb && bootsect->bsJump[2] == 0x90)) {
   #ifdef DEBUG
@@ -104,12 +58,23 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
       bootsect->bsBootSectSig1);
   }
 
-  bpb = (struct byte_bpb33*)&(bootsect->bsBPB[0]);
+  bpb = (struct byte_bpb710*)&(bootsect->bsBPB[0]);
 
   /* bpb is a byte-based struct, because this data is unaligned.
      This makes it hard to access the multi-byte fields, so we copy
-     it to a slightly larger struct that is word-aligned */
-  bpb2 = malloc(sizeof(struct bpb33));
+     it to a slightly larger struct that is word-aligned.  The DOS 7.10
+     BPB is a superset of the older ones, so we always fill one in:
+     bpbHugeSectors and bpbBigFATsecs always hold the real sector
+     counts, whichever field they came from, and bpbRootClust is 0
+     unless the root directory is a cluster chain (FAT-32).  The
+     geometry worked out from it goes alongside */
+  disk = malloc(sizeof(struct fat_disk));
+  if (disk == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memset(disk, 0, sizeof(struct fat_disk));
+  bpb2 = &disk->bpb;
 
   bpb2->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
   bpb2->bpbSecPerClust = bpb->bpbSecPerClust;
@@ -117,9 +82,32 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
   bpb2->bpbFATs = bpb->bpbFATs;
   bpb2->bpbRootDirEnts = getushort(bpb->bpbRootDirEnts);
   bpb2->bpbSectors = getushort(bpb->bpbSectors);
+  bpb2->bpbMedia = bpb->bpbMedia;
   bpb2->bpbFATsecs = getushort(bpb->bpbFATsecs);
-  bpb2->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
+  bpb2->bpbSecPerTrack = getushort(bpb->bpbSecPerTrack);
+  bpb2->bpbHeads = getushort(bpb->bpbHeads);
 
+  if (bpb2->bpbSectors != 0) {
+    /* a DOS 3.3 BPB stops before bpbHugeSectors */
+    bpb2->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
+    bpb2->bpbHugeSectors = bpb2->bpbSectors;
+  } else {
+    bpb2->bpbHiddenSecs = getulong(bpb->bpbHiddenSecs);
+    bpb2->bpbHugeSectors = getulong(bpb->bpbHugeSectors);
+  }
+
+  if (bpb2->bpbFATsecs != 0) {
+    bpb2->bpbBigFATsecs = bpb2->bpbFATsecs;
+  } else {
+    /* only FAT-32 has the DOS 7.10 extensions; on anything else
+       these bytes are the extended boot record */
+    bpb2->bpbBigFATsecs = getulong(bpb->bpbBigFATsecs);
+    bpb2->bpbExtFlags = getushort(bpb->bpbExtFlags);
+    bpb2->bpbFSVers = getushort(bpb->bpbFSVers);
+    bpb2->bpbRootClust = getulong(bpb->bpbRootClust);
+    bpb2->bpbFSInfo = getushort(bpb->bpbFSInfo);
+    bpb2->bpbBackup = getushort(bpb->bpbBackup);
+  }
 
   #ifdef DEBUG
   printf("Bytes per sector: %d\n", bpb2->bpbBytesPerSec);
@@ -127,77 +115,1121 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
   printf("Reserved sectors: %d\n", bpb2->bpbResSectors);
   printf("Number of FATs: %d\n", bpb->bpbFATs);
   printf("Number of root dir entries: %d\n", bpb2->bpbRootDirEnts);
-  printf("Total number of sectors: %d\n", bpb2->bpbSectors);
-  printf("Number of sectors per FAT: %d\n", bpb2->bpbFATsecs);
-  printf("Number of hidden sectors: %d\n", bpb2->bpbHiddenSecs);
+  printf("Total number of sectors: %u\n", bpb2->bpbHugeSectors);
+  printf("Number of sectors per FAT: %u\n", bpb2->bpbBigFATsecs);
+  printf("Number of hidden sectors: %u\n", bpb2->bpbHiddenSecs);
+  printf("Root directory cluster: %u\n", bpb2->bpbRootClust);
   #endif
 
+  set_geometry(disk);
   return bpb2;
 }
 
-/* get_fat_entry returns the value from the FAT entry for
-   clusternum. */
-uint16_t get_fat_entry(uint16_t clusternum,
-  uint8_t *image_buf, struct bpb33* bpb)
+/* root_dir_sectors returns how many sectors the fixed-size root
+   directory takes up.  FAT-32 has none: its root directory is an
+   ordinary cluster chain starting at bpbRootClust */
+static uint32_t root_dir_sectors(struct bpb710 *bpb)
+{
+  return (bpb->bpbRootDirEnts * sizeof(struct direntry)
+          + bpb->bpbBytesPerSec - 1) / bpb->bpbBytesPerSec;
+}
+
+/* data_sectors returns how many sectors there are after the FATs and
+   the root directory, or 0 if there's no room for any */
+static uint32_t data_sectors(struct bpb710 *bpb)
+{
+  uint64_t meta_sectors = bpb->bpbResSectors
+    + (uint64_t)bpb->bpbFATs * bpb->bpbBigFATsecs + root_dir_sectors(bpb);
+
+  if (bpb->bpbHugeSectors <= meta_sectors) {
+    return 0;
+  }
+  return bpb->bpbHugeSectors - meta_sectors;
+}
+
+/* fat_type works out whether the disk is FAT-12, FAT-16 or FAT-32,
+   returning 12, 16 or 32.  Like DOS itself, this goes purely by how
+   many data clusters there are */
+int fat_type(struct bpb710 *bpb)
+{
+  uint32_t clusters = data_sectors(bpb) / bpb->bpbSecPerClust;
+
+  if (clusters < 4085) {
+    return 12;
+  } else if (clusters < 65525) {
+    return 16;
+  }
+  return 32;
+}
+
+/* set_geometry works out the disk layout from the BPB, once, so the
+   lookups that run for every cluster only have to add and shift.  It
+   mustn't trust the BPB: anything bpb_geometry_error would reject just
+   has to come out without dividing by zero */
+static void set_geometry(struct fat_disk *disk)
+{
+  struct bpb710 *bpb = &disk->bpb;
+  struct fat_geometry *geom = &disk->geom;
+  uint32_t shift;
+
+  geom->fat_offset = (size_t)bpb->bpbResSectors * bpb->bpbBytesPerSec;
+  geom->root_offset = geom->fat_offset
+    + (size_t)bpb->bpbFATs * bpb->bpbBigFATsecs * bpb->bpbBytesPerSec;
+  geom->data_offset = geom->root_offset
+    + bpb->bpbRootDirEnts * sizeof(struct direntry);
+  geom->cluster_size = (uint32_t)bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+  geom->root_cluster = bpb->bpbRootClust;
+  geom->type = 12;
+  if (bpb->bpbBytesPerSec != 0 && bpb->bpbSecPerClust != 0) {
+    geom->type = fat_type(bpb);
+  }
+
+  geom->layout = GEOM_MULTIPLY;
+  for (shift = 0; shift < 32; shift++) {
+    if (geom->cluster_size == (uint32_t)1 << shift) {
+      geom->layout = GEOM_SHIFT;
+      geom->cluster_shift = shift;
+      break;
+    }
+  }
+
+  if (bpb->bpbBytesPerSec == 512 && bpb->bpbResSectors == 1
+      && bpb->bpbFATs == 2 && bpb->bpbRootClust == 0) {
+    if (bpb->bpbSecPerClust == 1 && bpb->bpbBigFATsecs == 9
+        && bpb->bpbRootDirEnts == 224) {
+      geom->layout = GEOM_FLOPPY_1440;
+    } else if (bpb->bpbSecPerClust == 2 && bpb->bpbBigFATsecs == 3
+        && bpb->bpbRootDirEnts == 112) {
+      geom->layout = GEOM_FLOPPY_720;
+    }
+  }
+}
+
+/* bpb_geometry_error checks that the disk parameters describe a layout
+   that fits in an image of image_size bytes, and that nothing we divide
+   by is zero.  It returns a description of the first problem it finds,
+   or NULL if the geometry is usable. */
+const char *bpb_geometry_error(struct bpb710 *bpb, size_t image_size)
+{
+  if (bpb->bpbBytesPerSec < 128 || bpb->bpbBytesPerSec > 4096
+      || (bpb->bpbBytesPerSec & (bpb->bpbBytesPerSec - 1)) != 0) {
+    return "bad bytes per sector";
+  }
+  if (bpb->bpbSecPerClust == 0
+      || (bpb->bpbSecPerClust & (bpb->bpbSecPerClust - 1)) != 0) {
+    return "bad sectors per cluster";
+  }
+  if (bpb->bpbResSectors == 0 || bpb->bpbFATs == 0 || bpb->bpbBigFATsecs == 0) {
+    return "no room for the FAT";
+  }
+  if (data_sectors(bpb) == 0) {
+    return "no data area";
+  }
+  if ((uint64_t)bpb->bpbHugeSectors * bpb->bpbBytesPerSec > image_size) {
+    return "image is shorter than the boot sector says";
+  }
+  if (fat_type(bpb) == 32) {
+    if (bpb->bpbRootClust < CLUST_FIRST) {
+      return "no root directory cluster";
+    }
+  } else if (bpb->bpbRootDirEnts == 0) {
+    return "no root directory";
+  }
+  return NULL;
+}
+
+/* fat_copy_offset returns where copy (0 for the first) of the FAT
+   starts in the image */
+static uint64_t fat_copy_offset(struct bpb710 *bpb, int copy)
+{
+  return bpb_geometry(bpb)->fat_offset
+    + (uint64_t)copy * bpb->bpbBigFATsecs * bpb->bpbBytesPerSec;
+}
+
+/* fat_copy_region returns the whole of one copy of the FAT */
+static uint8_t *fat_copy_region(struct image_io *io, struct bpb710 *bpb,
+  int copy)
 {
-  uint32_t offset;
-  uint16_t value;
+  return io_get(io, fat_copy_offset(bpb, copy),
+    (size_t)bpb->bpbBigFATsecs * bpb->bpbBytesPerSec);
+}
+
+/* fat_region returns the whole of the first FAT */
+static uint8_t *fat_region(struct image_io *io, struct bpb710 *bpb)
+{
+  return fat_copy_region(io, bpb, 0);
+}
+
+/* get_fat_entry returns the value from the FAT entry for clusternum,
+   straight from the image.  Like fat_get, reserved, bad and end of
+   file markers come back as their FAT-32 values whatever the FAT
+   type. */
+uint32_t get_fat_entry(uint32_t clusternum,
+  struct image_io *io, struct bpb710* bpb)
+{
+  const struct fat_geometry *geom = bpb_geometry(bpb);
+  uint8_t *fat_buf;
+  uint32_t value;
   uint8_t b1, b2;
 
+  if (geom->layout == GEOM_FLOPPY_1440) {
+    /* FAT-12, and the FAT is always in the same place */
+    fat_buf = io_get(io, FLOPPY_1440_FAT, 9 * 512);
+  } else {
+    fat_buf = fat_region(io, bpb);
+    switch (geom->type) {
+    case 32:
+      return getulong(fat_buf + 4 * (size_t)clusternum) & FAT32_MASK;
+    case 16:
+      return fat_widen(getushort(fat_buf + 2 * (size_t)clusternum),
+        FAT16_MASK);
+    }
+  }
+
   /* this involves some really ugly bit shifting.  This probably
      only works on a little-endian machine. */
-  offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust
-    + (3 * (clusternum/2));
+  fat_buf += 3 * (clusternum/2);
   switch(clusternum % 2) {
     case 0:
-    b1 = *(image_buf + offset);
-    b2 = *(image_buf + offset + 1);
+    b1 = *fat_buf;
+    b2 = *(fat_buf + 1);
       /* mjh: little-endian CPUs are ugly! */
     value = ((0x0f & b2) << 8) | b1;
     break;
-    case 1:
-    b1 = *(image_buf + offset + 1);
-    b2 = *(image_buf + offset + 2);
+    default:
+    b1 = *(fat_buf + 1);
+    b2 = *(fat_buf + 2);
     value = b2 << 4 | ((0xf0 & b1) >> 4);
     break;
   }
-  return value;
+  return fat_widen(value, FAT12_MASK);
 }
 
-/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
-void set_fat_entry(uint16_t clusternum, uint16_t value,
-  uint8_t *image_buf, struct bpb33* bpb)
+/* put_fat_entry sets the FAT entry for clusternum to value in one
+   copy of the FAT */
+static void put_fat_entry(uint8_t *fat_buf, uint32_t clusternum,
+  uint32_t value, struct image_io *io, struct bpb710* bpb)
 {
-  uint32_t offset;
+  const struct fat_geometry *geom = bpb_geometry(bpb);
   uint8_t *p1, *p2;
 
+  switch (geom->type) {
+  case 32:
+    /* the top four bits are reserved, and have to be left alone */
+    p1 = fat_buf + 4 * (size_t)clusternum;
+    putulong(p1, (getulong(p1) & ~FAT32_MASK) | (value & FAT32_MASK));
+    io_dirty(io, p1, 4);
+    return;
+  case 16:
+    p1 = fat_buf + 2 * (size_t)clusternum;
+    putushort(p1, value & FAT16_MASK);
+    io_dirty(io, p1, 2);
+    return;
+  }
+
   /* this involves some really ugly bit shifting.  This probably
      only works on a little-endian machine. */
-  offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust
-    + (3 * (clusternum/2));
+  fat_buf += 3 * (clusternum/2);
   switch(clusternum % 2) {
     case 0:
-    p1 = image_buf + offset;
-    p2 = image_buf + offset + 1;
+    p1 = fat_buf;
+    p2 = fat_buf + 1;
       /* mjh: little-endian CPUs are really ugly! */
     *p1 = (uint8_t)(0xff & value);
     *p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
     break;
-    case 1:
-    p1 = image_buf + offset + 1;
-    p2 = image_buf + offset + 2;
+    default:
+    p1 = fat_buf + 1;
+    p2 = fat_buf + 2;
     *p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
     *p2 = (uint8_t)(0xff & (value >> 4));
     break;
   }
+  io_dirty(io, p1, 2);
+}
+
+/* set_fat_entry sets the value of the FAT entry for clusternum to
+   value, straight into the image, in every copy of the FAT */
+void set_fat_entry(uint32_t clusternum, uint32_t value,
+  struct image_io *io, struct bpb710* bpb)
+{
+  int copy;
+
+  for (copy = 0; copy < bpb->bpbFATs; copy++) {
+    put_fat_entry(fat_copy_region(io, bpb, copy), clusternum, value, io,
+      bpb);
+  }
+}
+
+
+/* Bulk FAT-12 conversion.  Every 3 bytes of the packed FAT hold two
+   12-bit entries, so both directions are a byte shuffle plus a shift.
+   fat12_decode/fat12_encode pick the widest kernel the CPU supports
+   the first time they're called; the scalar versions handle the
+   ragged ends and any CPU without SSSE3. */
+
+static void fat12_decode_scalar(const uint8_t *src, uint16_t *dst,
+  uint32_t n)
+{
+  uint32_t i;
+
+  for (i = 0; i + 1 < n; i += 2, src += 3) {
+    dst[i] = src[0] | ((0x0f & src[1]) << 8);
+    dst[i + 1] = (src[1] >> 4) | (src[2] << 4);
+  }
+  if (i < n) {
+    dst[i] = src[0] | ((0x0f & src[1]) << 8);
+  }
+}
+
+static void fat12_encode_scalar(const uint16_t *src, uint8_t *dst,
+  uint32_t n)
+{
+  uint32_t i;
+
+  for (i = 0; i + 1 < n; i += 2, dst += 3) {
+    dst[0] = (uint8_t)(0xff & src[i]);
+    dst[1] = (uint8_t)((0x0f & (src[i] >> 8)) | ((0x0f & src[i + 1]) << 4));
+    dst[2] = (uint8_t)(0xff & (src[i + 1] >> 4));
+  }
+  if (i < n) {
+    /* an odd entry at the end shares its second byte with the entry
+       that follows it, so keep that one's nibble */
+    dst[0] = (uint8_t)(0xff & src[i]);
+    dst[1] = (uint8_t)((0xf0 & dst[1]) | (0x0f & (src[i] >> 8)));
+  }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FAT12_HAVE_X86
+#include <immintrin.h>
+
+/* spread 12 packed bytes over eight 16-bit lanes: lane 2k gets bytes
+   3k,3k+1 and lane 2k+1 gets bytes 3k+1,3k+2 */
+#define FAT12_DECODE_SHUFFLE \
+  0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11
+/* gather the low three bytes of each 32-bit lane */
+#define FAT12_ENCODE_SHUFFLE \
+  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static inline __m128i fat12_unpack8(__m128i v, __m128i shuf)
+{
+  __m128i even, odd;
+
+  v = _mm_shuffle_epi8(v, shuf);
+  even = _mm_and_si128(v, _mm_set1_epi32(0x00000fff));
+  odd = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi32(0xffff0000));
+  return _mm_or_si128(even, odd);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i fat12_pack8(__m128i v, __m128i shuf)
+{
+  __m128i lo, hi;
+
+  /* each 32-bit lane holds an even entry and the odd one after it;
+     squeeze them into the low 24 bits, then drop the top bytes */
+  lo = _mm_and_si128(v, _mm_set1_epi32(0x00000fff));
+  hi = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi32(0x00fff000));
+  return _mm_shuffle_epi8(_mm_or_si128(lo, hi), shuf);
+}
+
+__attribute__((target("ssse3")))
+static void fat12_decode_ssse3(const uint8_t *src, uint16_t *dst,
+  uint32_t n)
+{
+  const __m128i shuf = _mm_setr_epi8(FAT12_DECODE_SHUFFLE);
+  uint32_t i = 0;
+
+  /* each step consumes 12 bytes but loads 16, so stop while there
+     are still 4 bytes of slack in the source */
+  for (; i + 8 <= n && (i / 2) * 3 + 16 <= (n * 3 + 1) / 2; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + (i / 2) * 3));
+    _mm_storeu_si128((__m128i *)(dst + i), fat12_unpack8(v, shuf));
+  }
+  fat12_decode_scalar(src + (i / 2) * 3, dst + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void fat12_encode_ssse3(const uint16_t *src, uint8_t *dst,
+  uint32_t n)
+{
+  const __m128i shuf = _mm_setr_epi8(FAT12_ENCODE_SHUFFLE);
+  uint32_t i = 0;
+
+  /* each step produces 12 bytes but stores 16; the next step (or the
+     scalar tail) overwrites the extra 4 */
+  for (; i + 8 <= n && (i / 2) * 3 + 16 <= (n / 2) * 3; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + (i / 2) * 3), fat12_pack8(v, shuf));
+  }
+  fat12_encode_scalar(src + i, dst + (i / 2) * 3, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fat12_decode_avx2(const uint8_t *src, uint16_t *dst,
+  uint32_t n)
+{
+  const __m256i shuf = _mm256_setr_epi8(FAT12_DECODE_SHUFFLE,
+    FAT12_DECODE_SHUFFLE);
+  uint32_t i = 0;
+
+  /* 24 bytes in, 16 entries out; the upper load reads 4 bytes past
+     the 24 we use */
+  for (; i + 16 <= n && (i / 2) * 3 + 28 <= (n * 3 + 1) / 2; i += 16) {
+    const uint8_t *p = src + (i / 2) * 3;
+    __m256i v, even, odd;
+
+    v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+      _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+    v = _mm256_shuffle_epi8(v, shuf);
+    even = _mm256_and_si256(v, _mm256_set1_epi32(0x00000fff));
+    odd = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+      _mm256_set1_epi32(0xffff0000));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(even, odd));
+  }
+  fat12_decode_ssse3(src + (i / 2) * 3, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fat12_encode_avx2(const uint16_t *src, uint8_t *dst,
+  uint32_t n)
+{
+  const __m256i shuf = _mm256_setr_epi8(FAT12_ENCODE_SHUFFLE,
+    FAT12_ENCODE_SHUFFLE);
+  uint32_t i = 0;
+
+  /* 16 entries in, 24 bytes out, written as two overlapping 16-byte
+     stores; the second one reaches 4 bytes past the 24 */
+  for (; i + 16 <= n && (i / 2) * 3 + 28 <= (n / 2) * 3; i += 16) {
+    uint8_t *p = dst + (i / 2) * 3;
+    __m256i v, lo, hi;
+
+    v = _mm256_loadu_si256((const __m256i *)(src + i));
+    lo = _mm256_and_si256(v, _mm256_set1_epi32(0x00000fff));
+    hi = _mm256_and_si256(_mm256_srli_epi32(v, 4),
+      _mm256_set1_epi32(0x00fff000));
+    v = _mm256_shuffle_epi8(_mm256_or_si256(lo, hi), shuf);
+    _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *)(p + 12), _mm256_extracti128_si256(v, 1));
+  }
+  fat12_encode_ssse3(src + i, dst + (i / 2) * 3, n - i);
+}
+#endif
+
+struct fat12_kernel {
+  const char *name;
+  void (*decode)(const uint8_t *src, uint16_t *dst, uint32_t n);
+  void (*encode)(const uint16_t *src, uint8_t *dst, uint32_t n);
+};
+
+/* widest first */
+static const struct fat12_kernel fat12_kernels[] = {
+#ifdef FAT12_HAVE_X86
+  { "avx2", fat12_decode_avx2, fat12_encode_avx2 },
+  { "ssse3", fat12_decode_ssse3, fat12_encode_ssse3 },
+#endif
+  { "scalar", fat12_decode_scalar, fat12_encode_scalar },
+};
+#define NUM_FAT12_KERNELS \
+  ((int)(sizeof(fat12_kernels) / sizeof(fat12_kernels[0])))
+
+/* the kernel in use, picked on first use.  Batch scans decode FATs
+   on several threads at once, so it is only read and written
+   atomically; threads that race to pick one all pick the same. */
+static const struct fat12_kernel *fat12_kernel;
+
+static int fat12_kernel_supported(const struct fat12_kernel *k)
+{
+#ifdef FAT12_HAVE_X86
+  __builtin_cpu_init();
+  if (strcmp(k->name, "avx2") == 0) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (strcmp(k->name, "ssse3") == 0) {
+    return __builtin_cpu_supports("ssse3");
+  }
+#endif
+  return TRUE;
+}
+
+static const struct fat12_kernel *fat12_select(void)
+{
+  const struct fat12_kernel *k;
+  int i;
+
+  k = __atomic_load_n(&fat12_kernel, __ATOMIC_ACQUIRE);
+  if (k == NULL) {
+    for (i = 0; i < NUM_FAT12_KERNELS; i++) {
+      if (fat12_kernel_supported(&fat12_kernels[i])) {
+        k = &fat12_kernels[i];
+        break;
+      }
+    }
+    __atomic_store_n(&fat12_kernel, k, __ATOMIC_RELEASE);
+  }
+  return k;
+}
+
+/* fat12_decode unpacks n entries from the packed FAT at src into dst.
+   src must hold (3 * n + 1) / 2 bytes. */
+void fat12_decode(const uint8_t *src, uint16_t *dst, uint32_t n)
+{
+  fat12_select()->decode(src, dst, n);
+}
+
+/* fat12_encode packs n entries from src into the packed FAT at dst.
+   Only the low 12 bits of each entry are used.  If n is odd, the
+   nibble belonging to the entry after the last is left untouched. */
+void fat12_encode(const uint16_t *src, uint8_t *dst, uint32_t n)
+{
+  fat12_select()->encode(src, dst, n);
+}
+
+/* fat12_use_kernel forces a particular kernel ("avx2", "ssse3" or
+   "scalar"), for benchmarking.  Returns FALSE if the kernel doesn't
+   exist or this CPU can't run it. */
+int fat12_use_kernel(const char *name)
+{
+  int i;
+
+  for (i = 0; i < NUM_FAT12_KERNELS; i++) {
+    if (strcmp(fat12_kernels[i].name, name) == 0) {
+      if (!fat12_kernel_supported(&fat12_kernels[i])) {
+        return FALSE;
+      }
+      __atomic_store_n(&fat12_kernel, &fat12_kernels[i], __ATOMIC_RELEASE);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* fat12_kernel_name returns the name of the kernel in use */
+const char *fat12_kernel_name(void)
+{
+  return fat12_select()->name;
+}
+
+/* load_fat_table unpacks the whole of the first FAT into a flat array
+   of 32-bit entries, one per cluster in the data area, whatever the
+   FAT type.  Reserved, bad and end of file markers are widened to
+   their FAT-32 values, so nothing else needs to know the FAT type */
+struct fat_table *load_fat_table(struct image_io *io, struct bpb710* bpb)
+{
+  return load_fat_copy(io, bpb, 0);
+}
+
+/* load_fat_copy is load_fat_table from another copy of the FAT (0 for
+   the first), for when the first can't be trusted */
+struct fat_table *load_fat_copy(struct image_io *io, struct bpb710* bpb,
+  int copy)
+{
+  struct fat_table *fat;
+  uint8_t *fat_buf;
+  uint64_t fsinfo_offset;
+  uint16_t *packed;
+  uint64_t fat_bytes, fat_capacity;
+  uint32_t i, next_free;
+
+  fat = malloc(sizeof(struct fat_table));
+  if (fat == NULL) {
+    fprintf(stderr, "Out of memory loading the FAT\n");
+    exit(1);
+  }
+  fat->type = bpb_geometry(bpb)->type;
+
+  /* the FAT can describe more clusters than the disk actually has,
+     so size the table from the data area, capped by what fits in
+     the FAT itself */
+  fat->nclusters = CLUST_FIRST + data_sectors(bpb) / bpb->bpbSecPerClust;
+  fat_bytes = (uint64_t)bpb->bpbBigFATsecs * bpb->bpbBytesPerSec;
+  switch (fat->type) {
+  case 12:
+    fat_capacity = fat_bytes * 2 / 3;
+    break;
+  case 16:
+    fat_capacity = fat_bytes / 2;
+    break;
+  default:
+    fat_capacity = fat_bytes / 4;
+    if (fat_capacity > (FAT32_MASK & CLUST_RSRVD)) {
+      /* cluster numbers above this are markers */
+      fat_capacity = FAT32_MASK & CLUST_RSRVD;
+    }
+    break;
+  }
+  if (fat->nclusters > fat_capacity) {
+    fat->nclusters = fat_capacity;
+  }
+
+  fat->entries = malloc(fat->nclusters * sizeof(uint32_t));
+  fat->dirty = calloc((fat->nclusters + 7) / 8, 1);
+  if (fat->entries == NULL || fat->dirty == NULL) {
+    fprintf(stderr, "Out of memory loading the FAT\n");
+    exit(1);
+  }
+  fat->ndirty = 0;
+  fat->dirty_first = (fat->nclusters + 7) / 8;
+  fat->dirty_end = 0;
+  fat->io = io;
+  fat->bpb = bpb;
+  fat->copy = copy;
+  fat->track_writes = FALSE;
+  fat->index = NULL;
+  fat->writes = NULL;
+  fat->nwrites = 0;
+  fat->writes_size = 0;
+
+  fat_buf = fat_copy_region(io, bpb, copy);
+  switch (fat->type) {
+  case 12:
+    packed = malloc(fat->nclusters * sizeof(uint16_t));
+    if (packed == NULL) {
+      fprintf(stderr, "Out of memory loading the FAT\n");
+      exit(1);
+    }
+    fat12_decode(fat_buf, packed, fat->nclusters);
+    for (i = 0; i < fat->nclusters; i++) {
+      fat->entries[i] = fat_widen(packed[i], FAT12_MASK);
+    }
+    free(packed);
+    break;
+  case 16:
+    for (i = 0; i < fat->nclusters; i++) {
+      fat->entries[i] = fat_widen(getushort(fat_buf + 2 * (size_t)i), FAT16_MASK);
+    }
+    break;
+  default:
+    for (i = 0; i < fat->nclusters; i++) {
+      fat->entries[i] = getulong(fat_buf + 4 * (size_t)i) & FAT32_MASK;
+    }
+    break;
+  }
+
+  /* build the free map in the same pass as the table, so allocation
+     never has to look at the FAT itself */
+  fat->free_map = calloc((fat->nclusters + 63) / 64, sizeof(uint64_t));
+  if (fat->free_map == NULL) {
+    fprintf(stderr, "Out of memory loading the FAT\n");
+    exit(1);
+  }
+  fat->nfree = 0;
+  for (i = CLUST_FIRST; i < fat->nclusters; i++) {
+    if (fat->entries[i] == CLUST_FREE) {
+      fat->free_map[i / 64] |= (uint64_t)1 << (i % 64);
+      fat->nfree++;
+    }
+  }
+  fat->free_hint = CLUST_FIRST;
+  fat->max_chain = fat->nclusters;
+
+  /* FAT-32 keeps a free cluster count and a next free cluster hint in
+     the FSInfo sector.  We've just counted for ourselves, so the
+     count is only kept to see whether it was right */
+  fat->fsinfo_offset = 0;
+  fat->fsinfo_free = FSINFO_UNKNOWN;
+  if (fat->type == 32 && bpb->bpbFSInfo != 0
+    && bpb->bpbFSInfo < bpb->bpbResSectors && bpb->bpbBytesPerSec >= 512) {
+    struct fsinfo *fsinfo;
+    fsinfo_offset = (uint64_t)bpb->bpbFSInfo * bpb->bpbBytesPerSec;
+    fsinfo = (struct fsinfo *)io_get(io, fsinfo_offset, bpb->bpbBytesPerSec);
+    if (memcmp(fsinfo->fsisig1, "RRaA", 4) == 0
+      && memcmp(fsinfo->fsisig2, "rrAa", 4) == 0) {
+      fat->fsinfo_offset = fsinfo_offset;
+      fat->fsinfo_free = getulong(fsinfo->fsinfree);
+      next_free = getulong(fsinfo->fsinxtfree);
+      if (next_free >= CLUST_FIRST && next_free < fat->nclusters
+        && next_free - CLUST_FIRST < fat->nclusters - fat->nfree) {
+        /* it can't be right if there aren't that many clusters in use
+           below it, but if there are, the search may as well start
+           there */
+        fat->free_hint = next_free;
+      }
+    }
+  }
+  return fat;
+}
+
+/* note_write is fat_note_write for the length bytes at offset in the
+   image.  A write that follows on from the last one just extends it,
+   so flushing a run of FAT entries costs one range */
+static void note_write(struct fat_table *fat, uint64_t offset,
+  size_t length)
+{
+  struct image_range *last;
+
+  if (!fat->track_writes || length == 0) {
+    return;
+  }
+  if (fat->nwrites > 0) {
+    last = &fat->writes[fat->nwrites - 1];
+    if (offset >= last->offset && offset <= last->offset + last->length) {
+      if (offset + length > last->offset + last->length) {
+        last->length = offset + length - last->offset;
+      }
+      return;
+    }
+  }
+  if (fat->nwrites == fat->writes_size) {
+    fat->writes_size = fat->writes_size ? fat->writes_size * 2 : 64;
+    fat->writes = realloc(fat->writes,
+      fat->writes_size * sizeof(struct image_range));
+    if (fat->writes == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  fat->writes[fat->nwrites].offset = offset;
+  fat->writes[fat->nwrites].length = length;
+  fat->nwrites++;
+}
+
+/* fat_entry_offset returns how many bytes the entries before cluster
+   take up in a copy of the FAT, rounded up to a whole byte */
+static size_t fat_entry_offset(struct fat_table *fat, uint32_t cluster)
+{
+  return ((size_t)fat->type * cluster + 7) / 8;
+}
+
+/* how many 8-entry groups flush_copy re-encodes at a time */
+#define FLUSH_GROUPS 512
+
+/* flush_copy writes every entry changed by fat_set since the last
+   flush into one copy of the FAT.  Runs of changed entries are
+   re-encoded up to FLUSH_GROUPS 8-entry groups at a time, and groups
+   always start on a byte boundary, even in a FAT-12 table.  Each piece
+   goes to the image with io_write, which keeps any cached part of the
+   FAT in step.  Only the groups between dirty_first and dirty_end are
+   looked at, so flushing a few changes is cheap however big the FAT
+   is. */
+static void flush_copy(struct fat_table *fat, int copy)
+{
+  uint16_t packed[FLUSH_GROUPS * 8];
+  uint8_t buf[FLUSH_GROUPS * 32];
+  uint64_t offset;
+  uint32_t g, start, end, i;
+  size_t length;
+
+  g = fat->dirty_first;
+  while (g < fat->dirty_end) {
+    if (fat->dirty[g] == 0) {
+      g++;
+      continue;
+    }
+    start = g * 8;
+    do {
+      g++;
+    } while (g < fat->dirty_end && fat->dirty[g] != 0
+      && g * 8 - start < FLUSH_GROUPS * 8);
+    end = g * 8 > fat->nclusters ? fat->nclusters : g * 8;
+    offset = fat_copy_offset(fat->bpb, copy) + fat_entry_offset(fat, start);
+    length = fat_entry_offset(fat, end) - fat_entry_offset(fat, start);
+
+    /* FAT-32 entries keep their top four bits, and an odd FAT-12 entry
+       at the very end shares its last byte with the padding after it,
+       so those need what's there already */
+    if ((fat->type == 32 || (fat->type == 12 && (end - start) % 2 != 0))
+      && io_read(fat->io, offset, buf, length) < 0) {
+      fprintf(stderr, "Cannot read the FAT: %s\n", strerror(errno));
+      exit(1);
+    }
+    switch (fat->type) {
+    case 12:
+      for (i = start; i < end; i++) {
+        packed[i - start] = fat->entries[i] & FAT12_MASK;
+      }
+      fat12_encode(packed, buf, end - start);
+      break;
+    case 16:
+      for (i = start; i < end; i++) {
+        putushort(buf + 2 * (i - start), fat->entries[i] & FAT16_MASK);
+      }
+      break;
+    default:
+      for (i = start; i < end; i++) {
+        uint8_t *p = buf + 4 * (i - start);
+        putulong(p, (getulong(p) & ~FAT32_MASK) | fat->entries[i]);
+      }
+      break;
+    }
+    note_write(fat, offset, length);
+    if (io_write(fat->io, offset, buf, length) < 0) {
+      fprintf(stderr, "Cannot write the FAT: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+}
+
+/* flush_fat_table writes every entry changed by fat_set since the last
+   flush back into the FAT in the image, and brings the FSInfo sector
+   up to date.  The same runs go to every copy of the FAT, one copy
+   after another, so the mirrors stay in step with the copy the table
+   came from. */
+void flush_fat_table(struct fat_table *fat)
+{
+  struct fsinfo *fsinfo;
+  int copy;
+
+  if (fat->fsinfo_offset != 0) {
+    fsinfo = (struct fsinfo *)io_get(fat->io, fat->fsinfo_offset,
+      fat->bpb->bpbBytesPerSec);
+    if (fat->ndirty > 0 || getulong(fsinfo->fsinfree) != fat->nfree) {
+      fat_note_write(fat, fsinfo->fsinfree, 4);
+      putulong(fsinfo->fsinfree, fat->nfree);
+      io_dirty(fat->io, fsinfo->fsinfree, 4);
+      fat_note_write(fat, fsinfo->fsinxtfree, 4);
+      putulong(fsinfo->fsinxtfree, fat->free_hint);
+      io_dirty(fat->io, fsinfo->fsinxtfree, 4);
+    }
+  }
+  if (fat->ndirty == 0) {
+    return;
+  }
+  flush_copy(fat, fat->copy);
+  for (copy = 0; copy < fat->bpb->bpbFATs; copy++) {
+    if (copy != fat->copy) {
+      flush_copy(fat, copy);
+    }
+  }
+  memset(fat->dirty + fat->dirty_first, 0,
+    fat->dirty_end - fat->dirty_first);
+  fat->ndirty = 0;
+  fat->dirty_first = (fat->nclusters + 7) / 8;
+  fat->dirty_end = 0;
+}
+
+/* how many entries fat_compare_copies compares with one memcmp before
+   looking at them one by one; even, so a FAT-12 group starts on a byte */
+#define FAT_COMPARE_ENTRIES 512
+
+/* raw_entry returns entry i of a FAT in the image, without widening
+   the markers, and without the reserved top bits of a FAT-32 entry */
+static uint32_t raw_entry(const uint8_t *fat_buf, int type, uint32_t i)
+{
+  const uint8_t *p;
+
+  switch (type) {
+  case 32:
+    return getulong(fat_buf + 4 * (size_t)i) & FAT32_MASK;
+  case 16:
+    return getushort(fat_buf + 2 * (size_t)i);
+  }
+  p = fat_buf + 3 * (size_t)(i / 2);
+  if (i % 2 == 0) {
+    return p[0] | (p[1] & 0x0f) << 8;
+  }
+  return p[1] >> 4 | p[2] << 4;
+}
+
+/* entry_bytes returns where in a FAT entry i starts, rounded down to
+   a byte */
+static size_t entry_bytes(int type, uint32_t i)
+{
+  return type == 12 ? 3 * (size_t)i / 2 : (size_t)i * (type / 8);
+}
+
+/* fat_compare_copies compares copy (0 for the first) of the FAT in the
+   image with the one the table was loaded from, and returns how many
+   runs of entries differ, with the runs in a malloced list in
+   *ranges.  It goes a block of entries at a time with memcmp, and only
+   looks at the entries in a block that differs.  Returns 0 with
+   *ranges NULL if they're the same. */
+uint32_t fat_compare_copies(struct fat_table *fat, int copy,
+  struct extent **ranges)
+{
+  size_t fat_size = (size_t)fat->bpb->bpbBigFATsecs
+    * fat->bpb->bpbBytesPerSec;
+  uint8_t *ours, *theirs, *ours_buf = NULL, *theirs_buf = NULL;
+  uint32_t i, j, end, nranges = 0, size = 0;
+  size_t from, to;
+
+  *ranges = NULL;
+  if (fat->io->map != NULL) {
+    ours = fat->io->map + fat_copy_offset(fat->bpb, fat->copy);
+    theirs = fat->io->map + fat_copy_offset(fat->bpb, copy);
+  } else {
+    /* the cache can't hold on to two blocks at once, so read both
+       copies whole.  io_read sees anything not yet written back */
+    ours = ours_buf = malloc(fat_size);
+    theirs = theirs_buf = malloc(fat_size);
+    if (ours_buf == NULL || theirs_buf == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    if (io_read(fat->io, fat_copy_offset(fat->bpb, fat->copy), ours,
+        fat_size) < 0
+      || io_read(fat->io, fat_copy_offset(fat->bpb, copy), theirs,
+        fat_size) < 0) {
+      fprintf(stderr, "Cannot read the FAT: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < fat->nclusters; i = end) {
+    end = i + FAT_COMPARE_ENTRIES;
+    if (end > fat->nclusters) {
+      end = fat->nclusters;
+    }
+    from = entry_bytes(fat->type, i);
+    to = fat->type == 12 ? (3 * (size_t)end + 1) / 2
+      : entry_bytes(fat->type, end);
+    if (memcmp(ours + from, theirs + from, to - from) == 0) {
+      continue;
+    }
+    for (j = i; j < end; j++) {
+      if (raw_entry(ours, fat->type, j) == raw_entry(theirs, fat->type, j)) {
+        continue;
+      }
+      if (nranges > 0
+        && (*ranges)[nranges - 1].start + (*ranges)[nranges - 1].length == j) {
+        (*ranges)[nranges - 1].length++;
+        continue;
+      }
+      if (nranges == size) {
+        size = size == 0 ? 16 : size * 2;
+        *ranges = realloc(*ranges, size * sizeof(struct extent));
+        if (*ranges == NULL) {
+          fprintf(stderr, "Out of memory\n");
+          exit(1);
+        }
+      }
+      (*ranges)[nranges].start = j;
+      (*ranges)[nranges].length = 1;
+      nranges++;
+    }
+  }
+  free(ours_buf);
+  free(theirs_buf);
+  return nranges;
+}
+
+/* free_fat_table releases the decoded FAT.  Any unflushed changes are
+   lost, so callers that modify the FAT must flush it first */
+void free_fat_table(struct fat_table *fat)
+{
+  dir_index_free(fat);
+  free(fat->writes);
+  free(fat->free_map);
+  free(fat->entries);
+  free(fat->dirty);
+  free(fat);
+}
+
+/* fat_note_write records that length bytes at addr in the image are
+   about to be written, if the FAT's owner asked for writes to be
+   tracked */
+void fat_note_write(struct fat_table *fat, const void *addr, size_t length)
+{
+  if (fat->track_writes) {
+    note_write(fat, io_offset(fat->io, addr), length);
+  }
+}
+
+/* fat_alloc_cluster takes the lowest-numbered free cluster, marks it
+   as the end of a file, and returns it.  Returns 0 if the disk is
+   full.  The free map is searched a 64-bit word at a time starting
+   from free_hint, so filling the disk costs linear time overall. */
+uint32_t fat_alloc_cluster(struct fat_table *fat)
+{
+  uint32_t w, nwords, cluster;
+
+  if (fat->nfree == 0) {
+    return 0;
+  }
+  nwords = (fat->nclusters + 63) / 64;
+  for (w = fat->free_hint / 64; w < nwords; w++) {
+    uint64_t bits = fat->free_map[w];
+    if (w == fat->free_hint / 64) {
+      /* ignore anything below the hint in its own word */
+      bits &= ~(uint64_t)0 << (fat->free_hint % 64);
+    }
+    if (bits != 0) {
+      cluster = w * 64 + __builtin_ctzll(bits);
+      fat->free_hint = cluster + 1;
+      fat_set(fat, cluster, FAT32_MASK & CLUST_EOFS);
+      return cluster;
+    }
+  }
+  /* nfree said there was one, so the hint was wrong */
+  if (fat->free_hint > CLUST_FIRST) {
+    fat->free_hint = CLUST_FIRST;
+    return fat_alloc_cluster(fat);
+  }
+  return 0;
+}
+
+/* next_free_bit returns the first cluster at or after from whose bit
+   in the free map equals free (TRUE or FALSE), or nclusters if there
+   isn't one */
+static uint32_t next_free_bit(struct fat_table *fat, uint32_t from, int free)
+{
+  uint32_t w, nwords = (fat->nclusters + 63) / 64;
+  uint64_t bits;
+
+  if (from >= fat->nclusters) {
+    return fat->nclusters;
+  }
+  w = from / 64;
+  bits = free ? fat->free_map[w] : ~fat->free_map[w];
+  bits &= ~(uint64_t)0 << (from % 64);
+  while (bits == 0) {
+    if (++w == nwords) {
+      return fat->nclusters;
+    }
+    bits = free ? fat->free_map[w] : ~fat->free_map[w];
+  }
+  from = w * 64 + __builtin_ctzll(bits);
+  return from < fat->nclusters ? from : fat->nclusters;
+}
+
+/* fat_free_extents returns a malloced list of every run of free
+   clusters, in cluster order, and stores how many there are in
+   *count */
+struct extent *fat_free_extents(struct fat_table *fat, uint32_t *count)
+{
+  struct extent *runs = NULL;
+  uint32_t n = 0, size = 0, start, end;
+
+  start = next_free_bit(fat, CLUST_FIRST, TRUE);
+  while (start < fat->nclusters) {
+    end = next_free_bit(fat, start, FALSE);
+    if (n == size) {
+      size = size ? size * 2 : 16;
+      runs = realloc(runs, size * sizeof(struct extent));
+      if (runs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+    }
+    runs[n].start = start;
+    runs[n].length = end - start;
+    n++;
+    start = next_free_bit(fat, end, TRUE);
+  }
+  *count = n;
+  return runs;
+}
+
+static int compare_extent_length(const void *a, const void *b)
+{
+  const struct extent *x = a, *y = b;
+  if (x->length != y->length) {
+    return x->length > y->length ? -1 : 1;
+  }
+  return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+static int compare_extent_start(const void *a, const void *b)
+{
+  const struct extent *x = a, *y = b;
+  return x->start < y->start ? -1 : (x->start > y->start);
 }
 
+/* fat_alloc_chain allocates count clusters as a single chain, links
+   them in the FAT, and returns the first one.  It takes the smallest
+   free run the whole chain fits in; if there isn't one, it takes the
+   largest runs first, so the chain ends up in as few fragments as
+   possible, and then the smallest run that fits what's left.  The
+   number of fragments used is stored in *fragments if it isn't NULL.
+   Returns 0, allocating nothing, if there isn't enough free space. */
+uint32_t fat_alloc_chain(struct fat_table *fat, uint32_t count,
+  uint32_t *fragments)
+{
+  struct extent *runs, *best = NULL;
+  uint32_t nruns, nused = 0, left = count, i, j;
+  uint32_t start = 0, prev = 0;
+
+  if (fragments != NULL) {
+    *fragments = 0;
+  }
+  if (count == 0 || count > fat->nfree) {
+    return 0;
+  }
+
+  runs = fat_free_extents(fat, &nruns);
+
+  /* best fit: the smallest run that holds everything */
+  for (i = 0; i < nruns; i++) {
+    if (runs[i].length >= count
+      && (best == NULL || runs[i].length < best->length)) {
+      best = &runs[i];
+    }
+  }
+  if (best != NULL) {
+    runs[0].start = best->start;
+    runs[0].length = count;
+    nused = 1;
+  } else {
+    /* fewest fragments: whole runs, biggest first, then a best fit
+       for the remainder among the runs that are left */
+    qsort(runs, nruns, sizeof(struct extent), compare_extent_length);
+    for (i = 0; left > 0; i++) {
+      if (runs[i].length >= left) {
+        for (j = i; j + 1 < nruns && runs[j + 1].length >= left; j++)
+          ;
+        runs[j].length = left;
+        runs[nused++] = runs[j];
+        left = 0;
+      } else {
+        left -= runs[i].length;
+        runs[nused++] = runs[i];
+      }
+    }
+    /* lay the chain out in disk order */
+    qsort(runs, nused, sizeof(struct extent), compare_extent_start);
+  }
+
+  for (i = 0; i < nused; i++) {
+    for (j = runs[i].start; j < runs[i].start + runs[i].length; j++) {
+      if (prev == 0) {
+        start = j;
+      } else {
+        fat_set(fat, prev, j);
+      }
+      prev = j;
+    }
+  }
+  fat_set(fat, prev, FAT32_MASK & CLUST_EOFS);
+  if (fragments != NULL) {
+    *fragments = nused;
+  }
+  free(runs);
+  return start;
+}
+
+/* count_fragments returns how many runs of consecutive clusters the
+   chain starting at cluster is made of */
+uint32_t count_fragments(struct fat_table *fat, uint32_t cluster)
+{
+  uint32_t fragments = 0, steps = 0;
+  uint32_t next;
+
+  if (cluster < CLUST_FIRST || cluster >= fat->nclusters) {
+    return 0;
+  }
+  fragments = 1;
+  while (steps++ < fat->max_chain) {
+    next = fat_get(fat, cluster);
+    if (is_end_of_file(next) || next < CLUST_FIRST
+      || next >= fat->nclusters) {
+      break;
+    }
+    if (next != cluster + 1) {
+      fragments++;
+    }
+    cluster = next;
+  }
+  return fragments;
+}
 
 /* is_end_of_file returns true if the FAT entry for cluster indicates
    this is the last cluster in a file */
-int is_end_of_file(uint16_t cluster) {
-  if (cluster >= (FAT12_MASK & CLUST_EOFS)
-    && cluster <= (FAT12_MASK & CLUST_EOFE)) {
+int is_end_of_file(uint32_t cluster) {
+  if (cluster >= (FAT32_MASK & CLUST_EOFS)
+    && cluster <= (FAT32_MASK & CLUST_EOFE)) {
     return TRUE;
   } else {
     return FALSE;
@@ -205,31 +1237,669 @@ int is_end_of_file(uint16_t cluster) {
 }
 
 
-/* root_dir_addr returns the address in the mmapped disk image for the
-   start of the root directory, as indicated in the boot sector */
-uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
+/* root_dir_size returns how many bytes the FAT-12/16 root directory
+   area takes up */
+static size_t root_dir_size(struct bpb710 *bpb)
+{
+  return bpb->bpbRootDirEnts * sizeof(struct direntry);
+}
+
+/* root_dir_addr returns the start of the root directory area, as
+   indicated in the boot sector.  On FAT-32 the area is empty, and
+   this is where the data starts */
+uint8_t *root_dir_addr(struct image_io *io, struct bpb710* bpb)
+{
+  return io_get(io, bpb_geometry(bpb)->root_offset, root_dir_size(bpb));
+}
+
+/* cluster_to_addr returns the cluster (or the FAT-12/16 root
+   directory, for MSDOSFSROOT) from the image */
+uint8_t *cluster_to_addr(uint32_t cluster, struct image_io *io,
+  struct bpb710* bpb)
+{
+  const struct fat_geometry *geom = bpb_geometry(bpb);
+
+  if (cluster == MSDOSFSROOT && geom->root_cluster == MSDOSFSROOT) {
+    return io_get(io, geom->root_offset, root_dir_size(bpb));
+  }
+  return io_get(io, cluster_offset(cluster, bpb), geom->cluster_size);
+}
+
+/* dir_iter_slots returns the slots of the cluster or area the
+   iterator is in.  They're fetched afresh each time, since anything
+   else the caller reads in between may have pushed them out of the
+   cache */
+static struct direntry *dir_iter_slots(struct dir_iter *it,
+  struct image_io *io, struct bpb710 *bpb)
+{
+  size_t length = it->cluster == MSDOSFSROOT ? root_dir_size(bpb)
+    : bpb_geometry(bpb)->cluster_size;
+
+  return (struct direntry *)io_get(io, it->offset, length);
+}
+
+/* dir_iter_start gets ready to walk the directory starting at
+   cluster (MSDOSFSROOT for the root directory) */
+void dir_iter_start(struct dir_iter *it, uint32_t cluster,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat)
+{
+  const struct fat_geometry *geom = bpb_geometry(bpb);
+
+  if (cluster == MSDOSFSROOT) {
+    /* the FAT-32 root directory is just a chain like any other */
+    cluster = geom->root_cluster;
+  }
+  it->cluster = cluster;
+  it->steps = 0;
+  it->done = FALSE;
+  if (cluster == MSDOSFSROOT) {
+    it->left = bpb->bpbRootDirEnts;
+  } else if (cluster < CLUST_FIRST || cluster >= fat->nclusters) {
+    /* not a cluster we can read */
+    it->left = 0;
+    it->done = TRUE;
+  } else {
+    it->left = geom->cluster_size / sizeof(struct direntry);
+  }
+  it->offset = cluster_offset(cluster, bpb);
+  it->slot = 0;
+}
+
+/* dir_iter_next returns the next slot in the directory, including
+   deleted ones, or NULL once it reaches the first never-used slot or
+   runs out of directory */
+struct direntry *dir_iter_next(struct dir_iter *it, struct image_io *io,
+  struct bpb710* bpb, struct fat_table *fat)
+{
+  struct direntry *dirent;
+  uint32_t next;
+
+  while (!it->done && it->left == 0) {
+    /* move on to the next cluster of the directory */
+    if (it->cluster == MSDOSFSROOT) {
+      it->done = TRUE;
+      break;
+    }
+    next = fat_get(fat, it->cluster);
+    if (is_end_of_file(next) || next < CLUST_FIRST
+      || next >= fat->nclusters || ++it->steps >= fat->max_chain) {
+      it->done = TRUE;
+      break;
+    }
+    it->cluster = next;
+    it->offset = cluster_offset(next, bpb);
+    it->slot = 0;
+    it->left = bpb_geometry(bpb)->cluster_size / sizeof(struct direntry);
+  }
+  if (it->done) {
+    return NULL;
+  }
+
+  dirent = dir_iter_slots(it, io, bpb) + it->slot;
+  if (dirent->deName[0] == SLOT_EMPTY) {
+    it->done = TRUE;
+    return NULL;
+  }
+  it->slot++;
+  it->left--;
+  return dirent;
+}
+
+/* dir_free_slot returns the first slot in the directory at cluster
+   that a new entry can go in: a deleted one, or else the never-used
+   one that ends the directory, in which case the slot after it is
+   cleared (if it's in the same cluster) so the directory still ends
+   after the new entry.  Returns NULL if the directory is full.  The
+   slot is only good until the image is next read, and whoever fills
+   it in has to io_dirty it. */
+struct direntry *dir_free_slot(uint32_t cluster, struct image_io *io,
+  struct bpb710* bpb, struct fat_table *fat)
+{
+  struct dir_iter it;
+  struct direntry *dirent;
+
+  dir_iter_start(&it, cluster, io, bpb, fat);
+  while ((dirent = dir_iter_next(&it, io, bpb, fat)) != NULL) {
+    if (dirent->deName[0] == SLOT_DELETED) {
+      return dirent;
+    }
+  }
+  if (it.left == 0) {
+    /* we ran out of directory rather than finding the end */
+    return NULL;
+  }
+  dirent = dir_iter_slots(&it, io, bpb) + it.slot;
+  if (it.left > 1) {
+    fat_note_write(fat, dirent + 1, sizeof(struct direntry));
+    memset(dirent + 1, 0, sizeof(struct direntry));
+    io_dirty(io, (uint8_t *)(dirent + 1), sizeof(struct direntry));
+  }
+  return dirent;
+}
+
+/* dir_grow adds a cleared cluster to the end of the directory at
+   cluster, for when dir_free_slot finds it full, and returns its first
+   slot.  Returns NULL if the directory can't grow (it's the FAT-12/16
+   root directory, or its chain is broken) or there's no free cluster.
+   The slot is only good until the image is next read. */
+struct direntry *dir_grow(uint32_t cluster, struct image_io *io,
+  struct bpb710* bpb, struct fat_table *fat)
 {
-  uint32_t offset;
-  offset =
-  (bpb->bpbBytesPerSec
-    * (bpb->bpbResSectors + (bpb->bpbFATs * bpb->bpbFATsecs)));
-  return image_buf + offset;
+  const struct fat_geometry *geom = bpb_geometry(bpb);
+  struct direntry *dirent;
+  uint32_t last, next, added, steps = 0;
+
+  if (cluster == MSDOSFSROOT) {
+    cluster = geom->root_cluster;
+  }
+  if (cluster < CLUST_FIRST || cluster >= fat->nclusters) {
+    return NULL;
+  }
+  last = cluster;
+  while (!is_end_of_file(next = fat_get(fat, last))) {
+    if (next < CLUST_FIRST || next >= fat->nclusters
+      || ++steps >= fat->max_chain) {
+      /* leave a broken directory for dos_scandisk */
+      return NULL;
+    }
+    last = next;
+  }
+
+  added = fat_alloc_cluster(fat);
+  if (added == 0) {
+    return NULL;
+  }
+  fat_set(fat, last, added);
+
+  /* every slot is never-used, so the directory now ends in the first */
+  dirent = (struct direntry *)io_get(io, cluster_offset(added, bpb),
+    geom->cluster_size);
+  fat_note_write(fat, dirent, geom->cluster_size);
+  memset(dirent, 0, geom->cluster_size);
+  io_dirty(io, (uint8_t *)dirent, geom->cluster_size);
+  return dirent;
 }
 
-/* cluster_to_addr returns the memory location where the memory mapped
-   cluster actually starts */
+/* walk_seen notes in the walk that the directory at cluster has been
+   walked, and returns whether it had been already.  A number that
+   isn't a cluster at all reads as an empty directory, so it's never
+   counted */
+static int walk_seen(struct tree_walk *walk, uint32_t cluster)
+{
+  uint64_t bit;
 
-uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf,
-  struct bpb33* bpb)
+  if (cluster == MSDOSFSROOT) {
+    cluster = bpb_geometry(walk->bpb)->root_cluster;
+  }
+  if (cluster >= walk->fat->nclusters
+    || (cluster != MSDOSFSROOT && cluster < CLUST_FIRST)) {
+    return FALSE;
+  }
+  bit = (uint64_t)1 << (cluster % 64);
+  if ((walk->walked[cluster / 64] & bit) != 0) {
+    return TRUE;
+  }
+  walk->walked[cluster / 64] |= bit;
+  return FALSE;
+}
+
+/* tree_walk_start gets ready to walk the tree below the directory at
+   cluster, going at most max_depth directories further down */
+void tree_walk_start(struct tree_walk *walk, uint32_t cluster,
+  uint32_t max_depth, struct image_io *io, struct bpb710* bpb,
+  struct fat_table *fat)
 {
-  uint8_t *p;
-  p = root_dir_addr(image_buf, bpb);
-  if (cluster != MSDOSFSROOT) {
-  /* move to the end of the root directory */
-    p += bpb->bpbRootDirEnts * sizeof(struct direntry);
-  /* move forward the right number of clusters */
-    p += bpb->bpbBytesPerSec * bpb->bpbSecPerClust
-      * (cluster - CLUST_FIRST);
+  walk->io = io;
+  walk->bpb = bpb;
+  walk->fat = fat;
+  walk->max_depth = max_depth;
+  walk->size = 8;
+  walk->stack = malloc(walk->size * sizeof(struct dir_iter));
+  walk->walked = calloc(fat->nclusters / 64 + 1, sizeof(uint64_t));
+  if (walk->stack == NULL || walk->walked == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  walk->depth = 1;
+  walk_seen(walk, cluster);
+  dir_iter_start(&walk->stack[0], cluster, io, bpb, fat);
+}
+
+/* tree_walk_next returns the next slot in the tree, in the same order
+   a recursive walk would visit them, or NULL when the walk is over.
+   The slot is walk->depth - 1 directories below the start. */
+struct direntry *tree_walk_next(struct tree_walk *walk)
+{
+  struct direntry *dirent;
+
+  while (walk->depth > 0) {
+    dirent = dir_iter_next(&walk->stack[walk->depth - 1],
+      walk->io, walk->bpb, walk->fat);
+    if (dirent != NULL) {
+      return dirent;
+    }
+    /* finished this directory - carry on with its parent */
+    walk->depth--;
+  }
+  return NULL;
+}
+
+/* tree_walk_descend makes the walk go into the directory at cluster
+   (normally the one tree_walk_next just returned) before carrying on
+   with the rest of the current one.  Returns WALK_DESCENDED, or
+   doesn't descend and returns WALK_TOO_DEEP if that would go deeper
+   than max_depth, or WALK_LOOP if the walk has been through the
+   directory already (it's an ancestor of itself, or another entry
+   leads to it too). */
+int tree_walk_descend(struct tree_walk *walk, uint32_t cluster)
+{
+  if (walk->depth > walk->max_depth) {
+    return WALK_TOO_DEEP;
+  }
+  if (walk_seen(walk, cluster)) {
+    return WALK_LOOP;
+  }
+  if (walk->depth == walk->size) {
+    walk->size *= 2;
+    walk->stack = realloc(walk->stack, walk->size * sizeof(struct dir_iter));
+    if (walk->stack == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  dir_iter_start(&walk->stack[walk->depth++], cluster,
+    walk->io, walk->bpb, walk->fat);
+  return WALK_DESCENDED;
+}
+
+void tree_walk_end(struct tree_walk *walk)
+{
+  free(walk->stack);
+  free(walk->walked);
+  walk->stack = NULL;
+  walk->walked = NULL;
+}
+
+/* get_name retrieves the filename from a directory entry */
+void get_name(char *fullname, struct direntry *dirent)
+{
+  char name[9];
+  char extension[4];
+  int i;
+
+  name[8] = ' ';
+  extension[3] = ' ';
+  memcpy(name, &(dirent->deName[0]), 8);
+  memcpy(extension, dirent->deExtension, 3);
+
+  /* names are space padded - remove the padding */
+  for (i = 8; i > 0; i--) {
+    if (name[i] == ' ')
+      name[i] = '\0';
+    else
+      break;
+  }
+
+  /* extensions aren't normally space padded - but remove the
+     padding anyway if it's there */
+  for (i = 3; i > 0; i--) {
+    if (extension[i] == ' ')
+      extension[i] = '\0';
+    else
+      break;
+  }
+  fullname[0] = '\0';
+  strcat(fullname, name);
+
+  /* append the extension if it's not a directory */
+  if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+    strcat(fullname, ".");
+    strcat(fullname, extension);
+  }
+}
+
+/* how many buckets dir_index_start gives the index to begin with; it
+   doubles them when it has twice as many names */
+#define DIR_INDEX_BUCKETS 1024
+
+/* dir_index_start gives fat an index of directory names, which
+   dir_find uses from then on */
+void dir_index_start(struct fat_table *fat)
+{
+  struct dir_index *index;
+
+  index = calloc(1, sizeof(struct dir_index));
+  if (index != NULL) {
+    index->nbuckets = DIR_INDEX_BUCKETS;
+    index->buckets = calloc(index->nbuckets,
+      sizeof(struct dir_index_entry *));
+    index->indexed = calloc(fat->nclusters / 64 + 1, sizeof(uint64_t));
+  }
+  if (index == NULL || index->buckets == NULL || index->indexed == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  fat->index = index;
+}
+
+void dir_index_free(struct fat_table *fat)
+{
+  struct dir_index *index = fat->index;
+  struct dir_index_entry *entry, *next;
+  uint32_t i;
+
+  if (index == NULL) {
+    return;
+  }
+  for (i = 0; i < index->nbuckets; i++) {
+    for (entry = index->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      free(entry);
+    }
+  }
+  free(index->buckets);
+  free(index->indexed);
+  free(index);
+  fat->index = NULL;
+}
+
+/* index_parent turns a directory's cluster into the index's name for
+   it: MSDOSFSROOT and the FAT-32 root cluster are the same directory,
+   and anything that isn't a cluster at all is left out */
+static uint32_t index_parent(struct fat_table *fat, uint32_t cluster)
+{
+  if (cluster == MSDOSFSROOT) {
+    cluster = bpb_geometry(fat->bpb)->root_cluster;
+  }
+  if (cluster >= fat->nclusters) {
+    return MSDOSFSROOT;
+  }
+  return cluster;
+}
+
+static uint32_t index_hash(uint32_t parent, const char *name)
+{
+  uint32_t hash = 2166136261u ^ parent;
+
+  while (*name != '\0') {
+    hash = (hash ^ (uint8_t)*name++) * 16777619u;
+  }
+  return hash;
+}
+
+/* index_lookup returns where name's entry in the index points to, or
+   NULL */
+static struct dir_index_entry **index_lookup(struct dir_index *index,
+  uint32_t parent, const char *name)
+{
+  struct dir_index_entry **link;
+
+  link = &index->buckets[index_hash(parent, name) % index->nbuckets];
+  while (*link != NULL) {
+    if ((*link)->parent == parent && strcmp((*link)->name, name) == 0) {
+      break;
+    }
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/* index_grow doubles the buckets, when there are twice as many names
+   as buckets.  Without the memory to, it carries on with chains a bit
+   longer */
+static void index_grow(struct dir_index *index)
+{
+  struct dir_index_entry **buckets, *entry, *next;
+  uint32_t i, n = index->nbuckets * 2;
+
+  buckets = calloc(n, sizeof(struct dir_index_entry *));
+  if (buckets == NULL) {
+    return;
+  }
+  for (i = 0; i < index->nbuckets; i++) {
+    for (entry = index->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      entry->next = buckets[index_hash(entry->parent, entry->name) % n];
+      buckets[index_hash(entry->parent, entry->name) % n] = entry;
+    }
+  }
+  free(index->buckets);
+  index->buckets = buckets;
+  index->nbuckets = n;
+}
+
+/* index_put makes name in parent point to the slot at offset.  The
+   first of two slots with the same name is the one dir_find would
+   find, so a second one only goes in if replace is set */
+static void index_put(struct dir_index *index, uint32_t parent,
+  const char *name, uint64_t offset, int replace)
+{
+  struct dir_index_entry **link, *entry;
+
+  link = index_lookup(index, parent, name);
+  if (*link != NULL) {
+    if (replace) {
+      (*link)->offset = offset;
+    }
+    return;
+  }
+  entry = malloc(sizeof(struct dir_index_entry));
+  if (entry == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  entry->parent = parent;
+  entry->offset = offset;
+  strcpy(entry->name, name);
+  entry->next = NULL;
+  *link = entry;
+  if (++index->count > index->nbuckets * 2) {
+    index_grow(index);
+  }
+}
+
+static int index_has_dir(struct dir_index *index, uint32_t parent)
+{
+  return (index->indexed[parent / 64] >> (parent % 64)) & 1;
+}
+
+/* index_dir reads every name in the directory at cluster into the
+   index */
+static void index_dir(struct dir_index *index, uint32_t cluster,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat)
+{
+  struct dir_iter it;
+  struct direntry *dirent;
+  uint32_t parent = index_parent(fat, cluster);
+  char fullname[13];
+
+  dir_iter_start(&it, cluster, io, bpb, fat);
+  while ((dirent = dir_iter_next(&it, io, bpb, fat)) != NULL) {
+    if (dirent->deName[0] == SLOT_DELETED) {
+      continue;
+    }
+    get_name(fullname, dirent);
+    index_put(index, parent, fullname,
+      it.offset + (uint64_t)(it.slot - 1) * sizeof(struct direntry), FALSE);
+  }
+  index->indexed[parent / 64] |= (uint64_t)1 << (parent % 64);
+  index->scans++;
+}
+
+/* index_slot returns the slot at offset in the image.  It's fetched
+   as part of the whole cluster or root directory it's in, as
+   dir_iter_next fetches it, so the two never see different copies */
+static struct direntry *index_slot(uint64_t offset, struct image_io *io,
+  struct bpb710* bpb)
+{
+  const struct fat_geometry *geom = bpb_geometry(bpb);
+  uint64_t base;
+  size_t length;
+
+  if (offset < geom->data_offset) {
+    base = geom->root_offset;
+    length = root_dir_size(bpb);
+  } else {
+    base = offset - (offset - geom->data_offset) % geom->cluster_size;
+    length = geom->cluster_size;
+  }
+  return (struct direntry *)(io_get(io, base, length) + (offset - base));
+}
+
+/* dir_index_add tells the index that dirent, in the directory at
+   cluster, has just been given a name.  A directory that hasn't been
+   read in yet will pick it up when it is */
+void dir_index_add(struct fat_table *fat, uint32_t cluster,
+  struct direntry *dirent)
+{
+  struct dir_index *index = fat->index;
+  uint32_t parent;
+  char fullname[13];
+
+  if (index == NULL) {
+    return;
+  }
+  parent = index_parent(fat, cluster);
+  if (!index_has_dir(index, parent)) {
+    return;
+  }
+  get_name(fullname, dirent);
+  index_put(index, parent, fullname,
+    io_offset(fat->io, (uint8_t *)dirent), TRUE);
+}
+
+/* dir_scan is dir_find the slow way, reading every slot */
+static struct direntry *dir_scan(const char *name, uint32_t cluster,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat)
+{
+  struct dir_iter it;
+  struct direntry *dirent;
+  char fullname[13];
+
+  dir_iter_start(&it, cluster, io, bpb, fat);
+  while ((dirent = dir_iter_next(&it, io, bpb, fat)) != NULL) {
+    if (dirent->deName[0] == SLOT_DELETED) {
+      /* skip over a deleted file */
+      continue;
+    }
+    get_name(fullname, dirent);
+    if (strcmp(fullname, name) == 0) {
+      return dirent;
+    }
+  }
+  return NULL;
+}
+
+/* dir_find returns the slot in the directory at cluster holding name
+   -- a file, a directory or the volume label -- or NULL if there's
+   nothing by that name.  With an index, that's a hash lookup, once the
+   directory's been read in.  The slot is only good until the image is
+   next read. */
+struct direntry *dir_find(const char *name, uint32_t cluster,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat)
+{
+  struct dir_index *index = fat->index;
+  struct dir_index_entry **link, *entry;
+  struct direntry *dirent;
+  uint32_t parent;
+  char fullname[13];
+
+  if (index == NULL) {
+    return dir_scan(name, cluster, io, bpb, fat);
+  }
+  if (strlen(name) >= sizeof(fullname)) {
+    /* longer than any 8.3 name */
+    return NULL;
+  }
+  parent = index_parent(fat, cluster);
+  if (!index_has_dir(index, parent)) {
+    index_dir(index, cluster, io, bpb, fat);
+  }
+  index->lookups++;
+  link = index_lookup(index, parent, name);
+  if (*link == NULL) {
+    return NULL;
+  }
+
+  /* make sure the slot still says what it did; if something changed
+     it behind the index's back, forget it and look the slow way */
+  dirent = index_slot((*link)->offset, io, bpb);
+  if (dirent->deName[0] != SLOT_EMPTY && dirent->deName[0] != SLOT_DELETED) {
+    get_name(fullname, dirent);
+    if (strcmp(fullname, name) == 0) {
+      return dirent;
+    }
+  }
+  entry = *link;
+  *link = entry->next;
+  free(entry);
+  index->count--;
+  return dir_scan(name, cluster, io, bpb, fat);
+}
+
+/* find_file seeks through the directories in the memory disk image,
+   until it finds the named file.  With FIND_DIR it returns a free
+   slot in the directory the file would go in instead.  The path is
+   looked up one component at a time, so there's no recursion however
+   deep it goes.  Returns NULL if there's nothing by that name. */
+struct direntry* find_file(char *infilename, uint32_t cluster,
+  int find_mode, struct image_io *io, struct bpb710* bpb,
+  struct fat_table *fat)
+{
+  char buf[MAXPATHLEN+1];
+  char *seek_name, *next_name;
+  struct direntry *dirent;
+
+  strncpy(buf, infilename, MAXPATHLEN);
+  buf[MAXPATHLEN] = '\0';
+  next_name = buf;
+
+  while (1) {
+    /* split off the first part of the path; we hunt through the
+       current directory for it, and if there's a remainder and what
+       we find is a directory, we carry on in that directory */
+    seek_name = next_name;
+    while (*seek_name == '/' || *seek_name == '\\') {
+      seek_name++;
+    }
+    next_name = seek_name + strcspn(seek_name, "/\\");
+    if (*next_name == '\0') {
+      /* end of name - no slashes found */
+      next_name = NULL;
+      if (find_mode == FIND_DIR) {
+        dirent = dir_free_slot(cluster, io, bpb, fat);
+        if (dirent == NULL) {
+          fprintf(stderr, "Directory is full\n");
+          exit(1);
+        }
+        return dirent;
+      }
+    } else {
+      *next_name = '\0';
+      next_name++;
+    }
+
+    dirent = dir_find(seek_name, cluster, io, bpb, fat);
+    if (dirent == NULL) {
+      /* we failed to find the file */
+      return NULL;
+    }
+
+    /* found it! */
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+      /* it's a directory */
+      if (next_name == NULL) {
+        fprintf(stderr, "Cannot copy out a directory\n");
+        exit(1);
+      }
+      cluster = dirent_start(dirent, fat);
+    } else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
+      /* it's a volume */
+      fprintf(stderr, "Cannot copy out a volume\n");
+      exit(1);
+    } else {
+      /* assume it's a file */
+      return dirent;
+    }
   }
-  return p;
 }
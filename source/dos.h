@@ -2,6 +2,20 @@
 
 #define MAXPATHLEN 255
 
+/* the deepest a directory can be and still have a path that fits in
+   MAXPATHLEN; tree walks stop descending beyond this by default */
+#define DEFAULT_MAX_DEPTH 128
+
+/* flags for find_file, depending on whether we're searching for a
+   file or a directory */
+#define FIND_FILE 0
+#define FIND_DIR 1
+
+/* what tree_walk_descend did */
+#define WALK_DESCENDED 0
+#define WALK_TOO_DEEP 1         /* it would go deeper than max_depth */
+#define WALK_LOOP 2             /* the directory has been walked already */
+
 #ifndef TRUE
 #define TRUE (1)
 #define FALSE (0)
@@ -11,14 +25,352 @@
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
+#include <stddef.h>
+
+/* a run of consecutive clusters */
+struct extent {
+  uint32_t start;
+  uint32_t length;
+};
+
+/* a run of bytes in the image */
+struct image_range {
+  size_t offset;
+  size_t length;
+};
+
+/* how cluster_to_addr finds a cluster.  The two standard floppy
+   layouts get cases of their own, with every offset a constant */
+#define GEOM_MULTIPLY 0         /* cluster size isn't a power of two */
+#define GEOM_SHIFT 1            /* cluster size is 1 << cluster_shift */
+#define GEOM_FLOPPY_1440 2      /* 3.5" 1.44MB */
+#define GEOM_FLOPPY_720 3       /* 3.5" 720KB */
+
+/* where things are on the 1.44MB floppy: 512 byte sectors and
+   clusters, one reserved sector, two 9 sector FATs and 224 root
+   directory entries */
+#define FLOPPY_1440_FAT 512
+#define FLOPPY_1440_ROOT (19 * 512)
+#define FLOPPY_1440_DATA (33 * 512)
+#define FLOPPY_1440_SHIFT 9
+
+/* and on the 720KB one: 1024 byte clusters, two 3 sector FATs and
+   112 root directory entries */
+#define FLOPPY_720_FAT 512
+#define FLOPPY_720_ROOT (7 * 512)
+#define FLOPPY_720_DATA (14 * 512)
+#define FLOPPY_720_SHIFT 10
+
+/* the disk layout, worked out once by check_bootsector from the BPB
+   so that address and FAT lookups don't redo the arithmetic */
+struct fat_geometry {
+  int layout;               /* GEOM_... */
+  int type;                 /* 12, 16 or 32 */
+  size_t fat_offset;        /* bytes from the start of the image to
+                               the first FAT */
+  size_t root_offset;       /* to the FAT-12/16 root directory */
+  size_t data_offset;       /* to cluster 2 */
+  uint32_t cluster_size;    /* bytes per cluster */
+  uint32_t cluster_shift;   /* log2(cluster_size), for GEOM_SHIFT */
+  uint32_t root_cluster;    /* bpbRootClust on FAT-32, otherwise
+                               MSDOSFSROOT */
+};
+
+/* check_bootsector hands back one of these as a struct bpb710*, so
+   every function that's passed the BPB can get at the geometry too,
+   and freeing the BPB frees both */
+struct fat_disk {
+  struct bpb710 bpb;
+  struct fat_geometry geom;
+};
+
+/* fsinfree when the FAT-32 FSInfo sector doesn't know the count */
+#define FSINFO_UNKNOWN 0xffffffff
+
+/* decoded, in-memory copy of the FAT.  The FAT-12, FAT-16 or FAT-32
+   table is unpacked once by load_fat_table, all reads and writes go
+   to the flat entries array, and flush_fat_table re-encodes only the
+   entries that were changed back into the image */
+struct fat_table {
+  uint32_t *entries;      /* one decoded entry per cluster, with end
+                             of file and bad cluster markers widened
+                             to their FAT-32 values */
+  int type;               /* 12, 16 or 32 */
+  uint32_t nclusters;     /* number of entries, including the two
+                             reserved ones at the start */
+  uint8_t *dirty;         /* one bit per entry, set by fat_set */
+  uint32_t ndirty;        /* number of entries changed since the
+                             last flush */
+  uint32_t dirty_first;   /* the bytes of dirty with any bit set all
+                             lie in [dirty_first, dirty_end) */
+  uint32_t dirty_end;
+  uint64_t *free_map;     /* one bit per cluster, set if the cluster
+                             is free; kept current by fat_set */
+  uint32_t nfree;         /* number of free clusters */
+  uint32_t free_hint;     /* where to start looking for a free
+                             cluster; there's none below it unless
+                             the FSInfo sector said otherwise */
+  uint32_t max_chain;     /* walks give up on a chain longer than
+                             this; defaults to nclusters */
+  uint64_t fsinfo_offset; /* where the FAT-32 FSInfo sector is, or 0
+                             if there isn't one */
+  uint32_t fsinfo_free;   /* its free count when we loaded the FAT */
+  int track_writes;       /* if set, every write into the image is
+                             noted in writes */
+  struct image_range *writes;
+  uint32_t nwrites;
+  uint32_t writes_size;
+  struct image_io *io;
+  struct bpb710 *bpb;
+  struct dir_index *index; /* NULL unless dir_index_start was called */
+  int copy;               /* which copy of the FAT it was loaded from;
+                             flushing writes them all */
+};
+
+/* one name in a dir_index */
+struct dir_index_entry {
+  uint32_t parent;          /* the directory it's in */
+  uint64_t offset;          /* where its slot is in the image */
+  struct dir_index_entry *next;
+  char name[13];            /* as get_name gives it */
+};
+
+/* the names in every directory looked up so far, hashed on the
+   directory and the name, so looking up the same directory again
+   doesn't scan its slots.  A directory is read in whole the first time
+   anything in it is looked up; after that, whoever writes a name into
+   it tells the index with dir_index_add */
+struct dir_index {
+  struct dir_index_entry **buckets;
+  uint32_t nbuckets;
+  uint32_t count;
+  uint64_t *indexed;        /* one bit per cluster, set once that
+                               directory has been read in; bit 0 is
+                               the FAT-12/16 root directory */
+  uint64_t lookups;
+  uint64_t scans;           /* directories read in */
+};
+
+/* walks the slots of a directory, following its cluster chain.  The
+   FAT-12 and FAT-16 root directory is a fixed-size area rather than a
+   chain. */
+struct dir_iter {
+  uint32_t cluster;         /* cluster being read, or MSDOSFSROOT */
+  uint64_t offset;          /* where that cluster or area is */
+  uint32_t slot;            /* next slot in it to return */
+  uint32_t left;            /* slots left in this cluster or area */
+  uint32_t steps;           /* clusters visited, so a looping chain
+                               can't keep us here forever */
+  int done;
+};
+
+/* depth-first walk of a directory tree, keeping a heap-allocated
+   stack of dir_iters rather than recursing, so a deep or looping tree
+   costs memory bounded by max_depth instead of stack.  No directory is
+   walked twice, so a looping tree costs no more time than the
+   directories in it */
+struct tree_walk {
+  struct dir_iter *stack;
+  uint32_t depth;           /* directories currently open */
+  uint32_t size;            /* frames allocated in stack */
+  uint32_t max_depth;
+  uint64_t *walked;         /* one bit per cluster, set once the
+                               directory starting there has been
+                               walked; bit 0 is the FAT-12/16 root
+                               directory */
+  struct image_io *io;
+  struct bpb710 *bpb;
+  struct fat_table *fat;
+};
+
+struct image_io;
+
+struct bpb710* check_bootsector(struct image_io *io);
+const char *bpb_geometry_error(struct bpb710 *bpb, size_t image_size);
+int fat_type(struct bpb710 *bpb);
+uint32_t get_fat_entry(uint32_t clusternum, struct image_io *io,
+ struct bpb710* bpb);
+void set_fat_entry(uint32_t clusternum, uint32_t value,
+ struct image_io *io, struct bpb710* bpb);
+void fat12_decode(const uint8_t *src, uint16_t *dst, uint32_t n);
+void fat12_encode(const uint16_t *src, uint8_t *dst, uint32_t n);
+int fat12_use_kernel(const char *name);
+const char *fat12_kernel_name(void);
+int is_end_of_file(uint32_t cluster) ;
+uint8_t *root_dir_addr(struct image_io *io, struct bpb710* bpb);
+uint8_t *cluster_to_addr(uint32_t cluster, struct image_io *io,
+ struct bpb710* bpb);
+
+struct fat_table *load_fat_table(struct image_io *io, struct bpb710* bpb);
+struct fat_table *load_fat_copy(struct image_io *io, struct bpb710* bpb,
+  int copy);
+uint32_t fat_compare_copies(struct fat_table *fat, int copy,
+  struct extent **ranges);
+void flush_fat_table(struct fat_table *fat);
+void free_fat_table(struct fat_table *fat);
+void fat_note_write(struct fat_table *fat, const void *addr, size_t length);
+uint32_t fat_alloc_cluster(struct fat_table *fat);
+struct extent *fat_free_extents(struct fat_table *fat, uint32_t *count);
+uint32_t fat_alloc_chain(struct fat_table *fat, uint32_t count,
+  uint32_t *fragments);
+uint32_t count_fragments(struct fat_table *fat, uint32_t cluster);
+void dir_iter_start(struct dir_iter *it, uint32_t cluster,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat);
+struct direntry *dir_iter_next(struct dir_iter *it, struct image_io *io,
+  struct bpb710* bpb, struct fat_table *fat);
+struct direntry *dir_free_slot(uint32_t cluster, struct image_io *io,
+  struct bpb710* bpb, struct fat_table *fat);
+struct direntry *dir_grow(uint32_t cluster, struct image_io *io,
+  struct bpb710* bpb, struct fat_table *fat);
+void tree_walk_start(struct tree_walk *walk, uint32_t cluster,
+  uint32_t max_depth, struct image_io *io, struct bpb710* bpb,
+  struct fat_table *fat);
+struct direntry *tree_walk_next(struct tree_walk *walk);
+int tree_walk_descend(struct tree_walk *walk, uint32_t cluster);
+void tree_walk_end(struct tree_walk *walk);
+void get_name(char *fullname, struct direntry *dirent);
+struct direntry *dir_find(const char *name, uint32_t cluster,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat);
+void dir_index_start(struct fat_table *fat);
+void dir_index_add(struct fat_table *fat, uint32_t cluster,
+  struct direntry *dirent);
+void dir_index_free(struct fat_table *fat);
+struct direntry* find_file(char *infilename, uint32_t cluster,
+  int find_mode, struct image_io *io, struct bpb710* bpb,
+  struct fat_table *fat);
+
+/* the helpers every cluster lookup goes through are inlined even in
+   the Makefile's unoptimised build, where a plain static inline
+   function still gets called */
+#ifndef ALWAYS_INLINE
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+#endif
+
+/* bpb_geometry returns the geometry check_bootsector worked out
+   for bpb */
+static ALWAYS_INLINE const struct fat_geometry *bpb_geometry(
+  struct bpb710 *bpb)
+{
+  return &((struct fat_disk *)bpb)->geom;
+}
+
+/* cluster_offset returns where in the image the cluster actually
+   starts.  MSDOSFSROOT means the root directory, which on FAT-32 is
+   the cluster in bpbRootClust.  It's here rather than in dos.c so
+   that, with io_get, cluster_to_addr on a mapped image comes down to
+   the arithmetic */
+static ALWAYS_INLINE uint64_t cluster_offset(uint32_t cluster,
+  struct bpb710 *bpb)
+{
+  const struct fat_geometry *geom = bpb_geometry(bpb);
+
+  if (cluster == MSDOSFSROOT) {
+    cluster = geom->root_cluster;
+    if (cluster == MSDOSFSROOT) {
+      return geom->root_offset;
+    }
+  }
+  switch (geom->layout) {
+  case GEOM_FLOPPY_1440:
+    return FLOPPY_1440_DATA
+      + ((uint64_t)(cluster - CLUST_FIRST) << FLOPPY_1440_SHIFT);
+  case GEOM_FLOPPY_720:
+    return FLOPPY_720_DATA
+      + ((uint64_t)(cluster - CLUST_FIRST) << FLOPPY_720_SHIFT);
+  case GEOM_SHIFT:
+    return geom->data_offset
+      + ((uint64_t)(cluster - CLUST_FIRST) << geom->cluster_shift);
+  default:
+    return geom->data_offset
+      + (uint64_t)(cluster - CLUST_FIRST) * geom->cluster_size;
+  }
+}
+
+/* fat_widen turns a FAT-12 or FAT-16 entry (mask says which) into
+   the FAT-32 equivalent: the same cluster number, or the same
+   reserved, bad or end of file marker */
+static inline uint32_t fat_widen(uint32_t value, uint32_t mask)
+{
+  if (value >= (mask & CLUST_RSRVD)) {
+    value |= FAT32_MASK & ~mask;
+  }
+  return value;
+}
+
+/* fat_get returns the decoded FAT entry for cluster.  Cluster numbers
+   beyond the end of the FAT read as end of file, so a corrupt chain
+   can never walk off the end of the table */
+static inline uint32_t fat_get(struct fat_table *fat, uint32_t cluster)
+{
+  if (cluster >= fat->nclusters) {
+    return FAT32_MASK & CLUST_EOFS;
+  }
+  return fat->entries[cluster];
+}
+
+/* fat_touch marks the entry for cluster as needing writing back to
+   the image, even though it hasn't changed */
+static inline void fat_touch(struct fat_table *fat, uint32_t cluster)
+{
+  if (cluster < fat->nclusters
+    && (fat->dirty[cluster / 8] & (1 << (cluster % 8))) == 0) {
+    fat->dirty[cluster / 8] |= 1 << (cluster % 8);
+    fat->ndirty++;
+    if (cluster / 8 < fat->dirty_first) {
+      fat->dirty_first = cluster / 8;
+    }
+    if (cluster / 8 >= fat->dirty_end) {
+      fat->dirty_end = cluster / 8 + 1;
+    }
+  }
+}
+
+/* fat_set changes the decoded FAT entry for cluster, and remembers
+   that it needs writing back to the image */
+static inline void fat_set(struct fat_table *fat, uint32_t cluster,
+  uint32_t value)
+{
+  if (cluster >= fat->nclusters || cluster < CLUST_FIRST) {
+    return;
+  }
+  if ((fat->entries[cluster] == CLUST_FREE) != (value == CLUST_FREE)) {
+    /* keep the free map in step with the table */
+    fat->free_map[cluster / 64] ^= (uint64_t)1 << (cluster % 64);
+    if (value == CLUST_FREE) {
+      fat->nfree++;
+      if (cluster < fat->free_hint) {
+        fat->free_hint = cluster;
+      }
+    } else {
+      fat->nfree--;
+    }
+  }
+  fat->entries[cluster] = value;
+  fat_touch(fat, cluster);
+}
+
+/* dirent_start returns the first cluster of a directory entry.  Only
+   FAT-32 uses the high half; on the others it can hold anything */
+static inline uint32_t dirent_start(struct direntry *dirent,
+  struct fat_table *fat)
+{
+  uint32_t cluster = getushort(dirent->deStartCluster);
+  if (fat->type == 32) {
+    cluster |= (uint32_t)getushort(dirent->deHighClust) << 16;
+  }
+  return cluster;
+}
 
-uint8_t *mmap_file(char *filename, int *fd);
-struct bpb33* check_bootsector(uint8_t *image_buf);
-uint16_t get_fat_entry(uint16_t clusternum, uint8_t *image_buf, 
- struct bpb33* bpb);
-void set_fat_entry(uint16_t clusternum, uint16_t value, 
- uint8_t *image_buf, struct bpb33* bpb);
-int is_end_of_file(uint16_t cluster) ;
-uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb);
-uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
- struct bpb33* bpb);
+/* dirent_set_start sets the first cluster of a directory entry */
+static inline void dirent_set_start(struct direntry *dirent,
+  struct fat_table *fat, uint32_t cluster)
+{
+  putushort(dirent->deStartCluster, cluster & 0xffff);
+  if (fat->type == 32) {
+    putushort(dirent->deHighClust, cluster >> 16);
+  }
+}
@@ -1,5 +1,8 @@
 /* COMP3005 coursework 2 */
 
+/* for copy_file_range */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -11,307 +14,312 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "io.h"
+#include "reader.h"
 
-/* get_name retrieves the filename from a directory entry */
-void get_name(char *fullname, struct direntry *dirent)
-{
-  char name[9];
-  char extension[4];
-  int i;
-
-  name[8] = ' ';
-  extension[3] = ' ';
-  memcpy(name, &(dirent->deName[0]), 8);
-  memcpy(extension, dirent->deExtension, 3);
-
-  /* names are space padded - remove the padding */
-  for (i = 8; i > 0; i--) {
-    if (name[i] == ' ')
-      name[i] = '\0';
-    else
-      break;
-  }
+/* the most copy_in_file reads into the image with one io_load */
+#define COPY_IN_MAX_RUN (64 * 1024 * 1024)
 
-  /* extensions aren't normally space padded - but remove the
-     padding anyway if it's there */
-  for (i = 3; i > 0; i--) {
-    if (extension[i] == ' ')
-      extension[i] = '\0';
-    else
-      break;
-  }
-  fullname[0] = '\0';
-  strcat(fullname, name);
+/* what copying a file out took */
+struct copy_stats {
+  uint64_t bytes;
+  uint64_t calls;             /* write or copy_file_range calls */
+  int failed;                 /* set once a write has failed */
+};
+
+/* write_out writes length bytes to fd, counting them in stats.
+   Returns -1, having said why and set stats->failed, if it can't */
+static int write_out(int fd, const uint8_t *buf, size_t length,
+  struct copy_stats *stats)
+{
+  ssize_t n;
 
-  /* append the extension if it's not a directory */
-  if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) {
-    strcat(fullname, ".");
-    strcat(fullname, extension);
+  while (length > 0) {
+    n = write(fd, buf, length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(stderr, "Can't write file: %s\n", strerror(errno));
+      stats->failed = TRUE;
+      return -1;
+    }
+    stats->calls++;
+    stats->bytes += n;
+    buf += n;
+    length -= n;
   }
+  return 0;
 }
 
-/* find_file seeks through the directories in the memory disk image,
-   until it finds the named file */
+#ifdef __linux__
 
-/* flags, depending on whether we're searching for a file or a
-   directory */
-#define FIND_FILE 0
-#define FIND_DIR 1
-
-struct direntry* find_file(char *infilename, uint16_t cluster,
-  int find_mode, uint8_t *image_buf, struct bpb33* bpb)
+/* copy_out_range copies the file with copy_file_range, a run of
+   consecutive clusters per call where the kernel manages it, so the
+   data goes straight from the image file to fd without coming through
+   our buffers.  It's only worth trying when the image file has
+   everything we'd see through io, which a private mapping needn't.
+   Returns FALSE, having copied nothing, if the kernel can't do it for
+   this pair of files -- fd isn't a regular file, say.  A write that
+   fails part way is reported and sets stats->failed, and the copy
+   stops there */
+static int copy_out_range(int fd, uint32_t cluster, uint32_t bytes_remaining,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat,
+  struct cluster_reader *reader, struct copy_stats *stats)
 {
-  char buf[MAXPATHLEN];
-  char *seek_name, *next_name;
-  int d;
-  struct direntry *dirent;
-  uint16_t dir_cluster;
-  char fullname[13];
-
-  /* find the first dirent in this directory */
-  dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-  /* first we need to split the file name we're looking for into the
-     first part of the path, and the remainder.  We hunt through the
-     current directory for the first part.  If there's a remainder,
-     and what we find is a directory, then we recurse, and search
-     that directory for the remainder */
+  static const uint8_t zeros[4096];
+  uint64_t offset;
+  uint32_t length;
+  loff_t image_offset;
+  ssize_t n;
 
-  strncpy(buf, infilename, MAXPATHLEN);
-  seek_name = buf;
-
-  /* trim leading slashes */
-  while (*seek_name == '/' || *seek_name == '\\') {
-    seek_name++;
+  if (io->fd < 0 || io->mode == IMAGE_PRIVATE) {
+    return FALSE;
   }
-
-  /* search for any more slashes - if so, it's a dirname */
-  next_name = seek_name;
-  while (1) {
-    if (*next_name == '/' || *next_name == '\\') {
-      *next_name = '\0';
-      next_name ++;
-      break;
-    }
-    if (*next_name == '\0') {
-      /* end of name - no slashes found */
-      next_name = NULL;
-      if (find_mode == FIND_DIR) {
-        return dirent;
+  reader_walk(reader, io, bpb, fat, cluster, bytes_remaining);
+  while (reader_extent(reader, &offset, &length)) {
+    image_offset = offset;
+    while (length > 0) {
+      n = copy_file_range(io->fd, &image_offset, fd, NULL, length, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
       }
-      break;
-    }
-    next_name++;
-  }
-
-  while (1) {
-    /* hunt a cluster for the relevant dirent.  If we reach the
-       end of the cluster, we'll need to go to the next cluster
-       for this directory */
-    for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-      d += sizeof(struct direntry)) {
-      if (dirent->deName[0] == SLOT_EMPTY) {
-        /* we failed to find the file */
-        return NULL;
+      if (n < 0 && stats->calls == 0 && (errno == EINVAL || errno == EXDEV
+          || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+        reader_end(reader);
+        return FALSE;
       }
-      if (dirent->deName[0] == SLOT_DELETED) {
-        /* skip over a deleted file */
-        dirent++;
-        continue;
+      if (n < 0) {
+        fprintf(stderr, "Can't write file: %s\n", strerror(errno));
+        stats->failed = TRUE;
+        return TRUE;
       }
-      get_name(fullname, dirent);
-      if (strcmp(fullname, seek_name) == 0) {
-        /* found it! */
-        if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
-          /* it's a directory */
-          if (next_name == NULL) {
-            fprintf(stderr, "Cannot copy out a directory\n");
-            exit(1);
+      if (n == 0) {
+        /* the run goes past the end of the image, which reads as
+           zeros the way it does for the reader */
+        while (length > 0) {
+          n = length < sizeof(zeros) ? length : sizeof(zeros);
+          if (write_out(fd, zeros, n, stats) < 0) {
+            return TRUE;
           }
-          dir_cluster = getushort(dirent->deStartCluster);
-          return find_file(next_name, dir_cluster,
-           find_mode, image_buf, bpb);
-        } else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
-          /* it's a volume */
-          fprintf(stderr, "Cannot copy out a volume\n");
-          exit(1);
-        } else {
-          /* assume it's a file */
-          return dirent;
+          length -= n;
         }
+        break;
       }
-      dirent++;
-    }
-    /* we've reached the end of the cluster for this directory.
-       Where's the next cluster? */
-    if (cluster == 0) {
-      // root dir is special
-      dirent++;
-    } else {
-      cluster = get_fat_entry(cluster, image_buf, bpb);
-      dirent = (struct direntry*)cluster_to_addr(cluster,
-       image_buf, bpb);
+      stats->calls++;
+      stats->bytes += n;
+      length -= n;
     }
   }
+  return TRUE;
 }
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
+#else
 
-void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
-  uint8_t *image_buf, struct bpb33* bpb)
+static int copy_out_range(int fd, uint32_t cluster, uint32_t bytes_remaining,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat,
+  struct cluster_reader *reader, struct copy_stats *stats)
 {
-  int total_clusters, clust_size;
-  uint8_t *p;
+  return FALSE;
+}
 
-  clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-  total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-  if (cluster == 0) {
-    fprintf(stderr, "Bad file termination\n");
-    return;
-  } else if (is_end_of_file(cluster)) {
-    return;
-  } else if (cluster > total_clusters) {
-    abort(); /* this shouldn't be able to happen */
-  }
+#endif
 
-  /* map the cluster number to the data location */
-  p = cluster_to_addr(cluster, image_buf, bpb);
+/* copy_out_file actually does the work of copying, following the
+   chain of clusters in the memory disk image, and copying out a run
+   of consecutive clusters at a time.  If the kernel can, each run is
+   copied from the image file to fd with copy_file_range; otherwise
+   the reader keeps up to depth runs further along the chain being read
+   while each one is written with a single write.  Returns -1 if
+   writing to fd failed, which has been reported */
 
-  if (bytes_remaining <= clust_size) {
-    /* this is the last cluster */
-    fwrite(p, bytes_remaining, 1, fd);
-  } else {
-    /* more clusters after this one */
-    fwrite(p, clust_size, 1, fd);
+int copy_out_file(int fd, uint32_t cluster, uint32_t bytes_remaining,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat,
+  uint32_t depth, int verbose)
+{
+  struct cluster_reader reader;
+  const uint8_t *buf;
+  const char *method = "copy_file_range";
+  uint32_t bytes;
+  struct copy_stats stats = { 0, 0, FALSE };
 
-    /* recurse, continuing to copy */
-    copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb),
-      bytes_remaining - clust_size, image_buf, bpb);
+  if (!copy_out_range(fd, cluster, bytes_remaining, io, bpb, fat, &reader,
+      &stats)) {
+    reader_start(&reader, io, bpb, fat, cluster, bytes_remaining, depth);
+    while ((buf = reader_next(&reader, &bytes)) != NULL) {
+      if (write_out(fd, buf, bytes, &stats) < 0) {
+        break;
+      }
+    }
+    method = reader_method(&reader);
   }
-  return;
+  if (reader.error[0] != '\0') {
+    fprintf(stderr, "%s\n", reader.error);
+  }
+  if (verbose) {
+    fprintf(stderr, "read %llu clusters in %llu runs with %s",
+      (unsigned long long)reader.clusters,
+      (unsigned long long)reader.extents, method);
+    if (reader.slots != NULL) {
+      fprintf(stderr, ", queue depth %u", reader.depth);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "wrote %llu bytes in %llu system calls",
+      (unsigned long long)stats.bytes, (unsigned long long)stats.calls);
+    if (stats.calls > 0) {
+      fprintf(stderr, ", %llu bytes per call",
+        (unsigned long long)(stats.bytes / stats.calls));
+    }
+    fprintf(stderr, "\n");
+  }
+  reader_end(&reader);
+  return stats.failed ? -1 : 0;
 }
 
-/* copyout copies a file from the FAT-12 memory disk image to a
-   regular file in the file system */
-
-void copyout(char *infilename, char* outfilename,
-  uint8_t *image_buf, struct bpb33* bpb)
+/* free_chain marks every cluster of the chain starting at cluster
+   free */
+static void free_chain(struct fat_table *fat, uint32_t cluster)
 {
-  struct direntry *dirent = (void*)1;
-  FILE *fd;
-  uint16_t start_cluster;
-  uint32_t size;
-
-  /* skip the volume name */
-  assert(strncmp("a:", infilename, 2)==0);
-  infilename+=2;
-
-  /* find the dirent of the file in the memory disk image */
-  dirent = find_file(infilename, 0, FIND_FILE, image_buf, bpb);
-  if (dirent == NULL) {
-    fprintf(stderr, "No file called %s exists in the disk image\n",
-      infilename);
-    exit(1);
-  }
+  uint32_t next;
 
-  /* open the real file for writing */
-  fd = fopen(outfilename, "w");
-  if (fd == NULL) {
-    fprintf(stderr, "Can't open file %s to copy data out\n",
-      outfilename);
-    exit(1);
+  while (!is_end_of_file(cluster) && cluster >= CLUST_FIRST
+    && cluster < fat->nclusters) {
+    next = fat_get(fat, cluster);
+    fat_set(fat, cluster, CLUST_FREE);
+    cluster = next;
   }
-
-  /* do the actual copy out*/
-  start_cluster = getushort(dirent->deStartCluster);
-  size = getulong(dirent->deFileSize);
-  copy_out_file(fd, start_cluster, size, image_buf, bpb);
-
-  fclose(fd);
 }
 
 /* copy_in_file actually does the copying of the file into the memory
-   image, updates the FAT, and returns the starting cluster of the
-   file */
+   image, updates the FAT, and sets *start to the starting cluster of
+   the file.  Returns -1 if the disk fills up or the file can't be
+   read, having given back whatever it took.  If we can tell how big
+   the file is, the whole chain is reserved up front, so it lands in
+   one contiguous run if there's room anywhere on the disk.  Each run of consecutive clusters is then
+   read from fd straight into the image with one io_load, rather than
+   a cluster at a time through a buffer of our own */
 
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
-  uint32_t *size)
+int copy_in_file(int fd, struct image_io *io, struct bpb710* bpb,
+  struct fat_table *fat, uint32_t *start, uint32_t *size)
 {
-  uint32_t clust_size, total_clusters, i;
-  uint8_t *buf;
-  size_t bytes;
-  uint16_t start_cluster = 0;
-  uint16_t prev_cluster = 0;
+  struct stat statbuf;
+  uint32_t clust_size;
+  uint32_t start_cluster = 0;
+  uint32_t prev_cluster = 0;
+  uint32_t cluster = 0, next;
+  uint32_t count, used;
+  size_t run;
+  ssize_t bytes;
+  uint8_t probe;
 
   clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-  total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-  buf = malloc(clust_size);
+
+  if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)
+    && statbuf.st_size > 0) {
+    start_cluster = fat_alloc_chain(fat,
+      (statbuf.st_size + clust_size - 1) / clust_size, NULL);
+    if (start_cluster == 0) {
+      fprintf(stderr, "No more space in filesystem\n");
+      return -1;
+    }
+    cluster = start_cluster;
+  }
+
   while(1) {
-    /* read a block of data, and store it */
-    bytes = fread(buf, 1, clust_size, fd);
-    if (bytes > 0) {
-      *size += bytes;
-
-      /* find a free cluster */
-      for (i = 2; i < total_clusters; i++) {
-        if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) {
+    if (cluster == 0) {
+      /* we've used up anything we reserved (or couldn't reserve
+         anything), so take a free cluster; the allocator marks it
+         as the end of the file in the FAT */
+      cluster = fat_alloc_cluster(fat);
+      if (cluster == 0) {
+        /* oops - we ran out of disk space, unless there's nothing
+           more to put on it anyway */
+        if (read(fd, &probe, 1) == 0) {
           break;
         }
-      }
-
-      if (i == total_clusters) {
-      /* oops - we ran out of disk space */
         fprintf(stderr, "No more space in filesystem\n");
-      /* we should clean up here, rather than just exit */
-        exit(1);
+        if (start_cluster != 0) {
+          free_chain(fat, start_cluster);
+        }
+        return -1;
       }
 
       /* remember the first cluster, as we need to store this in
          the dirent */
       if (start_cluster == 0) {
-        start_cluster = i;
+        start_cluster = cluster;
       } else {
-      /* link the previous cluster to this one in the FAT */
+        /* link the previous cluster to this one in the FAT */
         assert(prev_cluster != 0);
-        set_fat_entry(prev_cluster, i, image_buf, bpb);
+        fat_set(fat, prev_cluster, cluster);
       }
-      /* make sure we've recorded this cluster as used */
-      set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+    }
+
+    /* read as many consecutive clusters of the chain as we can at
+       once; whatever's left of the last one after the end of the
+       file is zeroed */
+    count = 1;
+    while (count < COPY_IN_MAX_RUN / clust_size
+      && fat_get(fat, cluster + count - 1) == cluster + count) {
+      count++;
+    }
+    run = (size_t)count * clust_size;
+    bytes = io_load(io, cluster_offset(cluster, bpb), fd, run);
+    if (bytes < 0) {
+      fprintf(stderr, "Cannot copy file into disk image: %s\n",
+        strerror(errno));
+      free_chain(fat, start_cluster);
+      return -1;
+    }
+    *size += bytes;
 
-      /* copy the data into the cluster */
-      memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
+    used = (bytes + clust_size - 1) / clust_size;
+    if (used > 0) {
+      prev_cluster = cluster + used - 1;
+      next = fat_get(fat, prev_cluster);
+      cluster = is_end_of_file(next) ? 0 : next;
     }
-    if (bytes < clust_size) {
-      /* We didn't real a full cluster, so we either got a read
-         error, or reached end of file.  We exit anyway */
+    if ((size_t)bytes < run) {
+      /* We didn't read all we asked for, so we've reached the end
+         of the file */
       break;
     }
-    prev_cluster = i;
   }
 
-  free(buf);
-  return start_cluster;
+  if (cluster != 0) {
+    /* the file was shorter than it said it was - give back the
+       clusters we reserved but didn't use */
+    if (prev_cluster == 0) {
+      start_cluster = 0;
+    } else {
+      fat_set(fat, prev_cluster, FAT32_MASK & CLUST_EOFS);
+    }
+    free_chain(fat, cluster);
+  }
+
+  *start = start_cluster;
+  return 0;
 }
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename,
-  uint16_t start_cluster, uint32_t size)
+/* set_dirent_name sets the name and extension of a directory entry
+   from filename, which is upper cased and cut down to 8.3.  Any
+   directories in front of it are ignored.  Returns FALSE if filename
+   has no extension, in which case a file gets ".___" */
+static int set_dirent_name(struct direntry *dirent, const char *filename,
+  uint8_t attributes)
 {
   char *p, *p2;
   char *uppername;
   int len, i;
 
-  /* clean out anything old that used to be here */
-  memset(dirent, 0, sizeof(struct direntry));
-
   /* extract just the filename part */
   uppername = strdup(filename);
   p2 = uppername;
@@ -326,13 +334,16 @@ void write_dirent(struct direntry *dirent, char *filename,
     uppername[i] = toupper(uppername[i]);
   }
 
-  /* set the file name and extension */
+  /* set the file name and extension; directories don't usually have
+     an extension */
   memset(dirent->deName, ' ', 8);
   p = strchr(uppername, '.');
-  memcpy(dirent->deExtension, "___", 3);
-  if (p == NULL) {
-    fprintf(stderr, "No filename extension given - defaulting to .___\n");
+  if ((attributes & ATTR_DIRECTORY) != 0) {
+    memset(dirent->deExtension, ' ', 3);
   } else {
+    memcpy(dirent->deExtension, "___", 3);
+  }
+  if (p != NULL) {
     *p = '\0';
     p++;
     len = strlen(p);
@@ -344,121 +355,879 @@ void write_dirent(struct direntry *dirent, char *filename,
   }
   memcpy(dirent->deName, uppername, strlen(uppername));
   free(p2);
+  return p != NULL;
+}
+
+/* write the values into a directory entry, in the directory at
+   dir_cluster, and tell the directory index about it */
+void write_dirent(struct direntry *dirent, uint32_t dir_cluster,
+  const char *filename, uint32_t start_cluster, uint32_t size,
+  uint8_t attributes, struct fat_table *fat)
+{
+  /* clean out anything old that used to be here */
+  memset(dirent, 0, sizeof(struct direntry));
+
+  if (!set_dirent_name(dirent, filename, attributes)
+    && (attributes & ATTR_DIRECTORY) == 0) {
+    fprintf(stderr, "No filename extension given - defaulting to .___\n");
+  }
 
   /* set the attributes and file size */
-  dirent->deAttributes = ATTR_NORMAL;
-  putushort(dirent->deStartCluster, start_cluster);
+  dirent->deAttributes = attributes;
+  dirent_set_start(dirent, fat, start_cluster);
   putulong(dirent->deFileSize, size);
+  dir_index_add(fat, dir_cluster, dirent);
 
   /* a real filesystem would set the time and date here, but it's
      not necessary for this coursework */
 }
 
+/* dos_name puts the name filename will have in the image, as get_name
+   would give it back, into fullname.  Returns FALSE if there's nothing
+   of it left to make a name from (".profile", say) */
+static int dos_name(char *fullname, const char *filename,
+  uint8_t attributes)
+{
+  struct direntry dirent;
+
+  memset(&dirent, 0, sizeof(struct direntry));
+  set_dirent_name(&dirent, filename, attributes);
+  dirent.deAttributes = attributes;
+  if (dirent.deName[0] == ' ') {
+    return FALSE;
+  }
+  get_name(fullname, &dirent);
+  return TRUE;
+}
+
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
+/* one run of dos_cp, which may copy any number of files and
+   directories, in either direction, with the image opened once.  The
+   FAT's directory index remembers the names in each directory as it's
+   looked in, so copying lots of files to or from the same place
+   doesn't scan the same directories each time */
+struct copy_session {
+  struct image_io *io;
+  struct bpb710 *bpb;
+  struct fat_table *fat;
+  uint32_t depth;             /* reads to keep in flight copying out */
+  int verbose;
+  int report_fragments;
+  int recursive;              /* copy directories, and make any that
+                                 are missing from a path in the image */
+  uint32_t files;             /* files copied */
+  uint32_t dirs_made;         /* directories made in the image */
+  int status;                 /* what to exit with: 1 if anything
+                                 couldn't be copied */
+};
 
-void create_dirent(struct direntry *dirent, char *filename,
-  uint16_t start_cluster, uint32_t size, uint8_t *image_buf, struct bpb33* bpb)
+/* image_path tidies up a path in the image (without its "a:") into
+   out: both kinds of slash become '/', and there are none at the
+   start or end or doubled up.  "" is the root directory.  Returns -1
+   if it's too long */
+static int image_path(char *out, const char *path)
 {
-  while(1) {
-    if (dirent->deName[0] == SLOT_EMPTY) {
-      /* we found an empty slot at the end of the directory */
-      write_dirent(dirent, filename, start_cluster, size);
-      dirent++;
-
-      /* make sure the next dirent is set to be empty, just in
-         case it wasn't before */
-      memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-      dirent->deName[0] = SLOT_EMPTY;
+  size_t n = 0;
+  char c;
+
+  for (; *path != '\0'; path++) {
+    c = *path == '\\' ? '/' : *path;
+    if (c == '/' && (n == 0 || out[n - 1] == '/')) {
+      continue;
+    }
+    if (n == MAXPATHLEN) {
+      fprintf(stderr, "Path too long\n");
+      return -1;
+    }
+    out[n++] = c;
+  }
+  if (n > 0 && out[n - 1] == '/') {
+    n--;
+  }
+  out[n] = '\0';
+  return 0;
+}
+
+/* split_path splits path, from image_path, at its last slash: *leaf is
+   what comes after it, and path is left holding the directory it's in
+   ("" for the root) */
+static void split_path(char *path, char **leaf)
+{
+  char *slash = strrchr(path, '/');
+
+  if (slash == NULL) {
+    memmove(path + 1, path, strlen(path) + 1);
+    path[0] = '\0';
+    *leaf = path + 1;
+  } else {
+    *slash = '\0';
+    *leaf = slash + 1;
+  }
+}
+
+/* new_slot returns a slot for a new entry in the directory at dir,
+   adding a cluster to the directory if every slot it has is taken.
+   Returns NULL, having said why, if there's no room.  The slot is only
+   good until the image is next read */
+static struct direntry *new_slot(struct copy_session *s, uint32_t dir)
+{
+  struct direntry *dirent;
+
+  dirent = dir_free_slot(dir, s->io, s->bpb, s->fat);
+  if (dirent == NULL) {
+    dirent = dir_grow(dir, s->io, s->bpb, s->fat);
+  }
+  if (dirent == NULL) {
+    fprintf(stderr, s->fat->nfree == 0 ? "No more space in filesystem\n"
+      : "Directory is full\n");
+  }
+  return dirent;
+}
+
+/* save_session writes the FAT entries changed so far, and whatever
+   the cache is holding, back to the image.  It's done after every
+   file copied in and every directory made, so that however the
+   session ends -- an error, or being killed -- everything finished
+   by then is in the image with its clusters allocated */
+static void save_session(struct copy_session *s)
+{
+  flush_fat_table(s->fat);
+  if (io_flush(s->io) < 0) {
+    fprintf(stderr, "Cannot write disk image: %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+/* make_dir makes a directory called name in the directory at parent,
+   and returns its cluster, or 0 if there's no room for it */
+static uint32_t make_dir(struct copy_session *s, uint32_t parent,
+  const char *name)
+{
+  uint32_t cluster_size = bpb_geometry(s->bpb)->cluster_size;
+  struct direntry *dirent;
+  uint32_t cluster;
+
+  cluster = fat_alloc_cluster(s->fat);
+  if (cluster == 0) {
+    fprintf(stderr, "No more space in filesystem\n");
+    return 0;
+  }
+
+  /* it starts out holding just "." and "..", which is 0 for the root
+     directory even on FAT-32.  This is done before finding a slot for
+     it in the parent, since the slot doesn't last past reading the
+     image */
+  dirent = (struct direntry *)io_get(s->io,
+    cluster_offset(cluster, s->bpb), cluster_size);
+  memset(dirent, 0, cluster_size);
+  memset(dirent[0].deName, ' ', 8);
+  memset(dirent[0].deExtension, ' ', 3);
+  dirent[0].deName[0] = '.';
+  dirent[0].deAttributes = ATTR_DIRECTORY;
+  dirent_set_start(&dirent[0], s->fat, cluster);
+  memcpy(&dirent[1], &dirent[0], sizeof(struct direntry));
+  dirent[1].deName[1] = '.';
+  dirent_set_start(&dirent[1], s->fat, parent);
+  io_dirty(s->io, (uint8_t *)dirent, cluster_size);
+
+  dirent = new_slot(s, parent);
+  if (dirent == NULL) {
+    fat_set(s->fat, cluster, CLUST_FREE);
+    return 0;
+  }
+  write_dirent(dirent, parent, name, cluster, 0, ATTR_DIRECTORY, s->fat);
+  io_dirty(s->io, (uint8_t *)dirent, sizeof(struct direntry));
+  save_session(s);
+  s->dirs_made++;
+  return cluster;
+}
+
+/* image_dir finds the directory at path, from image_path, in the
+   image.  If make is set, any parts of it that are missing are made.
+   Returns FALSE if it isn't there (or can't be made), or something on
+   the way isn't a directory */
+static int image_dir(struct copy_session *s, const char *path, int make,
+  uint32_t *cluster)
+{
+  char buf[MAXPATHLEN + 1];
+  char fullname[13];
+  char *name, *slash;
+  struct direntry *dirent;
+  uint32_t dir = MSDOSFSROOT;
+
+  strcpy(buf, path);
+  name = buf;
+  while (*name != '\0') {
+    slash = strchr(name, '/');
+    if (slash != NULL) {
+      *slash = '\0';
+    }
+    dirent = dir_find(name, dir, s->io, s->bpb, s->fat);
+    if (dirent == NULL && make) {
+      /* it may be there under the name it'd be made with */
+      if (!dos_name(fullname, name, ATTR_DIRECTORY)) {
+        return FALSE;
+      }
+      dirent = dir_find(fullname, dir, s->io, s->bpb, s->fat);
+    }
+    if (dirent != NULL && (dirent->deAttributes & ATTR_VOLUME) == 0
+      && (dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+      dir = dirent_start(dirent, s->fat);
+    } else if (dirent == NULL && make) {
+      dir = make_dir(s, dir, name);
+      if (dir == 0) {
+        return FALSE;
+      }
+    } else {
+      return FALSE;
+    }
+    if (slash == NULL) {
+      break;
+    }
+    name = slash + 1;
+  }
+  *cluster = dir;
+  return TRUE;
+}
+
+/* make_host_dir makes a directory outside the image, unless it's
+   there already */
+static int make_host_dir(const char *path)
+{
+  struct stat statbuf;
+
+  if (mkdir(path, 0777) < 0
+    && (errno != EEXIST || stat(path, &statbuf) < 0
+      || !S_ISDIR(statbuf.st_mode))) {
+    fprintf(stderr, "Can't make directory %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/* copy_out_one copies the file of size bytes starting at cluster out
+   to host */
+static void copy_out_one(struct copy_session *s, uint32_t cluster,
+  uint32_t size, const char *host)
+{
+  int fd;
+
+  fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open file %s to copy data out\n", host);
+    s->status = 1;
+    return;
+  }
+  if (copy_out_file(fd, cluster, size, s->io, s->bpb, s->fat, s->depth,
+      s->verbose) < 0) {
+    s->status = 1;
+  } else {
+    s->files++;
+  }
+  close(fd);
+}
+
+/* copy_out_tree copies everything below the directory at cluster out
+   into the directory host, making it if need be.  The tree is walked
+   with a tree_walk, so it goes no deeper than DEFAULT_MAX_DEPTH, and
+   copies no directory twice however the tree loops */
+static void copy_out_tree(struct copy_session *s, uint32_t cluster,
+  const char *host)
+{
+  struct tree_walk walk;
+  struct direntry *dirent;
+  char path[PATH_MAX];
+  char name[13];
+  size_t ends[DEFAULT_MAX_DEPTH + 2];  /* where path ends at each depth */
+  uint32_t level, start, size;
+  uint8_t attributes;
+  int descended;
+
+  if (strlen(host) >= sizeof(path) || make_host_dir(host) < 0) {
+    s->status = 1;
+    return;
+  }
+  strcpy(path, host);
+  ends[0] = strlen(path);
+
+  tree_walk_start(&walk, cluster, DEFAULT_MAX_DEPTH, s->io, s->bpb, s->fat);
+  while ((dirent = tree_walk_next(&walk)) != NULL) {
+    level = walk.depth - 1;
+    if (dirent->deName[0] == SLOT_DELETED
+      || (dirent->deAttributes & ATTR_VOLUME) != 0) {
+      continue;
+    }
+    get_name(name, dirent);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+    /* copying the file out will read the image, so take what's needed
+       from the slot now */
+    attributes = dirent->deAttributes;
+    start = dirent_start(dirent, s->fat);
+    size = getulong(dirent->deFileSize);
+
+    if (ends[level] + 1 + strlen(name) >= sizeof(path)) {
+      fprintf(stderr, "Path too long\n");
+      s->status = 1;
+      continue;
+    }
+    sprintf(path + ends[level], "/%s", name);
+    if ((attributes & ATTR_DIRECTORY) != 0) {
+      if (make_host_dir(path) < 0) {
+        s->status = 1;
+        continue;
+      }
+      descended = tree_walk_descend(&walk, start);
+      if (descended == WALK_DESCENDED) {
+        ends[level + 1] = strlen(path);
+      } else if (descended == WALK_TOO_DEEP) {
+        fprintf(stderr, "%s is nested too deeply to copy\n", path);
+        s->status = 1;
+      } else {
+        fprintf(stderr, "%s is a directory loop, copied already\n", path);
+        s->status = 1;
+      }
+    } else {
+      copy_out_one(s, start, size, path);
+    }
+  }
+  tree_walk_end(&walk);
+}
+
+/* copy_out copies src, a file or (with -r) a directory in the image,
+   out to dst.  If into_dir is set, or dst is a directory, it goes in
+   there under the same name */
+static void copy_out(struct copy_session *s, const char *src,
+  const char *dst, int into_dir)
+{
+  char path[MAXPATHLEN + 1];
+  char host[PATH_MAX];
+  char name[13];
+  char *leaf;
+  struct direntry *dirent;
+  struct stat statbuf;
+  uint32_t dir, start, size;
+  uint8_t attributes;
+
+  /* skip the volume name */
+  assert(strncmp("a:", src, 2)==0);
+  src+=2;
+  if (image_path(path, src) < 0) {
+    s->status = 1;
+    return;
+  }
+
+  if (path[0] == '\0') {
+    /* the root directory */
+    attributes = ATTR_DIRECTORY;
+    start = MSDOSFSROOT;
+    size = 0;
+    strcpy(name, "");
+  } else {
+    /* find the dirent of the file in the memory disk image */
+    split_path(path, &leaf);
+    dirent = NULL;
+    if (image_dir(s, path, FALSE, &dir)) {
+      dirent = dir_find(leaf, dir, s->io, s->bpb, s->fat);
+    }
+    if (dirent == NULL) {
+      fprintf(stderr, "No file called %s exists in the disk image\n", src);
+      s->status = 1;
       return;
     }
-    if (dirent->deName[0] == SLOT_DELETED) {
-      /* we found a deleted entry - we can just overwrite it */
-      write_dirent(dirent, filename, start_cluster, size);
+    attributes = dirent->deAttributes;
+    start = dirent_start(dirent, s->fat);
+    size = getulong(dirent->deFileSize);
+    get_name(name, dirent);
+  }
+  if ((attributes & ATTR_VOLUME) != 0) {
+    fprintf(stderr, "Cannot copy out a volume\n");
+    s->status = 1;
+    return;
+  }
+  if ((attributes & ATTR_DIRECTORY) != 0 && !s->recursive) {
+    fprintf(stderr, "Cannot copy out a directory\n");
+    s->status = 1;
+    return;
+  }
+
+  /* work out where it's going */
+  if (name[0] != '\0'
+    && (into_dir || (stat(dst, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)))) {
+    if (strlen(dst) + 1 + strlen(name) >= sizeof(host)) {
+      fprintf(stderr, "Path too long\n");
+      s->status = 1;
+      return;
+    }
+    sprintf(host, "%s/%s", dst, name);
+  } else {
+    if (strlen(dst) >= sizeof(host)) {
+      fprintf(stderr, "Path too long\n");
+      s->status = 1;
       return;
     }
-    dirent++;
+    strcpy(host, dst);
   }
-}
 
-/* copyin copies a file from a regular file on the filesystem into a
-   file in the FAT-12 memory disk image  */
+  if ((attributes & ATTR_DIRECTORY) != 0) {
+    copy_out_tree(s, start, host);
+  } else {
+    copy_out_one(s, start, size, host);
+  }
+}
 
-void copyin(char *infilename, char* outfilename,
-  uint8_t *image_buf, struct bpb33* bpb)
+/* copy_in_one copies the file host into the directory at dir in the
+   image, calling it name.  shown is what to call it in messages */
+static void copy_in_one(struct copy_session *s, const char *host,
+  uint32_t dir, const char *name, const char *shown)
 {
-  struct direntry *dirent = (void*)1;
-  FILE *fd;
-  uint16_t start_cluster;
+  char fullname[13];
+  struct direntry *dirent;
+  uint32_t start_cluster;
   uint32_t size = 0;
-
-  assert(strncmp("a:", outfilename, 2)==0);
-  outfilename+=2;
+  int fd;
 
   /* check that the file doesn't already exist */
-  dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-  if (dirent != NULL) {
-    fprintf(stderr, "File %s already exists\n", outfilename);
-    exit(1);
+  if (!dos_name(fullname, name, ATTR_NORMAL)) {
+    fprintf(stderr, "Can't make a file name for %s in the disk image\n",
+      host);
+    s->status = 1;
+    return;
+  }
+  if (dir_find(fullname, dir, s->io, s->bpb, s->fat) != NULL) {
+    fprintf(stderr, "File %s already exists\n", shown);
+    s->status = 1;
+    return;
   }
 
-  /* find the dirent of the directory to put the file in */
-  dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
+  /* find a free slot in the directory to put the file in.  Nothing
+     else may be read from the image until it's filled in, or the
+     cache could drop it */
+  dirent = new_slot(s, dir);
   if (dirent == NULL) {
-    fprintf(stderr, "Directory does not exists in the disk image\n");
-    exit(1);
+    s->status = 1;
+    return;
   }
 
   /* open the real file for reading */
-  fd = fopen(infilename, "r");
-  if (fd == NULL) {
-    fprintf(stderr, "Can't open file %s to copy data in\n",
-      infilename);
-    exit(1);
+  fd = open(host, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open file %s to copy data in\n", host);
+    s->status = 1;
+    return;
   }
 
   /* do the actual copy in*/
-  start_cluster = copy_in_file(fd, image_buf, bpb, &size);
+  if (copy_in_file(fd, s->io, s->bpb, s->fat, &start_cluster, &size) < 0) {
+    close(fd);
+    s->status = 1;
+    return;
+  }
+  close(fd);
 
   /* create the directory entry */
-  create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+  write_dirent(dirent, dir, name, start_cluster, size, ATTR_NORMAL, s->fat);
+  io_dirty(s->io, (uint8_t *)dirent, sizeof(struct direntry));
+  save_session(s);
+  s->files++;
+
+  if (s->report_fragments) {
+    uint32_t clust_size = s->bpb->bpbSecPerClust * s->bpb->bpbBytesPerSec;
+    printf("a:%s: %u clusters in %u fragments\n", shown,
+      (size + clust_size - 1) / clust_size,
+      count_fragments(s->fat, start_cluster));
+  }
+}
+
+/* a directory copy_in_tree has still to copy */
+struct pending_dir {
+  char *host;
+  char *image;                /* where it goes, from image_path */
+};
+
+/* copy_in_tree copies the directory host, and everything below it,
+   into the image as the directory image, which is made if need be.
+   Directories still to be copied are kept on a list rather than
+   recursing, and each one's files are copied in name order before
+   its subdirectories */
+static void copy_in_tree(struct copy_session *s, const char *host,
+  const char *image)
+{
+  struct pending_dir *pending, *grown, next;
+  uint32_t npending = 0, size = 16, first, lo, hi;
+  struct dirent **names;
+  struct stat statbuf, linkbuf;
+  char fullname[13];
+  char *child_host, *child_image;
+  uint32_t dir;
+  int i, n;
+
+  pending = malloc(size * sizeof(struct pending_dir));
+  if (pending == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  pending[npending].host = strdup(host);
+  pending[npending].image = strdup(image);
+  npending++;
+
+  while (npending > 0) {
+    next = pending[--npending];
+    n = -1;
+    if (!image_dir(s, next.image, TRUE, &dir)) {
+      fprintf(stderr, "Can't make directory a:%s in the disk image\n",
+        next.image);
+      s->status = 1;
+    } else if ((n = scandir(next.host, &names, NULL, alphasort)) < 0) {
+      fprintf(stderr, "Can't read directory %s\n", next.host);
+      s->status = 1;
+    }
+
+    /* subdirectories are pushed in reverse, so they come off the list
+       in name order */
+    first = npending;
+    for (i = 0; i < n; i++) {
+      if (strcmp(names[i]->d_name, ".") == 0
+        || strcmp(names[i]->d_name, "..") == 0) {
+        free(names[i]);
+        continue;
+      }
+      child_host = malloc(strlen(next.host) + strlen(names[i]->d_name) + 2);
+      child_image = malloc(MAXPATHLEN + 1);
+      if (child_host == NULL || child_image == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+      sprintf(child_host, "%s/%s", next.host, names[i]->d_name);
+      /* symbolic links to files are followed, but not to directories,
+         which could lead round in a loop */
+      if (stat(child_host, &statbuf) < 0
+        || (!S_ISREG(statbuf.st_mode) && !S_ISDIR(statbuf.st_mode))
+        || (S_ISDIR(statbuf.st_mode) && (lstat(child_host, &linkbuf) < 0
+          || !S_ISDIR(linkbuf.st_mode)))) {
+        fprintf(stderr, "Not copying %s: not a file or directory\n",
+          child_host);
+        s->status = 1;
+      } else if (!dos_name(fullname, names[i]->d_name,
+          S_ISDIR(statbuf.st_mode) ? ATTR_DIRECTORY : ATTR_NORMAL)) {
+        fprintf(stderr, "Can't make a file name for %s in the disk image\n",
+          child_host);
+        s->status = 1;
+      } else if (strlen(next.image) + 1 + strlen(fullname) > MAXPATHLEN) {
+        fprintf(stderr, "Path too long\n");
+        s->status = 1;
+      } else {
+        sprintf(child_image, next.image[0] == '\0' ? "%s%s" : "%s/%s",
+          next.image, fullname);
+        if (S_ISREG(statbuf.st_mode)) {
+          copy_in_one(s, child_host, dir, fullname, child_image);
+        } else {
+          if (npending == size) {
+            size *= 2;
+            grown = realloc(pending, size * sizeof(struct pending_dir));
+            if (grown == NULL) {
+              fprintf(stderr, "Out of memory\n");
+              exit(1);
+            }
+            pending = grown;
+          }
+          pending[npending].host = child_host;
+          pending[npending].image = child_image;
+          npending++;
+          child_host = child_image = NULL;
+        }
+      }
+      free(child_host);
+      free(child_image);
+      free(names[i]);
+    }
+    if (n >= 0) {
+      free(names);
+    }
+    free(next.host);
+    free(next.image);
+    for (lo = first, hi = npending; hi > lo + 1; lo++, hi--) {
+      next = pending[lo];
+      pending[lo] = pending[hi - 1];
+      pending[hi - 1] = next;
+    }
+  }
+  free(pending);
+}
+
+/* copy_in copies src, a file or (with -r) a directory outside the
+   image, into the image as dst.  If into_dir is set, or dst is a
+   directory, it goes in there under its own name */
+static void copy_in(struct copy_session *s, const char *src,
+  const char *dst, int into_dir)
+{
+  char path[MAXPATHLEN + 1];
+  char shown[MAXPATHLEN + 1];
+  char fullname[13];
+  const char *base;
+  char *leaf, *copy;
+  struct stat statbuf;
+  int is_dir, dst_is_dir;
+  uint32_t dir;
+  size_t len;
+
+  assert(strncmp("a:", dst, 2)==0);
+  dst+=2;
+  if (image_path(path, dst) < 0) {
+    s->status = 1;
+    return;
+  }
+  is_dir = stat(src, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+  if (is_dir && !s->recursive) {
+    fprintf(stderr, "%s is a directory; copy it with -r\n", src);
+    s->status = 1;
+    return;
+  }
 
-  fclose(fd);
+  /* the last part of src, without any trailing slashes */
+  copy = strdup(src);
+  len = strlen(copy);
+  while (len > 1 && copy[len - 1] == '/') {
+    copy[--len] = '\0';
+  }
+  base = strrchr(copy, '/') != NULL ? strrchr(copy, '/') + 1 : copy;
+
+  len = strlen(dst);
+  dst_is_dir = into_dir || path[0] == '\0'
+    || (len > 0 && (dst[len - 1] == '/' || dst[len - 1] == '\\'))
+    || image_dir(s, path, FALSE, &dir);
+  if (dst_is_dir) {
+    /* it goes in there under the name it has now */
+    if (is_dir && (strcmp(base, ".") == 0 || strcmp(base, "..") == 0)) {
+      leaf = NULL;
+    } else if (!dos_name(fullname, base,
+        is_dir ? ATTR_DIRECTORY : ATTR_NORMAL)) {
+      fprintf(stderr, "Can't make a file name for %s in the disk image\n",
+        src);
+      s->status = 1;
+      free(copy);
+      return;
+    } else {
+      leaf = fullname;
+    }
+  } else {
+    split_path(path, &leaf);
+  }
+
+  if (leaf == NULL) {
+    /* "dir/." - copy what's in it */
+    strcpy(shown, path);
+  } else if (strlen(path) + 1 + strlen(leaf) > MAXPATHLEN) {
+    fprintf(stderr, "Path too long\n");
+    s->status = 1;
+    free(copy);
+    return;
+  } else {
+    sprintf(shown, path[0] == '\0' ? "%s%s" : "%s/%s", path, leaf);
+  }
+
+  if (is_dir) {
+    copy_in_tree(s, src, shown);
+  } else if (!image_dir(s, path, s->recursive, &dir)) {
+    fprintf(stderr, "Directory does not exists in the disk image\n");
+    s->status = 1;
+  } else {
+    copy_in_one(s, src, dir, leaf, shown);
+  }
+  free(copy);
+}
+
+/* copy_item copies src to dst, in whichever direction the "a:" says.
+   Returns FALSE if neither or both of them are in the image */
+static int copy_item(struct copy_session *s, const char *src,
+  const char *dst, int into_dir)
+{
+  /* use the "a:" bit to determine whether we're copying in or out */
+  if (strncmp("a:", src, 2)==0 && strncmp("a:", dst, 2)!=0) {
+    /* copy from FAT-12 disk image to external filesystem */
+    copy_out(s, src, dst, into_dir);
+  } else if (strncmp("a:", dst, 2)==0 && strncmp("a:", src, 2)!=0) {
+    /* copy from external filesystem to FAT-12 disk image */
+    copy_in(s, src, dst, into_dir);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* copy_manifest copies everything listed in the file manifest ("-"
+   for standard input): one copy per line, the source and then the
+   destination, separated by a tab, or by spaces if there's no tab.
+   Blank lines and lines starting with '#' are skipped */
+static void copy_manifest(struct copy_session *s, const char *manifest)
+{
+  char line[2 * PATH_MAX];
+  char *src, *dst, *end;
+  uint32_t lineno = 0;
+  FILE *f;
+
+  f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Can't open manifest %s\n", manifest);
+    s->status = 1;
+    return;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+    src = line + strspn(line, " \t");
+    if (*src == '\0' || *src == '#') {
+      continue;
+    }
+    dst = strchr(src, '\t');
+    if (dst == NULL) {
+      dst = src + strcspn(src, " ");
+    }
+    if (*dst != '\0') {
+      *dst++ = '\0';
+      dst += strspn(dst, " \t");
+    }
+    /* and no trailing blanks */
+    end = dst + strlen(dst);
+    while (end > dst && (end[-1] == ' ' || end[-1] == '\t')) {
+      *--end = '\0';
+    }
+    if (*dst == '\0' || !copy_item(s, src, dst, FALSE)) {
+      fprintf(stderr, "%s:%u: need a source and a destination, one of "
+        "them in the image\n", manifest, lineno);
+      s->status = 1;
+    }
+  }
+  if (f != stdin) {
+    fclose(f);
+  }
 }
 
 void usage()
 {
   fprintf(stderr, "Usage:\n");
-  fprintf(stderr, "  dos_cp <imagename> a:<filename1> <filename2>\n");
-  fprintf(stderr, "    copies file called filename1 from disk image to a normal file\n");
-  fprintf(stderr, "  dos_cp <imagename> <filename3> a:<filename4>\n");
-  fprintf(stderr, "    copies normal file called filename3 into disk image as filename4\n");
+  fprintf(stderr, "  dos_cp [-r] [-c maxchain] [-q depth] [-i mmap|pread] [-m cachekb] [-v] <imagename> a:<filename1>... <filename2>\n");
+  fprintf(stderr, "    copies files called filename1 from disk image to a normal file,\n");
+  fprintf(stderr, "    or into the directory filename2 if there's more than one\n");
+  fprintf(stderr, "    -q keeps up to depth reads in flight (default %d, 0 for\n", READER_DEFAULT_DEPTH);
+  fprintf(stderr, "       one at a time without io_uring)\n");
+  fprintf(stderr, "  dos_cp [-r] [-f] <imagename> <filename3>... a:<filename4>\n");
+  fprintf(stderr, "    copies normal files called filename3 into disk image as filename4,\n");
+  fprintf(stderr, "    or into the directory filename4 if there's more than one\n");
+  fprintf(stderr, "    -f reports how many fragments each new file was written in\n");
+  fprintf(stderr, "  dos_cp -l manifest [-r] [-f] <imagename>\n");
+  fprintf(stderr, "    does each copy listed in manifest, a source and a destination\n");
+  fprintf(stderr, "    per line (\"-\" reads the list from standard input)\n");
+  fprintf(stderr, "  -r copies directories and everything in them, and makes any\n");
+  fprintf(stderr, "     directories missing from a path in the disk image\n");
+  fprintf(stderr, "  -c stops following a chain after maxchain clusters\n");
+  fprintf(stderr, "  -i reads the image with mmap (the default) or pread\n");
+  fprintf(stderr, "  -m caches up to cachekb KB of the image with -i pread\n");
+  fprintf(stderr, "  -v reports how well the cache did, and how the files were read\n");
   exit(1);
 }
 
 int main(int argc, char** argv)
 {
-  int fd;
-  uint8_t *image_buf;
-  struct bpb33* bpb;
-  if (argc < 4 || argc > 4) {
+  int opt, i, nsources, copy_out_dir;
+  int backend = IO_MMAP;
+  uint32_t max_chain = 0;
+  size_t cache_size = 0;
+  char *manifest = NULL, *dst;
+  struct copy_session s;
+  struct stat statbuf;
+
+  memset(&s, 0, sizeof(struct copy_session));
+  s.depth = READER_DEFAULT_DEPTH;
+  while ((opt = getopt(argc, argv, "fc:i:l:m:q:rv")) != -1) {
+    switch (opt) {
+    case 'f':
+      s.report_fragments = TRUE;
+      break;
+    case 'c':
+      max_chain = atoi(optarg);
+      break;
+    case 'i':
+      backend = io_backend(optarg);
+      if (backend < 0) {
+        usage();
+      }
+      break;
+    case 'l':
+      manifest = optarg;
+      break;
+    case 'm':
+      cache_size = (size_t)atoi(optarg) * 1024;
+      break;
+    case 'q':
+      s.depth = atoi(optarg);
+      break;
+    case 'r':
+      s.recursive = TRUE;
+      break;
+    case 'v':
+      s.verbose = TRUE;
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (manifest != NULL ? argc != 2 : argc < 4) {
     usage();
   }
 
-  image_buf = mmap_file(argv[1], &fd);
-  bpb = check_bootsector(image_buf);
+  /* the sources all have to be on the same side of the copy, and the
+     destination on the other; more than one, and the destination has
+     to be a directory */
+  nsources = argc - 3;
+  dst = argv[argc - 1];
+  copy_out_dir = FALSE;
+  if (manifest == NULL) {
+    for (i = 2; i < argc - 1; i++) {
+      if ((strncmp("a:", argv[i], 2)==0) != (strncmp("a:", argv[2], 2)==0)
+        || (strncmp("a:", argv[i], 2)==0) == (strncmp("a:", dst, 2)==0)) {
+        usage();
+      }
+    }
+    copy_out_dir = nsources > 1 && strncmp("a:", dst, 2)!=0;
+    if (copy_out_dir && (stat(dst, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode))) {
+      fprintf(stderr, "%s is not a directory\n", dst);
+      exit(1);
+    }
+  }
 
-  /* use the "a:" bit to determine whether we're copying in or out */
-  if (strncmp("a:", argv[2], 2)==0) {
-  /* copy from FAT-12 disk image to external filesystem */
-    copyout(argv[2], argv[3], image_buf, bpb);
-  } else if (strncmp("a:", argv[3], 2)==0) {
-  /* copy from external filesystem to FAT-12 disk image */
-    copyin(argv[2], argv[3], image_buf, bpb);
+  s.io = open_image(argv[1], backend, IMAGE_SHARED, cache_size);
+  s.bpb = check_bootsector(s.io);
+  s.fat = load_fat_table(s.io, s.bpb);
+  if (max_chain > 0 && max_chain < s.fat->max_chain) {
+    s.fat->max_chain = max_chain;
+  }
+  dir_index_start(s.fat);
+
+  if (manifest != NULL) {
+    copy_manifest(&s, manifest);
   } else {
-    usage();
+    for (i = 2; i < argc - 1; i++) {
+      copy_item(&s, argv[i], dst, nsources > 1);
+    }
   }
-  close(fd);
-  exit(0);
+
+  save_session(&s);
+  if (s.verbose) {
+    if (s.files != 1 || s.dirs_made > 0) {
+      fprintf(stderr, "copied %u files, made %u directories\n", s.files,
+        s.dirs_made);
+      fprintf(stderr, "looked up %llu names, reading %llu directories\n",
+        (unsigned long long)s.fat->index->lookups,
+        (unsigned long long)s.fat->index->scans);
+    }
+    io_report(s.io, stderr);
+  }
+  free_fat_table(s.fat);
+  io_close(s.io);
+  free(s.bpb);
+  exit(s.status);
 }
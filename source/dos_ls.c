@@ -15,6 +15,7 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "io.h"
 
 
 void print_indent(int indent)
@@ -24,102 +25,133 @@ void print_indent(int indent)
     printf(" ");
 }
 
-void follow_dir(uint16_t cluster, int indent,
-  uint8_t *image_buf, struct bpb33* bpb)
+/* follow_dir lists the tree below the directory at cluster.  It
+   walks with an explicit stack of open directories rather than
+   recursing, indenting each entry by how deep it is */
+void follow_dir(uint32_t cluster, int indent,
+  struct image_io *io, struct bpb710* bpb, struct fat_table *fat)
 {
+  struct tree_walk walk;
   struct direntry *dirent;
-  int d, i;
-  dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-  while (1) {
-    for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-        d += sizeof(struct direntry)) {
-      char name[9];
-      char extension[4];
-      uint32_t size;
-      uint16_t file_cluster;
-      name[8] = ' ';
-      extension[3] = ' ';
-      memcpy(name, &(dirent->deName[0]), 8);
-      memcpy(extension, dirent->deExtension, 3);
+  int i, depth_indent;
 
-      if (name[0] == SLOT_EMPTY)
-        return;
+  tree_walk_start(&walk, cluster, DEFAULT_MAX_DEPTH, io, bpb, fat);
+  while ((dirent = tree_walk_next(&walk)) != NULL) {
+    char name[9];
+    char extension[4];
+    uint32_t size;
+    uint32_t file_cluster;
+    name[8] = ' ';
+    extension[3] = ' ';
+    memcpy(name, &(dirent->deName[0]), 8);
+    memcpy(extension, dirent->deExtension, 3);
 
-      /* skip over deleted entries */
-      if (((uint8_t)name[0]) == SLOT_DELETED)
-        continue;
+    /* skip over deleted entries */
+    if (((uint8_t)name[0]) == SLOT_DELETED)
+      continue;
 
-      /* names are space padded - remove the spaces */
-      for (i = 8; i > 0; i--) {
-        if (name[i] == ' ')
-          name[i] = '\0';
-        else
-          break;
-      }
+    /* names are space padded - remove the spaces */
+    for (i = 8; i > 0; i--) {
+      if (name[i] == ' ')
+        name[i] = '\0';
+      else
+        break;
+    }
 
-      /* remove the spaces from extensions */
-      for (i = 3; i > 0; i--) {
-        if (extension[i] == ' ')
-          extension[i] = '\0';
-        else
-          break;
-      }
+    /* remove the spaces from extensions */
+    for (i = 3; i > 0; i--) {
+      if (extension[i] == ' ')
+        extension[i] = '\0';
+      else
+        break;
+    }
 
-      /* don't print "." or ".." directories */
-      if (strcmp(name, ".")==0) {
-        dirent++;
-        continue;
-      }
-      if (strcmp(name, "..")==0) {
-        dirent++;
-        continue;
-      }
+    /* don't print "." or ".." directories */
+    if (strcmp(name, ".")==0) {
+      continue;
+    }
+    if (strcmp(name, "..")==0) {
+      continue;
+    }
 
-      if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
-        printf("Volume: %s\n", name);
-      } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
-        print_indent(indent);
-        printf("%s (directory)\n", name);
-        file_cluster = getushort(dirent->deStartCluster);
-        follow_dir(file_cluster, indent+2, image_buf, bpb);
-      } else {
-        file_cluster = getushort(dirent->deStartCluster);
-        size = getulong(dirent->deFileSize);
-        print_indent(indent);
-        printf("%s.%s (%u bytes) (%i)\n",
-          name, extension, size, file_cluster);
+    depth_indent = indent + 2 * (walk.depth - 1);
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
+      printf("Volume: %s\n", name);
+    } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+      print_indent(depth_indent);
+      printf("%s (directory)\n", name);
+      file_cluster = dirent_start(dirent, fat);
+      switch (tree_walk_descend(&walk, file_cluster)) {
+      case WALK_TOO_DEEP:
+        print_indent(depth_indent + 2);
+        printf("(too deep to list)\n");
+        break;
+      case WALK_LOOP:
+        print_indent(depth_indent + 2);
+        printf("(directory loop, listed already)\n");
+        break;
       }
-      dirent++;
-    }
-    if (cluster == 0) {
-      // root dir is special
-      dirent++;
     } else {
-      cluster = get_fat_entry(cluster, image_buf, bpb);
-      dirent = (struct direntry*)cluster_to_addr(cluster,
-        image_buf, bpb);
+      file_cluster = dirent_start(dirent, fat);
+      size = getulong(dirent->deFileSize);
+      print_indent(depth_indent);
+      printf("%s.%s (%u bytes) (%u)\n",
+        name, extension, size, file_cluster);
     }
   }
+  tree_walk_end(&walk);
 }
 
 void usage()
 {
-  fprintf(stderr, "Usage: dos_ls <imagename>\n");
+  fprintf(stderr, "Usage: dos_ls [-i mmap|pread] [-m cachekb] [-v] <imagename>\n");
+  fprintf(stderr, "  -i reads the image with mmap (the default) or pread\n");
+  fprintf(stderr, "  -m caches up to cachekb KB of the image with -i pread\n");
+  fprintf(stderr, "  -v reports how well the cache did\n");
   exit(1);
 }
 
 int main(int argc, char** argv)
 {
-  uint8_t *image_buf;
-  int fd;
-  struct bpb33* bpb;
+  struct image_io *io;
+  int opt, verbose = FALSE, backend = IO_MMAP;
+  size_t cache_size = 0;
+  struct bpb710* bpb;
+  struct fat_table *fat;
+
+  while ((opt = getopt(argc, argv, "i:m:v")) != -1) {
+    switch (opt) {
+    case 'i':
+      backend = io_backend(optarg);
+      if (backend < 0) {
+        usage();
+      }
+      break;
+    case 'm':
+      cache_size = (size_t)atoi(optarg) * 1024;
+      break;
+    case 'v':
+      verbose = TRUE;
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
   if (argc < 2 || argc > 2) {
     usage();
   }
 
-  image_buf = mmap_file(argv[1], &fd);
-  bpb = check_bootsector(image_buf);
-  follow_dir(0, 0, image_buf, bpb);
-  close(fd);
+  io = open_image(argv[1], backend, IMAGE_READONLY, cache_size);
+  bpb = check_bootsector(io);
+  fat = load_fat_table(io, bpb);
+  follow_dir(0, 0, io, bpb, fat);
+  free_fat_table(fat);
+  if (verbose) {
+    io_report(io, stderr);
+  }
+  io_close(io);
+  free(bpb);
   exit(0);
 }
@@ -10,487 +10,1639 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "io.h"
+#include "scan.h"
+#include "journal.h"
 
 /**
- * Removes padding from a given string
+ * Extracts just the filename part frim the file string.
  */
-void removePadding(char *string, u_int8_t length) {
-  int i;
-  for(i = length; i > 0; i--) {
-    if(string[i] == ' ') {
-      string[i] = '\0';
-    } else {
-      break;
+char* extractFileName(char *file) {
+  char *p2 = file; int i;
+  for (i = 0; i < strlen(file); i++) {
+    if (p2[i] == '/' || p2[i] == '\\') {
+      file = p2+i+1;
     }
   }
+  return p2;
 }
 
 /**
- * Gets the file name full filename in the current dirent and stores it
- * in the `fullname` variable.
+ * Updates the string to be uppercase
  */
-void get_name(char *fullname, struct direntry *dirent)
-{
-  char name[9];
-  char extension[4];
+void get_uppercase_string(char *string) {
+  int i;
+  for (i = 0; i < strlen(string); i++) {
+    string[i] = toupper(string[i]);
+  }
+}
 
-  name[8] = ' ';
-  extension[3] = ' ';
-  memcpy(name, &(dirent->deName[0]), 8);
-  memcpy(extension, dirent->deExtension, 3);
+/**
+ * Writes a new file or directory into the directory entry, which is in
+ * the directory at dir_cluster, and tells the directory index about it
+ */
+void write_dirent(struct direntry *dirent, uint32_t dir_cluster, char *filename,
+    uint32_t start_cluster, uint32_t size, uint8_t attributes, struct fat_table *fat) {
+  char *p, *p2;
+  char *uppername;
+  int len;
 
-  removePadding(name, 8);
-  removePadding(extension, 3);
+  fat_note_write(fat, dirent, sizeof(struct direntry));
+  memset(dirent, 0, sizeof(struct direntry));
 
-  fullname[0] = '\0';
-  strcat(fullname, name);
+  uppername = strdup(filename);
+  p2 = extractFileName(uppername);
+  get_uppercase_string(uppername);
 
-  /* append the extension if it's not a directory */
-  if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) {
-    strcat(fullname, ".");
-    strcat(fullname, extension);
+  // set the file name and extension
+  memset(dirent->deName, ' ', 8);
+  p = strchr(uppername, '.');
+  memcpy(dirent->deExtension, "___", 3);
+  if (p == NULL) {
+    fprintf(stderr, "No filename extension given - defaulting to .___\n");
+  } else {
+    *p = '\0';
+    p++;
+    len = strlen(p);
+    if (len > 3) len = 3;
+    memcpy(dirent->deExtension, p, len);
   }
+  if (strlen(uppername) > 8) {
+    uppername[8]='\0';
+  }
+  memcpy(dirent->deName, uppername, strlen(uppername));
+  free(p2);
+
+  // set the attributes and file size
+  dirent->deAttributes = attributes;
+  dirent_set_start(dirent, fat, start_cluster);
+  putulong(dirent->deFileSize, size);
+  dir_index_add(fat, dir_cluster, dirent);
 }
 
-/**
-  * find_file seeks through the directories in the memory disk image,
-  * until it finds the named file.
-  * @return the direntry of the file or NULL if it doesn't exist.
-  */
-#define FIND_FILE 0
-#define FIND_DIR 1
+/** The highest n a FOUNDn.DAT name in the root directory can have. */
+#define FOUND_MAX_NUMBER 999
 
-struct direntry* find_file(char *infilename, uint16_t cluster,
-  int find_mode, uint8_t *image_buf, struct bpb33* bpb)
-{
-  char buf[MAXPATHLEN];
-  char *seek_name, *next_name;
-  int d;
-  struct direntry *dirent;
-  uint16_t dir_cluster;
-  char fullname[13];
+/** How many FILEnnnn.CHK files one FOUND.nnn directory takes. */
+#define FOUND_DIR_FILES 10000
 
-  /* find the first dirent in this directory */
-  dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+/**
+ * A lost chain find_unreferenced_files wants saved as a file.
+ */
+struct lost_file {
+  uint32_t cluster;
+  uint32_t size;            /* in clusters */
+};
 
-  /* first we need to split the file name we're looking for into the
-     first part of the path, and the remainder.  We hunt through the
-     current directory for the first part.  If there's a remainder,
-     and what we find is a directory, then we recurse, and search
-     that directory for the remainder */
+/**
+ * Where lost files are being saved. They go in the root directory as
+ * FOUNDn.DAT while it has slots and names left; the names in use and the
+ * free slots come from one pass over the root. After that they go in
+ * a FOUND.nnn directory, made in the last free root slot, or if there's
+ * no slot left for one, the last FOUND.nnn directory already there.
+ */
+struct recovery {
+  struct direntry **slots;  /* free root slots, in directory order */
+  uint32_t nslots;
+  uint32_t next_slot;
+  uint32_t end_slot;        /* slots from here on are past the end of
+                               the root, so taking one has to end the
+                               directory again after it */
+  bool used[FOUND_MAX_NUMBER + 1];      /* FOUNDn.DAT is taken */
+  bool used_dirs[1000];                 /* FOUND.nnn is taken */
+  uint32_t last_dir;        /* the highest numbered of them, or 0 */
+  char last_dir_name[13];
+  uint32_t number;          /* the next FOUNDn.DAT to try */
+  uint32_t dir;             /* the FOUND.nnn directory, or 0 */
+  char dir_name[13];
+  uint32_t dir_cluster;     /* the cluster of it being filled */
+  uint32_t dir_slot;        /* the next slot in that cluster */
+  uint32_t dir_files;
+};
 
-  strncpy(buf, infilename, MAXPATHLEN);
-  seek_name = buf;
+/**
+ * Returns n if the space padded name is prefix followed by the decimal
+ * number n, or -1. A name with leading zeros counts too, which at worst
+ * means a free name gets skipped.
+ */
+static int numbered_name(const uint8_t *name, int length, const char *prefix) {
+  int i, n = 0, len = strlen(prefix);
 
-  /* trim leading slashes */
-  while (*seek_name == '/' || *seek_name == '\\') {
-    seek_name++;
+  if (memcmp(name, prefix, len) != 0 || name[len] < '0' || name[len] > '9') {
+    return -1;
   }
-
-  /* search for any more slashes - if so, it's a dirname */
-  next_name = seek_name;
-  while (1) {
-    if (*next_name == '/' || *next_name == '\\') {
-      *next_name = '\0';
-      next_name ++;
-      break;
+  for (i = len; i < length && name[i] != ' '; i++) {
+    if (name[i] < '0' || name[i] > '9') {
+      return -1;
     }
-    if (*next_name == '\0') {
-      /* end of name - no slashes found */
-      next_name = NULL;
-      if (find_mode == FIND_DIR) {
-        return dirent;
-      }
-      break;
+    n = n * 10 + name[i] - '0';
+  }
+  for (; i < length; i++) {
+    if (name[i] != ' ') {
+      return -1;
     }
-    next_name++;
   }
+  return n;
+}
+
+/**
+ * Reads the root directory once, noting the FOUNDn.DAT and FOUND.nnn
+ * names already in it and every slot a new entry can go in. dos_scandisk
+ * maps the image, so the slots stay good.
+ */
+static void recovery_start(struct scan *scan, struct recovery *rec) {
+  struct dir_iter it;
+  struct direntry *dirent;
+  uint32_t size = 64, i;
+  int n;
 
-  while (1) {
-    /* hunt a cluster for the relevant dirent.  If we reach the
-       end of the cluster, we'll need to go to the next cluster
-       for this directory */
-    for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-      d += sizeof(struct direntry)) {
-      if (dirent->deName[0] == SLOT_EMPTY) {
-        /* we failed to find the file */
-        return NULL;
+  memset(rec, 0, sizeof(struct recovery));
+  rec->number = 1;
+  rec->slots = malloc(size * sizeof(struct direntry *));
+  if (rec->slots == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  dir_iter_start(&it, MSDOSFSROOT, scan->io, scan->bpb, scan->fat);
+  while (true) {
+    dirent = dir_iter_next(&it, scan->io, scan->bpb, scan->fat);
+    if (dirent == NULL) {
+      /* the slots after the end of the directory are free too */
+      rec->end_slot = rec->nslots;
+      if (it.left == 0) {
+        break;
       }
-      if (dirent->deName[0] == SLOT_DELETED) {
-        /* skip over a deleted file */
-        dirent++;
-        continue;
+      dirent = (struct direntry *)io_get(scan->io,
+          it.offset + (uint64_t)it.slot * sizeof(struct direntry),
+          it.left * sizeof(struct direntry));
+      if (rec->nslots + it.left > size) {
+        size = rec->nslots + it.left;
+        rec->slots = realloc(rec->slots, size * sizeof(struct direntry *));
+        if (rec->slots == NULL) {
+          fprintf(stderr, "Out of memory\n");
+          exit(1);
+        }
       }
-      get_name(fullname, dirent);
-      if (strcmp(fullname, seek_name) == 0) {
-        /* found it! */
-        if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
-          /* it's a directory */
-          if (next_name == NULL) {
-            fprintf(stderr, "Cannot copy out a directory\n");
-            exit(1);
-          }
-          dir_cluster = getushort(dirent->deStartCluster);
-          return find_file(next_name, dir_cluster,
-           find_mode, image_buf, bpb);
-        } else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
-          /* it's a volume */
-          fprintf(stderr, "Cannot copy out a volume\n");
+      for (i = 0; i < it.left; i++) {
+        rec->slots[rec->nslots++] = dirent + i;
+      }
+      break;
+    }
+    if (dirent->deName[0] == SLOT_DELETED) {
+      if (rec->nslots == size) {
+        size *= 2;
+        rec->slots = realloc(rec->slots, size * sizeof(struct direntry *));
+        if (rec->slots == NULL) {
+          fprintf(stderr, "Out of memory\n");
           exit(1);
-        } else {
-          /* assume it's a file */
-          return dirent;
         }
       }
-      dirent++;
+      rec->slots[rec->nslots++] = dirent;
+      continue;
     }
-    /* we've reached the end of the cluster for this directory.
-       Where's the next cluster? */
-    if (cluster == 0) {
-      // root dir is special
-      dirent++;
-    } else {
-      cluster = get_fat_entry(cluster, image_buf, bpb);
-      dirent = (struct direntry*)cluster_to_addr(cluster,
-       image_buf, bpb);
+    if (memcmp(dirent->deExtension, "DAT", 3) == 0) {
+      n = numbered_name(dirent->deName, 8, "FOUND");
+      if (n >= 0 && n <= FOUND_MAX_NUMBER) {
+        rec->used[n] = true;
+      }
+    } else if (memcmp(dirent->deName, "FOUND   ", 8) == 0
+        && isdigit(dirent->deExtension[0]) && isdigit(dirent->deExtension[1])
+        && isdigit(dirent->deExtension[2])) {
+      n = numbered_name(dirent->deExtension, 3, "");
+      rec->used_dirs[n] = true;
+      if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+        rec->last_dir = dirent_start(dirent, scan->fat);
+        sprintf(rec->last_dir_name, "FOUND.%03d", n);
+      }
     }
   }
+  while (rec->number <= FOUND_MAX_NUMBER && rec->used[rec->number]) {
+    rec->number++;
+  }
 }
 
 /**
- * For a file, goes through the FAT and marks every cluster as
- * referenced.
+ * Takes the next free root slot, ending the directory after it if it
+ * was the end before.
  */
-void mark_file_cluster(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb, uint32_t bytes_remaining, bool *referenced_clusters) {
-  referenced_clusters[cluster] = true;
+static struct direntry *take_root_slot(struct scan *scan, struct recovery *rec) {
+  uint32_t i = rec->next_slot++;
+  struct direntry *dirent = rec->slots[i];
 
-  int total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-  int clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+  if (i >= rec->end_slot && i + 1 < rec->nslots && rec->slots[i + 1] == dirent + 1) {
+    fat_note_write(scan->fat, dirent + 1, sizeof(struct direntry));
+    memset(dirent + 1, 0, sizeof(struct direntry));
+  }
+  return dirent;
+}
+
+/**
+ * Allocates a cluster for a directory and clears it. Returns 0 if the
+ * disk is full.
+ */
+static uint32_t new_dir_cluster(struct scan *scan, uint8_t **data) {
+  uint32_t clust_size = bpb_geometry(scan->bpb)->cluster_size;
+  uint32_t cluster = fat_alloc_cluster(scan->fat);
 
   if (cluster == 0) {
-    fprintf(stderr, "Bad file termination\n");
-    return;
-  } else if (is_end_of_file(cluster)) {
-    return;
-  } else if (cluster > total_clusters) {
-    abort(); /* this shouldn't be able to happen */
+    return 0;
   }
-  /* more clusters after this one */
-  mark_file_cluster(get_fat_entry(cluster, image_buf, bpb), image_buf, bpb, bytes_remaining - clust_size, referenced_clusters);
+  *data = io_get(scan->io, cluster_offset(cluster, scan->bpb), clust_size);
+  fat_note_write(scan->fat, *data, clust_size);
+  memset(*data, 0, clust_size);
+  return cluster;
 }
 
 /**
- * Loops through the directory structure and marks every cluster it sees as referenced (true).
+ * Makes the first FOUND.nnn directory not already in the root, in the
+ * next free root slot. Returns false if it can't.
  */
-void find_referenced_clusters(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb, bool *referenced_clusters) {
-  referenced_clusters[cluster] = true;
+static bool make_found_dir(struct scan *scan, struct recovery *rec) {
   struct direntry *dirent;
-  int d, length = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-  dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-  while (1) {
-    for (d = 0; d < length; d += sizeof(struct direntry)) {
-      char name[9];
-      name[8] = ' ';
-      memcpy(name, &(dirent->deName[0]), 8);
-
-      if (name[0] == SLOT_EMPTY) {
-        return;
-      }
+  uint8_t *data;
+  uint32_t n;
 
-      /* skip over deleted entries */
-      if (((uint8_t)name[0]) == SLOT_DELETED)
-        continue;
+  for (n = 0; n < 1000 && rec->used_dirs[n]; n++) {
+  }
+  if (n == 1000 || rec->next_slot == rec->nslots) {
+    return false;
+  }
+  rec->dir = new_dir_cluster(scan, &data);
+  if (rec->dir == 0) {
+    return false;
+  }
+  rec->used_dirs[n] = true;
+  sprintf(rec->dir_name, "FOUND.%03u", n);
+
+  /* "." and "..", which is 0 for the root directory */
+  dirent = (struct direntry *)data;
+  memset(dirent[0].deName, ' ', 8);
+  memset(dirent[0].deExtension, ' ', 3);
+  dirent[0].deName[0] = '.';
+  dirent[0].deAttributes = ATTR_DIRECTORY;
+  dirent_set_start(&dirent[0], scan->fat, rec->dir);
+  memcpy(&dirent[1], &dirent[0], sizeof(struct direntry));
+  dirent[1].deName[1] = '.';
+  dirent_set_start(&dirent[1], scan->fat, 0);
+
+  write_dirent(take_root_slot(scan, rec), MSDOSFSROOT, rec->dir_name, rec->dir, 0,
+      ATTR_DIRECTORY, scan->fat);
+  rec->dir_cluster = rec->dir;
+  rec->dir_slot = 2;
+  rec->dir_files = 0;
+  return true;
+}
 
-      removePadding(name, 8);
+/**
+ * Carries on filling the FOUND.nnn directory an earlier run made, after
+ * the FILEnnnn.CHK files already in it. Returns false if there isn't
+ * one, or its chain doesn't end properly so it can't be grown.
+ */
+static bool reuse_found_dir(struct scan *scan, struct recovery *rec) {
+  struct dir_iter it;
+  struct direntry *dirent;
+  int n;
 
-      if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-        dirent++; continue;
+  if (rec->last_dir == 0) {
+    return false;
+  }
+  rec->dir = rec->last_dir;
+  strcpy(rec->dir_name, rec->last_dir_name);
+  rec->dir_files = 0;
+  dir_iter_start(&it, rec->dir, scan->io, scan->bpb, scan->fat);
+  while ((dirent = dir_iter_next(&it, scan->io, scan->bpb, scan->fat)) != NULL) {
+    n = numbered_name(dirent->deName, 8, "FILE");
+    if (dirent->deName[0] != SLOT_DELETED && n >= 0 && n >= rec->dir_files
+        && memcmp(dirent->deExtension, "CHK", 3) == 0) {
+      rec->dir_files = n + 1;
+    }
+  }
+  if (it.cluster < CLUST_FIRST || it.cluster >= scan->fat->nclusters
+      || (it.left == 0 && !is_end_of_file(fat_get(scan->fat, it.cluster)))) {
+    rec->dir = 0;
+    return false;
+  }
+  rec->dir_cluster = it.cluster;
+  rec->dir_slot = it.slot;
+  return true;
+}
+
+/**
+ * Saves the lost chain starting at cluster, size clusters long, as a
+ * file. left is how many there are still to save, counting this one,
+ * so the last root slot can be kept for a FOUND.nnn directory when
+ * they won't all fit.
+ */
+static void save_lost_file(struct scan *scan, struct recovery *rec, uint32_t cluster,
+    uint32_t size, uint32_t left) {
+  uint32_t clust_size = bpb_geometry(scan->bpb)->cluster_size;
+  uint32_t slots_left = rec->nslots - rec->next_slot;
+  struct direntry *dirent;
+  char filename[13];
+  uint8_t *data;
+
+  uint64_t bytes = (uint64_t)size * clust_size;
+  if (bytes > UINT32_MAX) {
+    bytes = UINT32_MAX;   /* as big as a FAT file can be */
+  }
+
+  if (rec->dir == 0) {
+    if (rec->number <= FOUND_MAX_NUMBER && slots_left > 0 && (slots_left > 1 || left == 1)) {
+      sprintf(filename, "FOUND%u.DAT", rec->number);
+      write_dirent(take_root_slot(scan, rec), MSDOSFSROOT, filename, cluster, bytes,
+          ATTR_NORMAL, scan->fat);
+      rec->used[rec->number] = true;
+      while (rec->number <= FOUND_MAX_NUMBER && rec->used[rec->number]) {
+        rec->number++;
       }
-      else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
-        uint16_t file_cluster = getushort(dirent->deStartCluster);
-        find_referenced_clusters(file_cluster, image_buf, bpb, referenced_clusters);
-      } else if((dirent->deAttributes & ATTR_VOLUME) == 0) { // Not a volume
-        uint16_t file_cluster = getushort(dirent->deStartCluster);
-        uint32_t size = getulong(dirent->deFileSize);
-        mark_file_cluster(file_cluster, image_buf, bpb, size, referenced_clusters);
+      return;
+    }
+    if (!make_found_dir(scan, rec) && !reuse_found_dir(scan, rec)) {
+      if (rec->number <= FOUND_MAX_NUMBER) {
+        fprintf(scan->err, "Root directory is full, cannot save FOUND%u.DAT\n", rec->number);
+      } else {
+        fprintf(scan->err, "Root directory is full, cannot save lost file %u\n", cluster);
       }
-      dirent++;
+      return;
     }
-    if (cluster == 0) {
-      dirent++;
-    } else {
-      cluster = get_fat_entry(cluster, image_buf, bpb);
-      dirent = (struct direntry*)cluster_to_addr(cluster,
-        image_buf, bpb);
+  }
+
+  if (rec->dir_files == FOUND_DIR_FILES) {
+    fprintf(scan->err, "%s is full, cannot save lost file %u\n", rec->dir_name, cluster);
+    return;
+  }
+  if (rec->dir_slot == clust_size / sizeof(struct direntry)) {
+    /* on to another cluster of the directory */
+    uint32_t next = new_dir_cluster(scan, &data);
+    if (next == 0) {
+      fprintf(scan->err, "No room to grow %s, cannot save lost file %u\n", rec->dir_name,
+          cluster);
+      return;
     }
+    fat_set(scan->fat, rec->dir_cluster, next);
+    rec->dir_cluster = next;
+    rec->dir_slot = 0;
+  }
+  dirent = (struct direntry *)io_get(scan->io, cluster_offset(rec->dir_cluster, scan->bpb),
+      clust_size) + rec->dir_slot++;
+  if (rec->dir_slot < clust_size / sizeof(struct direntry)) {
+    /* the directory ends after it */
+    fat_note_write(scan->fat, dirent + 1, sizeof(struct direntry));
+    memset(dirent + 1, 0, sizeof(struct direntry));
   }
+  sprintf(filename, "FILE%04u.CHK", rec->dir_files++);
+  write_dirent(dirent, rec->dir, filename, cluster, bytes, ATTR_NORMAL, scan->fat);
 }
 
 /**
- * Extracts just the filename part frim the file string.
+ * Every repair dos_scandisk is going to make, worked out before any of
+ * them is made. The FAT entries the repairs change are kept as a bit
+ * per cluster, so they can be checked against each other as they're
+ * planned, and applied in cluster order, which is image order.
  */
-char* extractFileName(char *file) {
-  char *p2 = file; int i;
-  for (i = 0; i < strlen(file); i++) {
-    if (p2[i] == '/' || p2[i] == '\\') {
-      file = p2+i+1;
-    }
+struct repair_plan {
+  uint64_t *ends;           /* clusters that become the end of a chain */
+  uint64_t *frees;          /* clusters that become free */
+  struct lost_file *lost;   /* lost chains to save as files */
+  uint32_t nlost;
+  uint32_t lost_size;
+  struct direntry **emptied;  /* empty files whose chain is freed, so
+                                 their start cluster becomes 0 */
+  uint32_t nemptied;
+  uint32_t emptied_size;
+  uint32_t cuts;            /* chains ended where they loop */
+  uint32_t truncations;     /* files whose chain is cut back */
+  uint32_t nends;
+  uint32_t nfrees;
+  uint32_t conflicts;
+};
+
+/**
+ * Starts an empty plan for the image being scanned.
+ */
+static void plan_init(struct scan *scan, struct repair_plan *plan) {
+  size_t words = (scan->fat->nclusters + 63) / 64;
+
+  memset(plan, 0, sizeof(struct repair_plan));
+  plan->ends = calloc(words, sizeof(uint64_t));
+  plan->frees = calloc(words, sizeof(uint64_t));
+  if (plan->ends == NULL || plan->frees == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
   }
-  return p2;
+}
+
+static void plan_free(struct repair_plan *plan) {
+  free(plan->ends);
+  free(plan->frees);
+  free(plan->lost);
+  free(plan->emptied);
 }
 
 /**
- * Updates the string to be uppercase
+ * Returns what the FAT entry for cluster will hold once the plan so far
+ * is applied.
  */
-void get_uppercase_string(char *string) {
-  int i;
-  for (i = 0; i < strlen(string); i++) {
-    string[i] = toupper(string[i]);
+static uint32_t planned_next(struct scan *scan, struct repair_plan *plan, uint32_t cluster) {
+  if (map_test(plan->frees, cluster)) {
+    return CLUST_FREE;
+  }
+  if (map_test(plan->ends, cluster)) {
+    return FAT32_MASK & CLUST_EOFS;
   }
+  return fat_get(scan->fat, cluster);
 }
 
 /**
- * Writes a new file into the directory entry
+ * Plans for cluster to end a chain. A cluster one repair frees and
+ * another keeps is a conflict; it's kept, since a chain still goes
+ * through it.
  */
-void write_dirent(struct direntry *dirent, char *filename, uint16_t start_cluster, uint32_t size) {
-  char *p, *p2;
-  char *uppername;
-  int len;
+static void plan_end(struct scan *scan, struct repair_plan *plan, uint32_t cluster) {
+  uint64_t bit = (uint64_t)1 << (cluster % 64);
 
-  memset(dirent, 0, sizeof(struct direntry));
+  if ((plan->frees[cluster / 64] & bit) != 0) {
+    fprintf(scan->err, "Conflicting repairs: cluster %u is freed and kept, keeping it\n",
+        cluster);
+    plan->frees[cluster / 64] &= ~bit;
+    plan->nfrees--;
+    plan->conflicts++;
+  }
+  if ((plan->ends[cluster / 64] & bit) == 0) {
+    plan->ends[cluster / 64] |= bit;
+    plan->nends++;
+  }
+}
 
-  uppername = strdup(filename);
-  p2 = extractFileName(uppername);
-  get_uppercase_string(uppername);
+/**
+ * Plans for cluster to be freed. Returns false, planning nothing, if
+ * another repair has already planned to free it or keep it.
+ */
+static bool plan_release(struct scan *scan, struct repair_plan *plan, uint32_t cluster) {
+  uint64_t bit = (uint64_t)1 << (cluster % 64);
 
-  // set the file name and extension
-  memset(dirent->deName, ' ', 8);
-  p = strchr(uppername, '.');
-  memcpy(dirent->deExtension, "___", 3);
-  if (p == NULL) {
-    fprintf(stderr, "No filename extension given - defaulting to .___\n");
-  } else {
-    *p = '\0';
-    p++;
-    len = strlen(p);
-    if (len > 3) len = 3;
-    memcpy(dirent->deExtension, p, len);
+  if (((plan->frees[cluster / 64] | plan->ends[cluster / 64]) & bit) != 0) {
+    fprintf(scan->err, "Conflicting repairs: cluster %u is already being %s\n", cluster,
+        (plan->frees[cluster / 64] & bit) != 0 ? "freed" : "kept");
+    plan->conflicts++;
+    return false;
   }
-  if (strlen(uppername) > 8) {
-    uppername[8]='\0';
+  plan->frees[cluster / 64] |= bit;
+  plan->nfrees++;
+  return true;
+}
+
+/**
+ * Applies the plan: the ends of chains, then the lost files, which
+ * may need new clusters for a FOUND.nnn directory, then the clusters
+ * being freed, so none of those is handed straight out again, and
+ * last the empty files' directory entries. The FAT entries go in
+ * cluster order a word of the maps at a time. Nothing reaches the
+ * image until the FAT is flushed and the journal built, which write
+ * it all in image order.
+ */
+static void apply_plan(struct scan *scan, struct repair_plan *plan) {
+  struct fat_table *fat = scan->fat;
+  uint32_t w, nwords = (fat->nclusters + 63) / 64, i;
+  struct recovery rec;
+  uint64_t bits;
+
+  for (w = 0; w < nwords; w++) {
+    for (bits = plan->ends[w]; bits != 0; bits &= bits - 1) {
+      fat_set(fat, w * 64 + __builtin_ctzll(bits), FAT32_MASK & CLUST_EOFS);
+    }
   }
-  memcpy(dirent->deName, uppername, strlen(uppername));
-  free(p2);
+  if (plan->nlost > 0) {
+    /* the root directory's free slots and names are worked out once */
+    recovery_start(scan, &rec);
+    for (i = 0; i < plan->nlost; i++) {
+      save_lost_file(scan, &rec, plan->lost[i].cluster, plan->lost[i].size,
+          plan->nlost - i);
+    }
+    free(rec.slots);
+  }
+  for (w = 0; w < nwords; w++) {
+    for (bits = plan->frees[w]; bits != 0; bits &= bits - 1) {
+      fat_set(fat, w * 64 + __builtin_ctzll(bits), CLUST_FREE);
+    }
+  }
+  for (i = 0; i < plan->nemptied; i++) {
+    fat_note_write(fat, plan->emptied[i], sizeof(struct direntry));
+    dirent_set_start(plan->emptied[i], fat, 0);
+  }
+}
 
-  // set the attributes and file size
-  dirent->deAttributes = ATTR_NORMAL;
-  putushort(dirent->deStartCluster, start_cluster);
-  putulong(dirent->deFileSize, size);
+/**
+ * Prints how big the plan was, and how many runs of bytes in the image
+ * it came to once the writes were merged.
+ */
+static void display_plan(struct scan *scan, struct repair_plan *plan, int ranges) {
+  fprintf(scan->out, "Repair plan: chains cut %u, files truncated %u, clusters freed %u, "
+      "lost files saved %u, conflicts %u, ranges written %d\n", plan->cuts,
+      plan->truncations, plan->nfrees, plan->nlost, plan->conflicts, ranges);
 }
 
 /**
- * Creates a new file in the root directory
- * Returns the new int for the filename
+ * Reports every file whose chain loops back on itself, and plans to end
+ * the chain at the cluster where it turned back.  Returns how many it
+ * found.
  */
-uint8_t create_new_file(int cluster, uint8_t *image_buf, struct bpb33* bpb, uint8_t file_number, uint32_t size) {
-  // Find the correct filename
-  char filename[13]; filename[0] = '\0';
-  do {
-    sprintf(filename, "%s%i%s", "FOUND", file_number, ".DAT");
-    file_number++;
-  } while(find_file(filename, 0, FIND_FILE, image_buf, bpb) != NULL);
+int fix_cycles(struct scan *scan, struct repair_plan *plan) {
+  uint32_t i;
+  int cycles = 0;
 
-  uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+  for (i = 0; i < scan->nfiles; i++) {
+    struct file_record *file = &scan->files[i];
+    /* a looping directory tree can list the same file twice */
+    if (file->loop_cluster == 0
+        || is_end_of_file(planned_next(scan, plan, file->loop_cluster))) {
+      continue;
+    }
+    fprintf(scan->out, "Cycle: %s.%s %u\n", file->name, file->extension, file->loop_cluster);
+    plan_end(scan, plan, file->loop_cluster);
+    plan->cuts++;
+    cycles++;
+  }
+  return cycles;
+}
+
+/**
+ * Reports every cluster where the chains of two or more files or
+ * directories run together, with their names.  Returns how many.
+ */
+int display_cross_links(struct scan *scan) {
+  struct cross_link *links;
+  uint32_t nlinks, i, j;
+  char fullname[13];
+  int shared = 0;
 
-  struct direntry *dirent = (struct direntry*) cluster_to_addr(0, image_buf, bpb);
-  while(1) {
-    if (dirent->deName[0] == SLOT_EMPTY) {
-      write_dirent(dirent, filename, cluster, size * clust_size);
-      dirent++;
+  for (i = 0; i < (scan->fat->nclusters + 63) / 64 && scan->shared_map[i] == 0; i++) {
+  }
+  if (i == (scan->fat->nclusters + 63) / 64) {
+    return 0;
+  }
 
-      // make sure the next dirent is set to be empty, just in case it wasn't before
-      memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-      dirent->deName[0] = SLOT_EMPTY;
-      return file_number;
+  nlinks = find_cross_links(scan, &links);
+  for (i = 0; i < nlinks; i = j) {
+    for (j = i + 1; j < nlinks && links[j].cluster == links[i].cluster; j++) {
     }
-    if (dirent->deName[0] == SLOT_DELETED) {
-      // we found a deleted entry - we can just overwrite it
-      write_dirent(dirent, filename, cluster, size * clust_size);
-      return file_number;
+    if (j - i < 2) {
+      /* only this chain reaches it here: another joined further up */
+      continue;
     }
-    dirent++;
+    fprintf(scan->out, "Cross-linked: %u", links[i].cluster);
+    for (; i < j; i++) {
+      get_name(fullname, links[i].dirent);
+      fprintf(scan->out, " %s", fullname);
+    }
+    fprintf(scan->out, "\n");
+    shared++;
   }
+  free(links);
+  return shared;
 }
 
 /**
- * Gets the size of the given file (in clusters) by going through the FAT.
+ * Returns the first cluster from from on that the FAT has in use but no
+ * chain goes through, or nclusters if there isn't one. It goes through
+ * the free map and the reference map a 64 bit word at a time.
  */
-uint32_t get_file_size(int cluster, uint8_t *image_buf, struct bpb33* bpb) {
-  uint32_t size = 0;
-  while (!is_end_of_file(cluster)) {
-    cluster = get_fat_entry(cluster, image_buf, bpb);
-    size++;
+static uint32_t next_unreferenced(struct scan *scan, uint32_t from) {
+  struct fat_table *fat = scan->fat;
+  uint32_t w, nwords = (fat->nclusters + 63) / 64;
+  uint64_t bits;
+
+  if (from < CLUST_FIRST) {
+    from = CLUST_FIRST;
+  }
+  if (from >= fat->nclusters) {
+    return fat->nclusters;
   }
-  return size;
+  w = from / 64;
+  bits = ~(fat->free_map[w] | scan->ref_map[w]) & (~(uint64_t)0 << (from % 64));
+  while (bits == 0) {
+    if (++w == nwords) {
+      return fat->nclusters;
+    }
+    bits = ~(fat->free_map[w] | scan->ref_map[w]);
+  }
+  /* the bits past the last cluster are clear in both maps */
+  from = w * 64 + __builtin_ctzll(bits);
+  return from < fat->nclusters ? from : fat->nclusters;
 }
 
 /**
- * Marks all the clusters as referenced
+ * Returns how many clusters the FAT has in use but no chain goes
+ * through.
  */
-void mark_clusters_referenced(int cluster, uint8_t *image_buf, struct bpb33* bpb, bool *referenced_clusters) {
-  while (!is_end_of_file(cluster)) {
-    referenced_clusters[cluster] = true;
-    cluster = get_fat_entry(cluster, image_buf, bpb);
+static uint32_t count_unreferenced(struct scan *scan) {
+  struct fat_table *fat = scan->fat;
+  uint32_t w, nwords = (fat->nclusters + 63) / 64, count = 0;
+  uint64_t bits;
+
+  for (w = 0; w < nwords; w++) {
+    bits = ~(fat->free_map[w] | scan->ref_map[w]);
+    if (w == 0) {
+      /* the two reserved entries */
+      bits &= ~(uint64_t)0 << CLUST_FIRST;
+    }
+    if (w == nwords - 1 && fat->nclusters % 64 != 0) {
+      bits &= ((uint64_t)1 << (fat->nclusters % 64)) - 1;
+    }
+    count += __builtin_popcountll(bits);
   }
-  referenced_clusters[cluster] = true;
+  return count;
 }
 
-
 /**
  * Displays the unreferenced clusters, as specified in the assignment
  */
-void display_unreferenced_clusters(uint8_t *image_buf, struct bpb33* bpb, bool *referenced_clusters, int total_clusters) {
-  bool title_displayed = false; int i;
-  for(i = 2; i < total_clusters; i++) {
-    if(referenced_clusters[i] == false && get_fat_entry(i, image_buf, bpb) != CLUST_FREE) {
-      if(!title_displayed) { printf("Unreferenced: "); title_displayed = true; }
-      printf("%i ", i);
-    }
+void display_unreferenced_clusters(struct scan *scan) {
+  uint32_t i = next_unreferenced(scan, CLUST_FIRST);
+
+  if (i == scan->fat->nclusters) {
+    return;
   }
-  if(title_displayed) printf("\n");
+  fprintf(scan->out, "Unreferenced: ");
+  for (; i < scan->fat->nclusters; i = next_unreferenced(scan, i + 1)) {
+    fprintf(scan->out, "%u ", i);
+  }
+  fprintf(scan->out, "\n");
 }
 
+/* chain_length value for a cluster on the chain being walked */
+#define ON_PATH UINT32_MAX
+
 /**
- * Goes through all unreferenced clusters and finds lost files.
- * We assume that a lost file starts with the lowest cluster in the file.
+ * Builds the predecessor index for lost clusters: for every cluster,
+ * how many unreferenced clusters point at it (saturating at 255).  An
+ * unreferenced cluster nothing points at is where a lost file really
+ * starts, whatever order its clusters were allocated in.
  */
-void find_unreferenced_files(uint8_t *image_buf, struct bpb33* bpb, bool *referenced_clusters, int total_clusters) {
-  uint8_t files_found = 1;
-  int i;
-  for(i = 2; i < total_clusters; i++) {
-    if(referenced_clusters[i] == false && get_fat_entry(i, image_buf, bpb) != CLUST_FREE) {
-      uint16_t size = get_file_size(i, image_buf, bpb);
-      mark_clusters_referenced(i, image_buf, bpb, referenced_clusters);
-      printf("Lost File: %i %i\n", i, size);
+static uint8_t *lost_in_degrees(struct scan *scan) {
+  struct fat_table *fat = scan->fat;
+  uint8_t *in_degree = calloc(fat->nclusters, 1);
+  uint32_t i;
 
-      files_found = create_new_file(i, image_buf,bpb, files_found, size);
+  if (in_degree == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (i = next_unreferenced(scan, CLUST_FIRST); i < fat->nclusters;
+      i = next_unreferenced(scan, i + 1)) {
+    uint32_t next = fat_get(fat, i);
+    if (next >= CLUST_FIRST && next < fat->nclusters && in_degree[next] < 255) {
+      in_degree[next]++;
     }
   }
+  return in_degree;
 }
 
 /**
- * Frees all the clusters inbetween and including the true end and the false end cluster
+ * Returns the length of the lost chain starting at head and marks its
+ * clusters as referenced.  The length of every cluster walked is kept
+ * in chain_length, so a chain that runs into one already sized stops
+ * there and every cluster is only walked once.  A chain that loops
+ * back on itself is planned to be cut where it loops, so the recovered
+ * file ends, and the cluster it's cut after goes in *loop_cluster.
  */
-void free_clusters(uint16_t true_end, uint16_t false_end, uint8_t *image_buf, struct bpb33* bpb) {
-  uint16_t current = true_end;
+static uint32_t lost_chain_length(struct scan *scan, struct repair_plan *plan, uint32_t head,
+    uint32_t *chain_length, uint32_t *path, uint32_t *loop_cluster) {
+  struct fat_table *fat = scan->fat;
+  uint32_t n = 0, tail = 0;
+  uint32_t cluster = head;
 
-  while(!is_end_of_file(current)) {
-      uint16_t next = get_fat_entry(current, image_buf, bpb);
-      set_fat_entry(current, FAT12_MASK&CLUST_FREE, image_buf, bpb);
-      current = next;
+  while (n < fat->max_chain) {
+    path[n++] = cluster;
+    chain_length[cluster] = ON_PATH;
+    scan->ref_map[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+
+    uint32_t next = fat_get(fat, cluster);
+    if (is_end_of_file(next) || next < CLUST_FIRST || next >= fat->nclusters) {
+      break;
+    }
+    if (chain_length[next] == ON_PATH) {
+      plan_end(scan, plan, cluster);
+      plan->cuts++;
+      *loop_cluster = cluster;
+      break;
+    }
+    if (chain_length[next] != 0) {
+      tail = chain_length[next];
+      break;
+    }
+    cluster = next;
   }
 
-  set_fat_entry(true_end, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+  /* fill in the lengths back from the end */
+  while (n > 0) {
+    if (tail < fat->max_chain) {
+      tail++;
+    }
+    chain_length[path[--n]] = tail;
+  }
+  return chain_length[head];
 }
 
 /**
- * Checks if the length of a file matches the one in the FAT
+ * Goes through all unreferenced clusters and finds lost files, adding
+ * them to the plan to be saved.
+ * A lost file starts at a cluster no other lost cluster points to;
+ * anything left over after those is a loop with no start, which we
+ * recover from its lowest cluster.  Returns how many it found.
  */
-void check_file_length(struct direntry *dirent, uint8_t *image_buf, struct bpb33* bpb, char *name, char *extension) {
-  uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-
-  uint32_t size = getulong(dirent->deFileSize);
-  int32_t size_in_clusters = (size + cluster_size - 1) / cluster_size;
+int find_unreferenced_files(struct scan *scan, struct repair_plan *plan) {
+  struct fat_table *fat = scan->fat;
+  uint8_t *in_degree;
+  uint32_t *chain_length, *path;
+  uint32_t i;
+  int pass, lost = 0;
 
-  uint16_t cluster = getushort(dirent->deStartCluster);
-  uint16_t fat_size_in_clusters = get_file_size(cluster, image_buf, bpb);
-  uint32_t fat_size = fat_size_in_clusters * cluster_size;
+  if (count_unreferenced(scan) == 0) {
+    /* nothing lost, so none of the per-cluster tables are needed */
+    return 0;
+  }
+  in_degree = lost_in_degrees(scan);
+  chain_length = calloc(fat->nclusters, sizeof(uint32_t));
+  path = malloc(fat->nclusters * sizeof(uint32_t));
+  if (chain_length == NULL || path == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (pass = 0; pass < 2; pass++) {
+    for (i = next_unreferenced(scan, CLUST_FIRST); i < fat->nclusters;
+        i = next_unreferenced(scan, i + 1)) {
+      if (pass == 1 || in_degree[i] == 0) {
+        uint32_t loop_cluster = 0;
+        uint32_t size = lost_chain_length(scan, plan, i, chain_length, path, &loop_cluster);
+        fprintf(scan->out, "Lost File: %u %u\n", i, size);
+        if (loop_cluster != 0) {
+          fprintf(scan->out, "Cycle: lost file %u %u\n", i, loop_cluster);
+        }
 
-  if(fat_size_in_clusters > size_in_clusters) {
-    printf("%s.%s %i %i\n", name, extension, size, fat_size);
-    free_clusters(cluster + size_in_clusters - 1, cluster + fat_size_in_clusters, image_buf, bpb);
+        if (plan->nlost == plan->lost_size) {
+          plan->lost_size = plan->lost_size == 0 ? 64 : plan->lost_size * 2;
+          plan->lost = realloc(plan->lost, plan->lost_size * sizeof(struct lost_file));
+          if (plan->lost == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+          }
+        }
+        plan->lost[plan->nlost].cluster = i;
+        plan->lost[plan->nlost].size = size;
+        plan->nlost++;
+        lost++;
+      }
+    }
   }
-  // No need to check smaller because that would not make sense
+  free(in_degree);
+  free(chain_length);
+  free(path);
+  return lost;
 }
 
 /**
- * Goes through the directory tree and checks if the length of all files match.
+ * Plans to free all the clusters after the true end of a file, and to mark
+ * the true end as the last cluster.  Clusters another chain still uses are
+ * left alone, and so is the rest of the chain after one another repair is
+ * already freeing.
  */
-void find_length_mismatches(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb) {
-  struct direntry *dirent;
-  int d, length = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-  dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-  while (1) {
-    for (d = 0; d < length; d += sizeof(struct direntry)) {
-      char name[9], extension[4];
-      name[8] = ' ';
-      extension[3] = ' ';
-      memcpy(name, &(dirent->deName[0]), 8);
-      memcpy(extension, dirent->deExtension, 3);
-
-      if (name[0] == SLOT_EMPTY) {
-        return;
+void free_clusters(uint32_t true_end, struct scan *scan, struct repair_plan *plan) {
+  struct fat_table *fat = scan->fat;
+  uint32_t current = planned_next(scan, plan, true_end);
+  uint32_t steps = 0;
+
+  while(!is_end_of_file(current) && current >= CLUST_FIRST && current < fat->nclusters
+      && steps++ < fat->max_chain) {
+      uint32_t next = planned_next(scan, plan, current);
+      if (cluster_refs(scan, current) > 1) {
+        /* cross-linked: the rest of the chain belongs to someone else too */
+        unref_cluster(scan, current);
+        break;
       }
+      if (!plan_release(scan, plan, current)) {
+        break;
+      }
+      current = next;
+  }
 
-      /* skip over deleted entries */
-      if (((uint8_t)name[0]) == SLOT_DELETED)
-        continue;
+  plan_end(scan, plan, true_end);
+}
+
+/**
+ * Reports every file whose chain is longer than its length in the directory
+ * entry says it should be, and plans to free the clusters beyond the end.
+ * Returns how many it found.
+ */
+int fix_length_mismatches(struct scan *scan, struct repair_plan *plan) {
+  uint32_t cluster_size = scan->bpb->bpbBytesPerSec * scan->bpb->bpbSecPerClust;
+  uint32_t i;
+  int mismatched = 0;
+
+  for (i = 0; i < scan->nfiles; i++) {
+    struct file_record *file = &scan->files[i];
+    uint32_t size_in_clusters = (file->size + cluster_size - 1) / cluster_size;
 
-      removePadding(name, 8);
-      removePadding(extension, 3);
+    // No need to check smaller because that would not make sense
+    if (file->fat_clusters <= size_in_clusters) {
+      continue;
+    }
+    fprintf(scan->out, "%s.%s %u %u\n", file->name, file->extension, file->size,
+      file->fat_clusters * cluster_size);
+    mismatched++;
+    plan->truncations++;
 
-      if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-        dirent++; continue;
-      } else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
+    if (file->last_cluster != 0) {
+      free_clusters(file->last_cluster, scan, plan);
+    } else {
+      /* an empty file shouldn't have any clusters at all */
+      uint32_t start = dirent_start(file->dirent, scan->fat);
+      if (map_test(plan->frees, start)) {
+        /* a looping directory tree listed it twice */
         continue;
-      } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
-        uint16_t file_cluster = getushort(dirent->deStartCluster);
-        find_length_mismatches(file_cluster, image_buf, bpb);
+      }
+      free_clusters(start, scan, plan);
+      if (cluster_refs(scan, start) > 1) {
+        unref_cluster(scan, start);
       } else {
-        check_file_length(dirent, image_buf, bpb, name, extension);
+        /* it was planned as the end of the chain just now */
+        plan->ends[start / 64] &= ~((uint64_t)1 << (start % 64));
+        plan->nends--;
+        plan_release(scan, plan, start);
+      }
+      if (plan->nemptied == plan->emptied_size) {
+        plan->emptied_size = plan->emptied_size == 0 ? 16 : plan->emptied_size * 2;
+        plan->emptied = realloc(plan->emptied, plan->emptied_size * sizeof(struct direntry *));
+        if (plan->emptied == NULL) {
+          fprintf(stderr, "Out of memory\n");
+          exit(1);
+        }
+      }
+      plan->emptied[plan->nemptied++] = file->dirent;
+    }
+  }
+  return mismatched;
+}
+
+/**
+ * Compares the free cluster count a FAT32 FSInfo sector records with
+ * what the FAT actually holds.  The sector itself is rewritten when the
+ * FAT is flushed, so this only has to report it.
+ */
+int check_fsinfo(struct scan *scan) {
+  struct fat_table *fat = scan->fat;
+
+  if (fat->fsinfo_offset == 0 || fat->fsinfo_free == FSINFO_UNKNOWN ||
+      fat->fsinfo_free == fat->nfree) {
+    return 0;
+  }
+  fprintf(scan->out, "FSInfo free clusters: %u %u\n", fat->fsinfo_free, fat->nfree);
+  return 1;
+}
+
+/** How many differing runs check_fat_copies lists for one copy. */
+#define FAT_DIFF_SHOWN 16
+
+/**
+ * Compares every other copy of the FAT with the one the scan is using,
+ * and lists the entries where each differs. Those entries are marked for
+ * writing back, so flushing the FAT brings every copy into line with
+ * the one used. Returns how many copies differed.
+ */
+int check_fat_copies(struct scan *scan) {
+  struct fat_table *fat = scan->fat;
+  struct extent *ranges;
+  uint32_t nranges, i, c;
+  int copy, differ = 0;
+
+  for (copy = 0; copy < scan->bpb->bpbFATs; copy++) {
+    if (copy == fat->copy) {
+      continue;
+    }
+    nranges = fat_compare_copies(fat, copy, &ranges);
+    if (nranges == 0) {
+      continue;
+    }
+    fprintf(scan->out, "FAT %d differs from FAT %d:", copy + 1, fat->copy + 1);
+    for (i = 0; i < nranges; i++) {
+      if (i < FAT_DIFF_SHOWN) {
+        if (ranges[i].length == 1) {
+          fprintf(scan->out, " %u", ranges[i].start);
+        } else {
+          fprintf(scan->out, " %u-%u", ranges[i].start, ranges[i].start + ranges[i].length - 1);
+        }
+      }
+      for (c = ranges[i].start; c < ranges[i].start + ranges[i].length; c++) {
+        fat_touch(fat, c);
       }
-      dirent++;
     }
-    if (cluster == 0) {
-      dirent++;
+    if (nranges > FAT_DIFF_SHOWN) {
+      fprintf(scan->out, " and %u more", nranges - FAT_DIFF_SHOWN);
+    }
+    fprintf(scan->out, "\n");
+    free(ranges);
+    differ++;
+  }
+  return differ;
+}
+
+/**
+ * One kind of problem quick_check looks for, and the first few clusters
+ * it found it at.
+ */
+struct quick_finding {
+  const char *label;
+  uint32_t count;
+  uint32_t shown[FAT_DIFF_SHOWN];
+};
+
+static void quick_note(struct quick_finding *finding, uint32_t cluster) {
+  if (finding->count < FAT_DIFF_SHOWN) {
+    finding->shown[finding->count] = cluster;
+  }
+  finding->count++;
+}
+
+/**
+ * Returns whether a FAT entry holds one of the reserved values just
+ * below the bad cluster marker: 0xff0 to 0xff6 on FAT-12, 0xfff0 to
+ * 0xfff6 on FAT-16 and 0xffffff0 to 0xffffff6 on FAT-32.  Only the last
+ * of them is widened when the FAT is decoded, so the test is made on
+ * the entry as it was on disk.
+ */
+static bool quick_reserved(struct fat_table *fat, uint32_t next) {
+  uint32_t mask = fat->type == 12 ? FAT12_MASK : fat->type == 16 ? FAT16_MASK : FAT32_MASK;
+
+  return (next & mask) >= (mask & 0xfffffff0) && (next & mask) < (mask & CLUST_BAD);
+}
+
+/**
+ * Returns whether a cluster belongs to some chain: it's neither free nor
+ * marked bad.
+ */
+static bool quick_used(struct fat_table *fat, uint32_t cluster) {
+  return fat->entries[cluster] != CLUST_FREE && fat->entries[cluster] != (FAT32_MASK & CLUST_BAD);
+}
+
+/**
+ * Follows the chain from cluster, setting the bit in reached for each
+ * used cluster on it, until it ends or comes to one already reached.
+ */
+static void quick_walk(struct fat_table *fat, uint64_t *reached, uint32_t cluster) {
+  while (cluster >= CLUST_FIRST && cluster < fat->nclusters && !quick_reserved(fat, cluster)
+      && quick_used(fat, cluster) && !map_test(reached, cluster)) {
+    reached[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+    cluster = fat->entries[cluster];
+  }
+}
+
+/**
+ * Checks what can be checked from the FAT alone, without reading a
+ * single directory: entries pointing past the end of the FAT or at a
+ * reserved value, chains that run into a free cluster, clusters more
+ * than one entry points at, loops that no chain leads into, and the
+ * FSInfo free count.  One pass over the FAT finds where each chain
+ * starts, and following them from there finds the loops, so every
+ * entry is read at most three times.  Reports the problems, how many
+ * clusters are free, used and bad, how many chains the used ones make
+ * up, and whether a full scan is worth running.  Returns how many
+ * problems it found.
+ */
+int quick_check(struct scan *scan) {
+  struct fat_table *fat = scan->fat;
+  struct quick_finding findings[] = {
+    {"Out of range"}, {"Reserved"}, {"Ends in free cluster"}, {"Shared"},
+    {"Loops with no start"}
+  };
+  uint32_t nfindings = sizeof(findings) / sizeof(findings[0]);
+  uint32_t i, j, next, nfree = 0, nused = 0, nbad = 0, nchains = 0;
+  uint64_t *seen, *shared, *reached, bit;
+  int problems;
+
+  problems = check_fsinfo(scan);
+
+  /* a cluster pointed at once sets its bit in seen, twice in shared */
+  seen = calloc((fat->nclusters + 63) / 64, sizeof(uint64_t));
+  shared = calloc((fat->nclusters + 63) / 64, sizeof(uint64_t));
+  reached = calloc((fat->nclusters + 63) / 64, sizeof(uint64_t));
+  if (seen == NULL || shared == NULL || reached == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (i = CLUST_FIRST; i < fat->nclusters; i++) {
+    next = fat->entries[i];
+    if (next == CLUST_FREE) {
+      nfree++;
+      continue;
+    }
+    if (next == (FAT32_MASK & CLUST_BAD)) {
+      nbad++;
+      continue;
+    }
+    nused++;
+    if (is_end_of_file(next)) {
+      continue;
+    }
+    if (next < CLUST_FIRST || quick_reserved(fat, next)) {
+      quick_note(&findings[1], i);
+      continue;
+    }
+    if (next >= fat->nclusters) {
+      quick_note(&findings[0], i);
+      continue;
+    }
+    if (fat->entries[next] == CLUST_FREE) {
+      quick_note(&findings[2], i);
+    }
+    bit = (uint64_t)1 << (next % 64);
+    if ((seen[next / 64] & bit) == 0) {
+      seen[next / 64] |= bit;
+    } else if ((shared[next / 64] & bit) == 0) {
+      shared[next / 64] |= bit;
+      quick_note(&findings[3], next);
+    }
+  }
+
+  /* every used cluster nothing points at starts a chain.  Whatever
+     used clusters those chains don't reach are in loops nothing leads
+     into, each of them a chain of its own */
+  for (i = CLUST_FIRST; i < fat->nclusters; i++) {
+    if (quick_used(fat, i) && !map_test(seen, i)) {
+      nchains++;
+      quick_walk(fat, reached, i);
+    }
+  }
+  for (i = CLUST_FIRST; i < fat->nclusters; i++) {
+    if (quick_used(fat, i) && !map_test(reached, i)) {
+      nchains++;
+      quick_note(&findings[4], i);
+      quick_walk(fat, reached, i);
+    }
+  }
+  free(seen);
+  free(shared);
+  free(reached);
+
+  for (i = 0; i < nfindings; i++) {
+    if (findings[i].count == 0) {
+      continue;
+    }
+    fprintf(scan->out, "%s:", findings[i].label);
+    for (j = 0; j < findings[i].count && j < FAT_DIFF_SHOWN; j++) {
+      fprintf(scan->out, " %u", findings[i].shown[j]);
+    }
+    if (findings[i].count > FAT_DIFF_SHOWN) {
+      fprintf(scan->out, " and %u more", findings[i].count - FAT_DIFF_SHOWN);
+    }
+    fprintf(scan->out, "\n");
+    problems += findings[i].count;
+  }
+  fprintf(scan->out, "Clusters: %u free, %u used in %u chains, %u bad\n", nfree, nused,
+      nchains, nbad);
+  if (problems == 0) {
+    fprintf(scan->out, "FAT is consistent\n");
+  } else {
+    fprintf(scan->out, "FAT has %d problem%s, run a full scan\n", problems,
+        problems == 1 ? "" : "s");
+  }
+  return problems;
+}
+
+/**
+ * Settings shared by every image dos_scandisk looks at.
+ */
+struct scan_options {
+  uint32_t max_depth;
+  uint32_t max_chain;
+  int nthreads;               /* threads per image's tree scan */
+  char *journal;              /* where to journal the repairs, or NULL
+                                 for <image>.journal (<image>.patch
+                                 for a dry run) */
+  bool dry_run;               /* leave the image alone, and just write
+                                 the journal as a patch */
+  int fat_copy;               /* which copy of the FAT to believe, from
+                                 0 */
+  bool plan;                  /* print a summary of the repair plan */
+  bool quick;                 /* only check the FAT, and repair nothing */
+};
+
+/**
+ * Makes the repairs for real.  Until now they've only been made in a
+ * private mapping of the image; first they're written to a journal on
+ * disk, and only once that's safely there are they copied into the
+ * image, all in one go.  If we're stopped half way through, the journal
+ * can still undo them.  Returns how many runs of bytes it changed, or
+ * -1, with the image untouched, if the journal can't be written.  A dry
+ * run stops once the journal is written, leaving it as a patch to apply
+ * later.
+ */
+static int commit_repairs(struct scan *scan, char *filename, int fd, size_t size,
+    struct scan_options *opts, FILE *err) {
+  const char *suffix = opts->dry_run ? ".patch" : ".journal";
+  struct journal journal;
+  char *path = opts->journal;
+  int result;
+
+  if (journal_build(&journal, scan->fat, fd, size) < 0) {
+    fprintf(err, "Cannot read disk image file %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  if (journal.nrecords == 0) {
+    journal_free(&journal);
+    return 0;
+  }
+
+  if (path == NULL) {
+    path = malloc(strlen(filename) + strlen(suffix) + 1);
+    if (path == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    sprintf(path, "%s%s", filename, suffix);
+  }
+  result = journal.nrecords;
+  if (journal_write(&journal, path) < 0) {
+    fprintf(err, "Cannot write repair journal %s: %s\n", path, strerror(errno));
+    result = -1;
+  } else if (!opts->dry_run
+      && journal_apply(&journal, fd, JOURNAL_REDO, filename, err) < 0) {
+    result = -1;
+  }
+  if (path != opts->journal) {
+    free(path);
+  }
+  journal_free(&journal);
+  return result;
+}
+
+/**
+ * Checks and repairs one image, writing its report to out and any
+ * warnings about it to err.  Returns the number of problems it fixed,
+ * or -1 if the image couldn't be checked at all or its repairs couldn't
+ * be saved.  It never exits, so a batch can carry on with the next
+ * image.
+ */
+int scandisk_image(char *filename, struct scan_options *opts, FILE *out, FILE *err) {
+  int problems, ranges;
+  const char *geometry_error;
+  struct repair_plan plan;
+  struct scan scan;
+
+  memset(&scan, 0, sizeof(scan));
+  scan.out = out;
+  scan.err = err;
+  /* the scan keeps pointers to dirents, and shares them between
+     threads, so it needs the whole image mapped */
+  scan.io = io_open(filename, IO_MMAP,
+    opts->dry_run || opts->quick ? IMAGE_READONLY : IMAGE_PRIVATE, 0);
+  if (scan.io == NULL) {
+    fprintf(err, "Cannot read disk image file %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  scan.bpb = check_bootsector(scan.io);
+  geometry_error = bpb_geometry_error(scan.bpb, scan.io->size);
+  if (geometry_error != NULL) {
+    fprintf(err, "Not a usable FAT image %s: %s\n", filename, geometry_error);
+    free(scan.bpb);
+    io_close(scan.io);
+    return -1;
+  }
+  if (opts->fat_copy >= scan.bpb->bpbFATs) {
+    fprintf(err, "%s has only %d FAT%s\n", filename, scan.bpb->bpbFATs,
+        scan.bpb->bpbFATs == 1 ? "" : "s");
+    free(scan.bpb);
+    io_close(scan.io);
+    return -1;
+  }
+  scan.fat = load_fat_copy(scan.io, scan.bpb, opts->fat_copy);
+  if (opts->quick) {
+    /* the FAT on its own: no directories, and nothing written */
+    problems = quick_check(&scan);
+    free_fat_table(scan.fat);
+    free(scan.bpb);
+    io_close(scan.io);
+    return problems;
+  }
+  scan.fat->track_writes = true;
+  if (opts->max_chain > 0 && opts->max_chain < scan.fat->max_chain) {
+    scan.fat->max_chain = opts->max_chain;
+  }
+  scan.max_depth = opts->max_depth;
+  scan_init(&scan);
+
+  /* one pass over the directory tree, then everything else works from
+     what it found */
+  scan_tree_parallel(&scan, opts->nthreads);
+
+  /* work out every repair before making any of them */
+  plan_init(&scan, &plan);
+  problems = check_fat_copies(&scan);
+  problems += check_fsinfo(&scan);
+  problems += fix_cycles(&scan, &plan);
+  problems += display_cross_links(&scan);
+  display_unreferenced_clusters(&scan);
+  problems += find_unreferenced_files(&scan, &plan);
+  problems += fix_length_mismatches(&scan, &plan);
+
+  /* then make them, and write them back to the image in one go */
+  apply_plan(&scan, &plan);
+  flush_fat_table(scan.fat);
+  ranges = commit_repairs(&scan, filename, scan.io->fd, scan.io->size, opts, err);
+  if (ranges < 0) {
+    problems = -1;
+  } else if (opts->plan && problems > 0) {
+    display_plan(&scan, &plan, ranges);
+  }
+  plan_free(&plan);
+
+  free_fat_table(scan.fat);
+  free(scan.bpb);
+  io_close(scan.io);
+  scan_free(&scan);
+  return problems;
+}
+
+/**
+ * One image in a batch, and what happened when it was scanned.
+ */
+struct batch_job {
+  char *filename;
+  char *report;               /* everything scandisk_image printed */
+  size_t report_len;
+  int result;
+  bool done;
+};
+
+/**
+ * A batch of images shared by a bounded pool of workers.  Workers take
+ * the next image off the list; the main thread prints the reports in
+ * list order as they finish, so the output doesn't depend on timing.
+ */
+struct batch {
+  struct batch_job *jobs;
+  uint32_t njobs;
+  uint32_t size;
+  uint32_t next;              /* next job to hand out, taken atomically */
+  struct scan_options *opts;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+/**
+ * Adds an image to the batch.
+ */
+static void add_batch_job(struct batch *batch, char *filename) {
+  if (batch->njobs == batch->size) {
+    batch->size = batch->size ? batch->size * 2 : 64;
+    batch->jobs = realloc(batch->jobs, batch->size * sizeof(struct batch_job));
+    if (batch->jobs == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  memset(&batch->jobs[batch->njobs], 0, sizeof(struct batch_job));
+  batch->jobs[batch->njobs++].filename = strdup(filename);
+}
+
+/**
+ * Reads image names one per line from list, skipping blank lines and
+ * lines starting with #.
+ */
+static void read_batch_list(struct batch *batch, FILE *list) {
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &line_size, list)) != -1) {
+    while (len > 0 && isspace((unsigned char)line[len - 1])) {
+      line[--len] = '\0';
+    }
+    if (len == 0 || line[0] == '#') {
+      continue;
+    }
+    add_batch_job(batch, line);
+  }
+  free(line);
+}
+
+/**
+ * Whether name is one of the repair journals or patches kept next to
+ * the images.
+ */
+static bool is_journal_name(const char *name) {
+  size_t len = strlen(name);
+  return (len > 8 && strcmp(name + len - 8, ".journal") == 0)
+    || (len > 6 && strcmp(name + len - 6, ".patch") == 0);
+}
+
+/**
+ * Adds every regular file in a directory to the batch, in name order,
+ * leaving out repair journals and patches.
+ */
+static int read_batch_dir(struct batch *batch, char *dirname) {
+  struct dirent **names;
+  struct stat statbuf;
+  char path[MAXPATHLEN+1];
+  int n, i;
+
+  n = scandir(dirname, &names, NULL, alphasort);
+  if (n < 0) {
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (names[i]->d_name[0] != '.' && !is_journal_name(names[i]->d_name)
+        && snprintf(path, sizeof(path), "%s/%s", dirname, names[i]->d_name) < sizeof(path)
+        && stat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+      add_batch_job(batch, path);
+    }
+    free(names[i]);
+  }
+  free(names);
+  return 0;
+}
+
+static void *batch_worker_main(void *arg) {
+  struct batch *batch = arg;
+  uint32_t i;
+
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->njobs) {
+    struct batch_job *job = &batch->jobs[i];
+    FILE *report = open_memstream(&job->report, &job->report_len);
+    if (report == NULL) {
+      job->result = -1;
     } else {
-      cluster = get_fat_entry(cluster, image_buf, bpb);
-      dirent = (struct direntry*)cluster_to_addr(cluster,
-        image_buf, bpb);
+      job->result = scandisk_image(job->filename, batch->opts, report, report);
+      fclose(report);
     }
+
+    pthread_mutex_lock(&batch->lock);
+    job->done = true;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
   }
+  return NULL;
+}
+
+/**
+ * Scans every image named by source -- a file listing them, - for
+ * stdin, or a directory of them -- on nworkers threads, and prints one
+ * report covering them all.  Returns the exit status.
+ */
+int scandisk_batch(char *source, struct scan_options *opts, int nworkers) {
+  struct batch batch;
+  struct stat statbuf;
+  pthread_t *threads;
+  uint32_t i, clean = 0, repaired = 0, failed = 0;
+  int nthreads;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.opts = opts;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.finished, NULL);
+
+  if (strcmp(source, "-") == 0) {
+    read_batch_list(&batch, stdin);
+  } else if (stat(source, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+    if (read_batch_dir(&batch, source) < 0) {
+      fprintf(stderr, "Cannot read directory %s: %s\n", source, strerror(errno));
+      return 1;
+    }
+  } else {
+    FILE *list = fopen(source, "r");
+    if (list == NULL) {
+      fprintf(stderr, "Cannot read image list %s: %s\n", source, strerror(errno));
+      return 1;
+    }
+    read_batch_list(&batch, list);
+    fclose(list);
+  }
+
+  nthreads = nworkers < batch.njobs ? nworkers : batch.njobs;
+  threads = calloc(nthreads > 0 ? nthreads : 1, sizeof(pthread_t));
+  if (threads == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, batch_worker_main, &batch) != 0) {
+      fprintf(stderr, "Cannot create batch thread\n");
+      exit(1);
+    }
+  }
+
+  /* print each report as soon as it and everything before it is done,
+     so we don't hold thousands of them in memory */
+  for (i = 0; i < batch.njobs; i++) {
+    struct batch_job *job = &batch.jobs[i];
+    pthread_mutex_lock(&batch.lock);
+    while (!job->done) {
+      pthread_cond_wait(&batch.finished, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    if (job->result < 0) {
+      printf("== %s: failed\n", job->filename);
+      failed++;
+    } else if (job->result == 0) {
+      printf("== %s: clean\n", job->filename);
+      clean++;
+    } else {
+      printf("== %s: %s %d problem%s\n", job->filename,
+        opts->quick ? "found" : opts->dry_run ? "would repair" : "repaired", job->result,
+        job->result == 1 ? "" : "s");
+      repaired++;
+    }
+    if (job->report != NULL) {
+      fwrite(job->report, 1, job->report_len, stdout);
+    }
+    free(job->report);
+    free(job->filename);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  printf("%u images: %u clean, %u %s, %u failed\n", batch.njobs, clean,
+    repaired, opts->quick ? "to scan" : opts->dry_run ? "to repair" : "repaired", failed);
+
+  free(threads);
+  free(batch.jobs);
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.finished);
+  return failed > 0 ? 1 : 0;
+}
+
+/**
+ * Makes the changes in a journal or patch to an image (direction
+ * JOURNAL_REDO), or rolls them back (JOURNAL_UNDO).  Returns the exit
+ * status.
+ */
+int replay_journal(char *journal_path, char *filename, int direction) {
+  struct journal journal;
+  const char *error;
+  int fd, changed;
+
+  error = journal_read(&journal, journal_path);
+  if (error != NULL) {
+    fprintf(stderr, "Cannot read repair journal %s: %s\n", journal_path, error);
+    return 1;
+  }
+  fd = open(filename, O_RDWR);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot read disk image file %s: %s\n", filename, strerror(errno));
+    journal_free(&journal);
+    return 1;
+  }
+  changed = journal_apply(&journal, fd, direction, filename, stderr);
+  close(fd);
+  journal_free(&journal);
+  if (changed < 0) {
+    return 1;
+  }
+  printf("%s %d change%s\n", direction == JOURNAL_UNDO ? "Undid" : "Applied",
+    changed, changed == 1 ? "" : "s");
+  return 0;
 }
 
 void usage() {
-  fprintf(stderr, "Usage: dos_scandisk <imagename>\n");
+  fprintf(stderr, "Usage: dos_scandisk [-j threads] [-d maxdepth] [-c maxchain] [--fat-select n] [--plan] [--dry-run] [--journal file] <imagename>\n");
+  fprintf(stderr, "       dos_scandisk --batch <listfile|-|directory> [-j threads] [-d maxdepth] [-c maxchain] [--fat-select n] [--plan]\n");
+  fprintf(stderr, "       dos_scandisk --quick [--fat-select n] <imagename>\n");
+  fprintf(stderr, "       dos_scandisk --undo <journal> <imagename>\n");
+  fprintf(stderr, "       dos_scandisk --apply-patch <patch> <imagename>\n");
+  fprintf(stderr, "  -j  scan the directory tree with this many threads (default 1); with\n");
+  fprintf(stderr, "      --batch, scan this many images at once (default: one per CPU)\n");
+  fprintf(stderr, "  -d  don't descend more than maxdepth directories (default %d)\n", DEFAULT_MAX_DEPTH);
+  fprintf(stderr, "  -c  stop following a chain after maxchain clusters (default: clusters on the disk)\n");
+  fprintf(stderr, "  --fat-select  scan using copy n of the FAT (default 1), and bring the\n");
+  fprintf(stderr, "      other copies into line with it\n");
+  fprintf(stderr, "  --plan  finish with a summary of the repairs made\n");
+  fprintf(stderr, "  --quick  only check the FAT, in one pass without reading any directories,\n");
+  fprintf(stderr, "      and say whether a full scan is needed; changes nothing (works with --batch)\n");
+  fprintf(stderr, "  --batch  check every image listed in a file (- for stdin) or in a directory\n");
+  fprintf(stderr, "  --journal  journal the repairs here (default: <imagename>.journal)\n");
+  fprintf(stderr, "  --dry-run  don't touch the image; write the repairs to <imagename>.patch\n");
+  fprintf(stderr, "      (or the --journal file) instead\n");
+  fprintf(stderr, "  --undo  put back everything the repairs in a journal changed\n");
+  fprintf(stderr, "  --apply-patch  make the repairs in a patch from --dry-run (or a journal)\n");
   exit(1);
 }
 
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    usage();
+  static struct option long_options[] = {
+    {"batch", required_argument, NULL, 'b'},
+    {"journal", required_argument, NULL, 'J'},
+    {"undo", required_argument, NULL, 'u'},
+    {"dry-run", no_argument, NULL, 'n'},
+    {"apply-patch", required_argument, NULL, 'a'},
+    {"fat-select", required_argument, NULL, 'F'},
+    {"plan", no_argument, NULL, 'p'},
+    {"quick", no_argument, NULL, 'q'},
+    {NULL, 0, NULL, 0}
+  };
+  struct scan_options opts;
+  char *batch_source = NULL, *replay = NULL;
+  int opt, nthreads = 0, direction = JOURNAL_REDO;
+
+  opts.max_depth = DEFAULT_MAX_DEPTH;
+  opts.max_chain = 0;
+  opts.nthreads = 1;
+  opts.journal = NULL;
+  opts.dry_run = false;
+  opts.fat_copy = 0;
+  opts.plan = false;
+  opts.quick = false;
+
+  while ((opt = getopt_long(argc, argv, "j:d:c:", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'j':
+      nthreads = atoi(optarg);
+      if (nthreads < 1) {
+        usage();
+      }
+      break;
+    case 'd':
+      opts.max_depth = atoi(optarg);
+      break;
+    case 'c':
+      opts.max_chain = atoi(optarg);
+      break;
+    case 'b':
+      batch_source = optarg;
+      break;
+    case 'J':
+      opts.journal = optarg;
+      break;
+    case 'u':
+      replay = optarg;
+      direction = JOURNAL_UNDO;
+      break;
+    case 'a':
+      replay = optarg;
+      direction = JOURNAL_REDO;
+      break;
+    case 'n':
+      opts.dry_run = true;
+      break;
+    case 'p':
+      opts.plan = true;
+      break;
+    case 'q':
+      opts.quick = true;
+      break;
+    case 'F':
+      opts.fat_copy = atoi(optarg) - 1;
+      if (opts.fat_copy < 0) {
+        usage();
+      }
+      break;
+    default:
+      usage();
+    }
   }
 
-  int fd;
-  uint8_t *image_buf = mmap_file(argv[1], &fd);
-  struct bpb33 *bpb = check_bootsector(image_buf);
+  if (replay != NULL) {
+    if (argc - optind != 1 || batch_source != NULL || opts.dry_run) {
+      usage();
+    }
+    return replay_journal(replay, argv[optind], direction);
+  }
 
-  int total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-  bool *referenced_clusters = calloc(total_clusters, sizeof(bool));
+  /* a quick check writes nothing, so there's no journal or patch */
+  if (opts.quick && (opts.dry_run || opts.plan || opts.journal != NULL)) {
+    usage();
+  }
 
-  find_referenced_clusters(0, image_buf, bpb, referenced_clusters);
-  display_unreferenced_clusters(image_buf, bpb, referenced_clusters, total_clusters);
-  find_unreferenced_files(image_buf, bpb, referenced_clusters, total_clusters);
-  find_length_mismatches(0, image_buf, bpb);
+  if (batch_source != NULL) {
+    /* each image gets its own journal or patch, next to it */
+    if (argc - optind != 0 || opts.journal != NULL) {
+      usage();
+    }
+    /* images are scanned in parallel with each other, so each one's
+       tree gets a single thread */
+    if (nthreads == 0) {
+      nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+      if (nthreads < 1) {
+        nthreads = 1;
+      }
+    }
+    return scandisk_batch(batch_source, &opts, nthreads);
+  }
 
-  free(bpb);
-  close(fd);
-  free(referenced_clusters);
-  return 0;
+  if (argc - optind != 1) {
+    usage();
+  }
+  if (nthreads > 0) {
+    opts.nthreads = nthreads;
+  }
+  return scandisk_image(argv[optind], &opts, stdout, stderr) < 0 ? 1 : 0;
 }
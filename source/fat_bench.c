@@ -0,0 +1,625 @@
+/* micro-benchmarks for the FAT routines in dos.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "scan.h"
+
+/* a bit over the largest FAT-12 table, so it isn't all in L1 */
+#define BENCH_ENTRIES (1 << 20)
+#define BENCH_SECONDS 0.25
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* bench_fat12 times fat12_decode and fat12_encode with each kernel,
+   and checks every kernel agrees with the scalar one */
+static void bench_fat12(void)
+{
+  static const char *kernels[] = { "scalar", "ssse3", "avx2" };
+  uint32_t n = BENCH_ENTRIES, nbytes = (3 * n + 1) / 2, i;
+  uint8_t *packed, *repacked;
+  uint16_t *expect, *entries;
+  int k;
+
+  packed = malloc(nbytes);
+  repacked = malloc(nbytes);
+  expect = malloc(n * sizeof(uint16_t));
+  entries = malloc(n * sizeof(uint16_t));
+  if (!packed || !repacked || !expect || !entries) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  srand(3005);
+  for (i = 0; i < nbytes; i++) {
+    packed[i] = rand();
+  }
+  fat12_use_kernel("scalar");
+  fat12_decode(packed, expect, n);
+
+  for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    double start, elapsed;
+    uint64_t done;
+
+    if (!fat12_use_kernel(kernels[k])) {
+      printf("fat12 %-6s  not supported on this CPU\n", kernels[k]);
+      continue;
+    }
+
+    /* odd lengths exercise the ragged tails */
+    memset(entries, 0, n * sizeof(uint16_t));
+    fat12_decode(packed, entries, n - 1);
+    memcpy(repacked, packed, nbytes);
+    memset(repacked, 0, (3 * (n - 1)) / 2);
+    fat12_encode(entries, repacked, n - 1);
+    if (memcmp(entries, expect, (n - 1) * sizeof(uint16_t)) != 0
+      || memcmp(repacked, packed, nbytes) != 0) {
+      printf("fat12 %-6s  MISMATCH against scalar kernel\n", kernels[k]);
+      continue;
+    }
+
+    done = 0;
+    start = now();
+    do {
+      fat12_decode(packed, entries, n);
+      done += n;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    printf("fat12 %-6s  decode %8.1f Mentries/s", kernels[k],
+      done / elapsed / 1e6);
+
+    done = 0;
+    start = now();
+    do {
+      fat12_encode(entries, repacked, n);
+      done += n;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    printf("  encode %8.1f Mentries/s\n", done / elapsed / 1e6);
+  }
+
+  free(packed);
+  free(repacked);
+  free(expect);
+  free(entries);
+}
+
+/* synthetic FAT-12 image: the largest FAT-12 disk with one-sector
+   clusters, holding SYNTH_DIRS directories of SYNTH_FILES small files */
+#define SYNTH_CLUSTERS 4084
+#define SYNTH_ROOTENTS 224
+#define SYNTH_FATSECS 12
+#define SYNTH_DIRS 60
+#define SYNTH_FILES 30
+
+static void synth_dirent(struct direntry *dirent, const char *name,
+  uint8_t attr, uint16_t cluster, uint32_t size)
+{
+  memset(dirent, 0, sizeof(struct direntry));
+  memset(dirent->deName, ' ', 8);
+  memset(dirent->deExtension, ' ', 3);
+  memcpy(dirent->deName, name, strlen(name));
+  if (attr == ATTR_NORMAL) {
+    memcpy(dirent->deExtension, "DAT", 3);
+  }
+  dirent->deAttributes = attr;
+  putushort(dirent->deStartCluster, cluster);
+  putulong(dirent->deFileSize, size);
+}
+
+/* make_image allocates a zeroed FAT-12 image with 512 byte sectors,
+   one reserved sector and two FATs, and fills in its boot sector; the
+   caller frees it */
+static uint8_t *make_image(uint32_t nsectors, uint8_t sec_per_clust,
+  uint16_t fat_secs, uint16_t root_ents)
+{
+  uint8_t *image_buf = calloc(nsectors, 512);
+  struct bootsector33 *bootsect = (struct bootsector33 *)image_buf;
+  struct byte_bpb33 *bpb = (struct byte_bpb33 *)bootsect->bsBPB;
+  int sector_size = 512;
+
+  if (image_buf == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  bootsect->bsJump[0] = 0xeb;
+  bootsect->bsJump[2] = 0x90;
+  bootsect->bsBootSectSig0 = BOOTSIG0;
+  bootsect->bsBootSectSig1 = BOOTSIG1;
+  putushort(bpb->bpbBytesPerSec, sector_size);
+  bpb->bpbSecPerClust = sec_per_clust;
+  putushort(bpb->bpbResSectors, 1);
+  bpb->bpbFATs = 2;
+  putushort(bpb->bpbRootDirEnts, root_ents);
+  putushort(bpb->bpbSectors, nsectors);
+  bpb->bpbMedia = 0xf0;
+  putushort(bpb->bpbFATsecs, fat_secs);
+  image_buf[512] = 0xf0;
+  image_buf[513] = 0xff;
+  image_buf[514] = 0xff;
+  return image_buf;
+}
+
+/* make_synthetic_image builds an image in memory and returns it,
+   with its length in *size; the caller frees it */
+static uint8_t *make_synthetic_image(size_t *size)
+{
+  uint32_t nsectors = 1 + 2 * SYNTH_FATSECS
+    + SYNTH_ROOTENTS * sizeof(struct direntry) / 512 + SYNTH_CLUSTERS;
+  uint8_t *image_buf = make_image(nsectors, 1, SYNTH_FATSECS,
+    SYNTH_ROOTENTS);
+  struct image_io *io = io_wrap(image_buf, (size_t)nsectors * 512);
+  struct bpb710 *bpb2;
+  struct fat_table *fat;
+  struct direntry *root, *dir;
+  char name[9];
+  int d, f;
+
+  bpb2 = check_bootsector(io);
+  fat = load_fat_table(io, bpb2);
+  root = (struct direntry *)root_dir_addr(io, bpb2);
+  srand(3005);
+  for (d = 0; d < SYNTH_DIRS; d++) {
+    uint32_t dir_cluster = fat_alloc_chain(fat, 2, NULL);
+    sprintf(name, "DIR%d", d);
+    synth_dirent(&root[d], name, ATTR_DIRECTORY, dir_cluster, 0);
+    dir = (struct direntry *)cluster_to_addr(dir_cluster, io, bpb2);
+    memset(dir, 0, 512);
+    synth_dirent(&dir[0], ".", ATTR_DIRECTORY, dir_cluster, 0);
+    synth_dirent(&dir[1], "..", ATTR_DIRECTORY, 0, 0);
+    for (f = 0; f < SYNTH_FILES; f++) {
+      uint32_t size = 1 + rand() % 1024;
+      /* the second cluster of the directory follows the first */
+      struct direntry *slot = f + 2 < 16 ? &dir[f + 2]
+        : (struct direntry *)cluster_to_addr(fat_get(fat, dir_cluster),
+          io, bpb2) + (f + 2 - 16);
+      sprintf(name, "F%d", f);
+      synth_dirent(slot, name, ATTR_NORMAL,
+        fat_alloc_chain(fat, (size + 511) / 512, NULL), size);
+    }
+  }
+  flush_fat_table(fat);
+  free_fat_table(fat);
+  free(bpb2);
+  io_close(io);
+  *size = (size_t)nsectors * 512;
+  return image_buf;
+}
+
+/* same_files compares two lists of file records field by field, as
+   the padding inside the records is never initialised */
+static int same_files(struct scan *a, struct scan *b)
+{
+  uint32_t i;
+
+  if (a->nfiles != b->nfiles) {
+    return FALSE;
+  }
+  for (i = 0; i < a->nfiles; i++) {
+    struct file_record *x = &a->files[i], *y = &b->files[i];
+    if (x->dirent != y->dirent || strcmp(x->name, y->name) != 0
+      || strcmp(x->extension, y->extension) != 0 || x->size != y->size
+      || x->fat_clusters != y->fat_clusters
+      || x->last_cluster != y->last_cluster
+      || x->loop_cluster != y->loop_cluster) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* same_refs compares the reference maps of two scans of the same
+   image */
+static int same_refs(struct scan *a, struct scan *b)
+{
+  uint32_t nwords = (a->fat->nclusters + 63) / 64;
+  uint32_t i;
+
+  if (memcmp(a->ref_map, b->ref_map, nwords * sizeof(uint64_t)) != 0
+    || memcmp(a->shared_map, b->shared_map, nwords * sizeof(uint64_t)) != 0) {
+    return FALSE;
+  }
+  for (i = 0; i < a->fat->nclusters; i++) {
+    if (cluster_refs(a, i) != cluster_refs(b, i)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* bench_scan times the directory-tree scan on a synthetic image with
+   1 up to max_threads threads, and checks each one gets the same
+   answer as the single-threaded scan */
+static void bench_scan(int max_threads)
+{
+  size_t size;
+  uint8_t *image_buf = make_synthetic_image(&size);
+  struct scan serial, scan;
+  double start, elapsed, base = 0;
+  uint64_t entries;
+  int nthreads;
+
+  memset(&serial, 0, sizeof(serial));
+  serial.io = io_wrap(image_buf, size);
+  serial.bpb = check_bootsector(serial.io);
+  serial.fat = load_fat_table(serial.io, serial.bpb);
+  serial.max_depth = DEFAULT_MAX_DEPTH;
+  serial.out = stdout;
+  serial.err = stderr;
+  scan_init(&serial);
+  scan_tree(&serial);
+
+  for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    scan = serial;
+    scan_init(&scan);
+    scan.files = NULL;
+    scan.files_size = 0;
+    entries = 0;
+    start = now();
+    do {
+      memset(scan.ref_map, 0, (scan.fat->nclusters + 63) / 64 * sizeof(uint64_t));
+      memset(scan.shared_map, 0,
+        (scan.fat->nclusters + 63) / 64 * sizeof(uint64_t));
+      if (scan.extra_refs != NULL) {
+        memset(scan.extra_refs, 0, scan.fat->nclusters);
+      }
+      scan.nfiles = 0;
+      scan_tree_parallel(&scan, nthreads);
+      entries += scan.nfiles + SYNTH_DIRS;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+
+    if (!same_files(&scan, &serial) || !same_refs(&scan, &serial)) {
+      printf("scan  %2d threads  MISMATCH against single-threaded scan\n",
+        nthreads);
+    } else {
+      if (nthreads == 1) {
+        base = entries / elapsed;
+      }
+      printf("scan  %2d threads  %8.3f Mdirents/s  (x%.2f)\n", nthreads,
+        entries / elapsed / 1e6, entries / elapsed / base);
+    }
+    scan_free(&scan);
+  }
+
+  scan_free(&serial);
+  free_fat_table(serial.fat);
+  free(serial.bpb);
+  io_close(serial.io);
+  free(image_buf);
+}
+
+#define CYCLE_RUNS 50
+#define CYCLE_CLUSTERS 600
+
+/* chain_end returns the last cluster of the chain starting at cluster */
+static uint32_t chain_end(struct fat_table *fat, uint32_t cluster)
+{
+  while (!is_end_of_file(fat_get(fat, cluster))) {
+    cluster = fat_get(fat, cluster);
+  }
+  return cluster;
+}
+
+/* check_shared_cycles makes a long loop of free clusters in the
+   synthetic image, and has the first two files in every directory run
+   into it, at its start and half way round, so threads keep walking
+   the same cycle at once.  Each directory's third file becomes an
+   entry for the directory half way round the root, so the directory
+   tree loops too, and the threads race to queue each directory.  Each
+   scan with nthreads threads has to find the same loops and counts,
+   and the same files in the same order, as the single-threaded one */
+static void check_shared_cycles(int nthreads)
+{
+  size_t size;
+  uint8_t *image_buf = make_synthetic_image(&size);
+  struct scan serial, scan;
+  struct direntry *root, *dir;
+  uint32_t loop, middle;
+  int d, run, mismatches = 0;
+  FILE *quiet = fopen("/dev/null", "w");
+
+  memset(&serial, 0, sizeof(serial));
+  serial.io = io_wrap(image_buf, size);
+  serial.bpb = check_bootsector(serial.io);
+  serial.fat = load_fat_table(serial.io, serial.bpb);
+  serial.max_depth = DEFAULT_MAX_DEPTH;
+  serial.out = stdout;
+  /* every scan reports the directory loops */
+  serial.err = quiet != NULL ? quiet : stderr;
+  loop = fat_alloc_chain(serial.fat, CYCLE_CLUSTERS, NULL);
+  if (loop == 0) {
+    fprintf(stderr, "No room for the loop in the synthetic image\n");
+    exit(1);
+  }
+  fat_set(serial.fat, chain_end(serial.fat, loop), loop);
+  for (middle = loop, d = 0; d < CYCLE_CLUSTERS / 2; d++) {
+    middle = fat_get(serial.fat, middle);
+  }
+  root = (struct direntry *)root_dir_addr(serial.io, serial.bpb);
+  for (d = 0; d < SYNTH_DIRS; d++) {
+    dir = (struct direntry *)cluster_to_addr(getushort(root[d].deStartCluster),
+      serial.io, serial.bpb);
+    fat_set(serial.fat, chain_end(serial.fat, getushort(dir[2].deStartCluster)),
+      loop);
+    fat_set(serial.fat, chain_end(serial.fat, getushort(dir[3].deStartCluster)),
+      middle);
+    synth_dirent(&dir[4], "LINK", ATTR_DIRECTORY,
+      getushort(root[(d + SYNTH_DIRS / 2) % SYNTH_DIRS].deStartCluster), 0);
+  }
+  scan_init(&serial);
+  scan_tree(&serial);
+
+  for (run = 0; run < CYCLE_RUNS; run++) {
+    scan = serial;
+    scan_init(&scan);
+    scan.files = NULL;
+    scan.files_size = 0;
+    scan.nfiles = 0;
+    scan_tree_parallel(&scan, nthreads);
+    if (!same_files(&scan, &serial) || !same_refs(&scan, &serial)) {
+      mismatches++;
+    }
+    scan_free(&scan);
+  }
+  if (mismatches > 0) {
+    printf("scan  %2d threads  MISMATCH on looping chains and directories in %d of %d runs\n",
+      nthreads, mismatches, CYCLE_RUNS);
+  } else {
+    printf("scan  %2d threads  looping chains and directories found as single-threaded in %d runs\n",
+      nthreads, CYCLE_RUNS);
+  }
+
+  scan_free(&serial);
+  free_fat_table(serial.fat);
+  free(serial.bpb);
+  io_close(serial.io);
+  free(image_buf);
+  if (quiet != NULL) {
+    fclose(quiet);
+  }
+}
+
+/* old_cluster_to_addr and old_get_fat_entry are cluster_to_addr and
+   get_fat_entry as they were before the geometry was worked out up
+   front, re-deriving everything from the BPB on every call; they're
+   what bench_lookup compares against */
+static uint8_t *old_cluster_to_addr(uint32_t cluster, uint8_t *image_buf,
+  struct bpb710 *bpb)
+{
+  uint8_t *p = image_buf + (size_t)bpb->bpbBytesPerSec
+    * (bpb->bpbResSectors + ((uint64_t)bpb->bpbFATs * bpb->bpbBigFATsecs));
+
+  if (cluster == MSDOSFSROOT) {
+    cluster = bpb->bpbRootClust;
+  }
+  if (cluster != MSDOSFSROOT) {
+    p += bpb->bpbRootDirEnts * sizeof(struct direntry);
+    p += (size_t)bpb->bpbBytesPerSec * bpb->bpbSecPerClust
+      * (cluster - CLUST_FIRST);
+  }
+  return p;
+}
+
+static uint32_t old_get_fat_entry(uint32_t clusternum, uint8_t *image_buf,
+  struct bpb710 *bpb)
+{
+  uint8_t *fat_buf = image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec;
+  uint32_t value;
+
+  switch (fat_type(bpb)) {
+  case 32:
+    return getulong(fat_buf + 4 * (size_t)clusternum) & FAT32_MASK;
+  case 16:
+    return fat_widen(getushort(fat_buf + 2 * (size_t)clusternum), FAT16_MASK);
+  }
+  fat_buf += 3 * (clusternum / 2);
+  if (clusternum % 2 == 0) {
+    value = ((0x0f & fat_buf[1]) << 8) | fat_buf[0];
+  } else {
+    value = fat_buf[2] << 4 | ((0xf0 & fat_buf[1]) >> 4);
+  }
+  return fat_widen(value, FAT12_MASK);
+}
+
+#define LOOKUPS 4096
+
+/* bench_lookup times cluster_to_addr and get_fat_entry against the
+   old versions, on the two standard floppies (which have fast paths
+   of their own) and on an image that only has the general one, and
+   checks they all give the same answers */
+static void bench_lookup(void)
+{
+  static const struct {
+    const char *name;
+    uint32_t nsectors;
+    uint8_t sec_per_clust;
+    uint16_t fat_secs, root_ents;
+  } layouts[] = {
+    { "1.44MB", 2880, 1, 9, 224 },
+    { "720KB", 1440, 2, 3, 112 },
+    { "other", 1 + 2 * SYNTH_FATSECS + SYNTH_ROOTENTS / 16 + SYNTH_CLUSTERS,
+      1, SYNTH_FATSECS, SYNTH_ROOTENTS },
+  };
+  static const char *layout_names[] = { "multiply", "shift", "1.44MB",
+    "720KB" };
+  uint32_t clusters[LOOKUPS], i, nclusters;
+  int l;
+
+  for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+    uint8_t *image_buf = make_image(layouts[l].nsectors,
+      layouts[l].sec_per_clust, layouts[l].fat_secs, layouts[l].root_ents);
+    struct image_io *io = io_wrap(image_buf,
+      (size_t)layouts[l].nsectors * 512);
+    struct bpb710 *bpb = check_bootsector(io);
+    double start, elapsed, before, after;
+    volatile uintptr_t sink = 0;
+    uint64_t done;
+
+    nclusters = CLUST_FIRST + (layouts[l].nsectors - 1 - 2 * layouts[l].fat_secs
+      - layouts[l].root_ents / 16) / layouts[l].sec_per_clust;
+    srand(3005);
+    for (i = 0; i < layouts[l].fat_secs * 512; i++) {
+      image_buf[512 + i] = rand();
+    }
+    for (i = 0; i < LOOKUPS; i++) {
+      clusters[i] = CLUST_FIRST + rand() % (nclusters - CLUST_FIRST);
+    }
+    for (i = 0; i < LOOKUPS; i++) {
+      if (cluster_to_addr(clusters[i], io, bpb)
+        != old_cluster_to_addr(clusters[i], image_buf, bpb)
+        || get_fat_entry(clusters[i], io, bpb)
+        != old_get_fat_entry(clusters[i], image_buf, bpb)) {
+        break;
+      }
+    }
+    if (i < LOOKUPS) {
+      printf("lookup %-6s  MISMATCH against the BPB arithmetic\n",
+        layouts[l].name);
+      free(bpb);
+      io_close(io);
+      free(image_buf);
+      continue;
+    }
+
+    printf("lookup %-6s  (%s path)", layouts[l].name,
+      layout_names[bpb_geometry(bpb)->layout]);
+
+    done = 0;
+    start = now();
+    do {
+      for (i = 0; i < LOOKUPS; i++) {
+        sink += (uintptr_t)old_cluster_to_addr(clusters[i], image_buf, bpb);
+      }
+      done += LOOKUPS;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    before = elapsed / done * 1e9;
+    done = 0;
+    start = now();
+    do {
+      for (i = 0; i < LOOKUPS; i++) {
+        sink += (uintptr_t)cluster_to_addr(clusters[i], io, bpb);
+      }
+      done += LOOKUPS;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    after = elapsed / done * 1e9;
+    printf("  cluster_to_addr %5.1f -> %5.1f ns", before, after);
+
+    done = 0;
+    start = now();
+    do {
+      for (i = 0; i < LOOKUPS; i++) {
+        sink += old_get_fat_entry(clusters[i], image_buf, bpb);
+      }
+      done += LOOKUPS;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    before = elapsed / done * 1e9;
+    done = 0;
+    start = now();
+    do {
+      for (i = 0; i < LOOKUPS; i++) {
+        sink += get_fat_entry(clusters[i], io, bpb);
+      }
+      done += LOOKUPS;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    after = elapsed / done * 1e9;
+    printf("  get_fat_entry %5.1f -> %5.1f ns\n", before, after);
+
+    free(bpb);
+    io_close(io);
+    free(image_buf);
+  }
+}
+
+/* bench_cache times walking the whole directory tree of a synthetic
+   image saved to a file, through a mapping and through the pread
+   cache at a few sizes, and checks they all see the same entries */
+static void bench_cache(void)
+{
+  static const struct {
+    int backend;
+    size_t cache_size;
+  } configs[] = {
+    { IO_MMAP, 0 },
+    { IO_PREAD, 4 * 1024 },
+    { IO_PREAD, 64 * 1024 },
+    { IO_PREAD, DEFAULT_CACHE_SIZE },
+  };
+  char filename[] = "/tmp/fat_benchXXXXXX";
+  size_t size;
+  uint8_t *image_buf = make_synthetic_image(&size);
+  uint64_t expected = 0;
+  int c, fd;
+
+  fd = mkstemp(filename);
+  if (fd < 0 || write(fd, image_buf, size) != size) {
+    fprintf(stderr, "Cannot write %s\n", filename);
+    exit(1);
+  }
+  close(fd);
+  free(image_buf);
+
+  for (c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    struct image_io *io = open_image(filename, configs[c].backend,
+      IMAGE_READONLY, configs[c].cache_size);
+    struct bpb710 *bpb = check_bootsector(io);
+    struct fat_table *fat = load_fat_table(io, bpb);
+    struct tree_walk walk;
+    struct direntry *dirent;
+    double start, elapsed;
+    uint64_t entries = 0, walks = 0;
+
+    start = now();
+    do {
+      tree_walk_start(&walk, MSDOSFSROOT, DEFAULT_MAX_DEPTH, io, bpb, fat);
+      while ((dirent = tree_walk_next(&walk)) != NULL) {
+        entries++;
+        if ((dirent->deAttributes & ATTR_DIRECTORY) != 0
+          && dirent->deName[0] != '.') {
+          tree_walk_descend(&walk, dirent_start(dirent, fat));
+        }
+      }
+      tree_walk_end(&walk);
+      walks++;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+
+    if (c == 0) {
+      expected = entries / walks;
+    }
+    if (entries != expected * walks) {
+      printf("walk  %-5s %5zuKB  MISMATCH against the mapping\n",
+        io->ops->name, configs[c].cache_size / 1024);
+    } else {
+      printf("walk  %-5s %5zuKB  %8.3f Mdirents/s  ", io->ops->name,
+        configs[c].cache_size / 1024, entries / elapsed / 1e6);
+      io_report(io, stdout);
+    }
+    free_fat_table(fat);
+    free(bpb);
+    io_close(io);
+  }
+  unlink(filename);
+}
+
+int main(int argc, char** argv)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  bench_fat12();
+  bench_lookup();
+  bench_cache();
+  bench_scan(ncpus > 4 ? ncpus : 4);
+  check_shared_cycles(8);
+  return 0;
+}
@@ -0,0 +1,685 @@
+/* how the tools get at a disk image: straight through a memory
+   mapping, or with pread and pwrite through a cache of blocks */
+
+/* for copy_file_range */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+
+/* how many hash chains the IO_PREAD cache spreads its blocks over */
+#define IO_BUCKETS 4096
+
+/* the most IO_PREAD's io_load brings through a buffer at once, when
+   the kernel can't copy the data itself */
+#define IO_LOAD_CHUNK (1024 * 1024)
+
+/* io_fail reports an I/O error on the image and gives up.  io_get
+   hands back a pointer, so there's nothing else it could do */
+static void io_fail(const char *what)
+{
+  fprintf(stderr, "Cannot %s disk image: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+/* pread_fully reads length bytes at offset, zero filling anything past
+   the end of the image */
+static int pread_fully(int fd, uint8_t *buf, size_t length, uint64_t offset)
+{
+  ssize_t n;
+
+  while (length > 0) {
+    n = pread(fd, buf, length, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      memset(buf, 0, length);
+      return 0;
+    }
+    buf += n;
+    length -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int pwrite_fully(int fd, const uint8_t *buf, size_t length,
+  uint64_t offset)
+{
+  ssize_t n;
+
+  while (length > 0) {
+    n = pwrite(fd, buf, length, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    length -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/* read_fully reads length bytes from fd, stopping short only at the
+   end of its file.  Returns how many it read */
+static ssize_t read_fully(int fd, uint8_t *buf, size_t length)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < length) {
+    n = read(fd, buf + done, length - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+
+/* the mmap backend: everything is already in memory */
+
+static uint8_t *mmap_get(struct image_io *io, uint64_t offset, size_t length)
+{
+  return io->map + offset;
+}
+
+static void mmap_dirty(struct image_io *io, const uint8_t *p, size_t length)
+{
+}
+
+static int mmap_read(struct image_io *io, uint64_t offset, void *buf,
+  size_t length)
+{
+  memcpy(buf, io->map + offset, length);
+  return 0;
+}
+
+static int mmap_write(struct image_io *io, uint64_t offset, const void *buf,
+  size_t length)
+{
+  memcpy(io->map + offset, buf, length);
+  return 0;
+}
+
+/* the file is read straight into the mapping */
+static ssize_t mmap_load(struct image_io *io, uint64_t offset, int fd,
+  size_t length)
+{
+  ssize_t n = read_fully(fd, io->map + offset, length);
+
+  if (n >= 0) {
+    memset(io->map + offset + n, 0, length - n);
+  }
+  return n;
+}
+
+static int mmap_flush(struct image_io *io)
+{
+  return 0;
+}
+
+static void mmap_close(struct image_io *io)
+{
+  if (io->owns_map) {
+    munmap(io->map, io->size);
+  }
+}
+
+static const struct image_io_ops mmap_ops = {
+  "mmap", mmap_get, mmap_dirty, mmap_read, mmap_write, mmap_load,
+  mmap_flush, mmap_close
+};
+
+
+/* the pread backend.  Blocks are hashed on their offset, and kept on
+   a list from most to least recently used; when the cache is over
+   size, blocks come off the old end, written back first if dirty */
+
+static uint32_t block_hash(struct image_io *io, uint64_t offset)
+{
+  return (offset / 512) % io->nbuckets;
+}
+
+static struct io_block *find_block(struct image_io *io, uint64_t offset)
+{
+  struct io_block *block;
+
+  for (block = io->buckets[block_hash(io, offset)]; block != NULL;
+       block = block->hash_next) {
+    if (block->offset == offset) {
+      return block;
+    }
+  }
+  return NULL;
+}
+
+static void unlink_lru(struct image_io *io, struct io_block *block)
+{
+  if (block->newer != NULL) {
+    block->newer->older = block->older;
+  } else {
+    io->newest = block->older;
+  }
+  if (block->older != NULL) {
+    block->older->newer = block->newer;
+  } else {
+    io->oldest = block->newer;
+  }
+}
+
+static void push_lru(struct image_io *io, struct io_block *block)
+{
+  block->newer = NULL;
+  block->older = io->newest;
+  if (io->newest != NULL) {
+    io->newest->newer = block;
+  } else {
+    io->oldest = block;
+  }
+  io->newest = block;
+}
+
+/* write_back writes out the part of block that's been changed */
+static int write_back(struct image_io *io, struct io_block *block)
+{
+  if (block->dirty_start == block->dirty_end) {
+    return 0;
+  }
+  if (pwrite_fully(io->fd, block->data + block->dirty_start,
+      block->dirty_end - block->dirty_start,
+      block->offset + block->dirty_start) < 0) {
+    return -1;
+  }
+  block->dirty_start = block->dirty_end = 0;
+  io->writebacks++;
+  return 0;
+}
+
+static void evict(struct image_io *io, struct io_block *block)
+{
+  struct io_block **pp;
+
+  if (write_back(io, block) < 0) {
+    io_fail("write");
+  }
+  for (pp = &io->buckets[block_hash(io, block->offset)]; *pp != block;
+       pp = &(*pp)->hash_next)
+    ;
+  *pp = block->hash_next;
+  unlink_lru(io, block);
+  io->cached -= block->length;
+  free(block->data);
+  free(block);
+}
+
+static uint8_t *pread_get(struct image_io *io, uint64_t offset, size_t length)
+{
+  struct io_block *block = find_block(io, offset);
+
+  if (block != NULL) {
+    if (block->length >= length) {
+      io->hits++;
+      unlink_lru(io, block);
+      push_lru(io, block);
+      return block->data;
+    }
+    /* we've only got the start of it */
+    evict(io, block);
+  }
+
+  io->misses++;
+  while (io->oldest != NULL && io->cached + length > io->cache_size) {
+    evict(io, io->oldest);
+  }
+  block = malloc(sizeof(struct io_block));
+  if (block == NULL || (block->data = malloc(length ? length : 1)) == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  if (pread_fully(io->fd, block->data, length, offset) < 0) {
+    io_fail("read");
+  }
+  block->offset = offset;
+  block->length = length;
+  block->dirty_start = block->dirty_end = 0;
+  block->hash_next = io->buckets[block_hash(io, offset)];
+  io->buckets[block_hash(io, offset)] = block;
+  push_lru(io, block);
+  io->cached += length;
+  return block->data;
+}
+
+/* block_holding finds the cached block p points into; recently used
+   blocks are the likeliest */
+static struct io_block *block_holding(struct image_io *io, const uint8_t *p)
+{
+  struct io_block *block;
+
+  for (block = io->newest; block != NULL; block = block->older) {
+    if (p >= block->data && p < block->data + block->length) {
+      return block;
+    }
+  }
+  return NULL;
+}
+
+/* overlaps says whether block holds any of the length bytes at offset */
+static int overlaps(const struct io_block *block, uint64_t offset,
+  size_t length)
+{
+  return block->offset < offset + length
+    && offset < block->offset + block->length;
+}
+
+static void pread_dirty(struct image_io *io, const uint8_t *p, size_t length)
+{
+  struct io_block *block = block_holding(io, p);
+  size_t start, end;
+
+  if (length == 0) {
+    return;
+  }
+  if (io->mode == IMAGE_READONLY) {
+    fprintf(stderr, "Disk image is read-only\n");
+    exit(1);
+  }
+  if (block == NULL) {
+    fprintf(stderr, "Changed a block that isn't cached\n");
+    exit(1);
+  }
+  start = p - block->data;
+  end = start + length;
+  if (block->dirty_start == block->dirty_end) {
+    block->dirty_start = start;
+    block->dirty_end = end;
+  } else {
+    if (start < block->dirty_start) {
+      block->dirty_start = start;
+    }
+    if (end > block->dirty_end) {
+      block->dirty_end = end;
+    }
+  }
+}
+
+static int pread_read(struct image_io *io, uint64_t offset, void *buf,
+  size_t length)
+{
+  struct io_block *block = find_block(io, offset);
+
+  if (block != NULL && block->length >= length) {
+    memcpy(buf, block->data, length);
+    return 0;
+  }
+  /* the file is behind any cached changes to the range */
+  for (block = io->newest; block != NULL; block = block->older) {
+    if (overlaps(block, offset, length) && write_back(io, block) < 0) {
+      return -1;
+    }
+  }
+  return pread_fully(io->fd, buf, length, offset);
+}
+
+static int pread_write(struct image_io *io, uint64_t offset,
+  const void *buf, size_t length)
+{
+  struct io_block *block;
+  uint64_t start, end;
+
+  if (io->mode == IMAGE_READONLY) {
+    errno = EROFS;
+    return -1;
+  }
+  if (pwrite_fully(io->fd, buf, length, offset) < 0) {
+    return -1;
+  }
+  /* keep every cached block the range touches current, so neither
+     io_get nor a later write-back hands back what was there before */
+  for (block = io->newest; block != NULL; block = block->older) {
+    if (overlaps(block, offset, length)) {
+      start = offset > block->offset ? offset : block->offset;
+      end = offset + length < block->offset + block->length
+        ? offset + length : block->offset + block->length;
+      memcpy(block->data + (start - block->offset),
+        (const uint8_t *)buf + (start - offset), end - start);
+    }
+  }
+  return 0;
+}
+
+/* the kernel copies the file into the image with copy_file_range if
+   it can; if it can't (fd is a pipe, or the kernel's too old) the file
+   comes through a buffer a chunk at a time */
+static ssize_t pread_load(struct image_io *io, uint64_t offset, int fd,
+  size_t length)
+{
+  struct io_block *block, *older;
+  uint8_t *buf = NULL;
+  size_t done = 0, chunk, pos;
+  int kernel_copy = TRUE;
+  ssize_t n;
+
+  if (io->mode == IMAGE_READONLY) {
+    errno = EROFS;
+    return -1;
+  }
+  /* the cache mustn't hand back what was there before, so drop every
+     block the range touches, writing back their changes first */
+  for (block = io->newest; block != NULL; block = older) {
+    older = block->older;
+    if (overlaps(block, offset, length)) {
+      evict(io, block);
+    }
+  }
+
+  while (done < length) {
+#ifdef __linux__
+    if (kernel_copy) {
+      loff_t out = offset + done;
+
+      n = copy_file_range(fd, NULL, io->fd, &out, length - done, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && done == 0 && (errno == EINVAL || errno == EXDEV
+          || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+        kernel_copy = FALSE;
+        continue;
+      }
+      if (n < 0) {
+        goto fail;
+      }
+      if (n == 0) {
+        break;
+      }
+      done += n;
+      continue;
+    }
+#endif
+    chunk = length - done < IO_LOAD_CHUNK ? length - done : IO_LOAD_CHUNK;
+    if (buf == NULL && (buf = malloc(chunk)) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    n = read_fully(fd, buf, chunk);
+    if (n < 0 || pwrite_fully(io->fd, buf, n, offset + done) < 0) {
+      goto fail;
+    }
+    done += n;
+    if ((size_t)n < chunk) {
+      break;
+    }
+  }
+
+  /* and zeros after the end of the file */
+  if (done < length) {
+    chunk = length - done < IO_LOAD_CHUNK ? length - done : IO_LOAD_CHUNK;
+    free(buf);
+    if ((buf = calloc(1, chunk)) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    for (pos = done; pos < length; pos += chunk) {
+      if (length - pos < chunk) {
+        chunk = length - pos;
+      }
+      if (pwrite_fully(io->fd, buf, chunk, offset + pos) < 0) {
+        goto fail;
+      }
+    }
+  }
+  free(buf);
+  return done;
+
+fail:
+  free(buf);
+  return -1;
+}
+
+static int pread_flush(struct image_io *io)
+{
+  struct io_block *block;
+
+  for (block = io->newest; block != NULL; block = block->older) {
+    if (write_back(io, block) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void pread_close(struct image_io *io)
+{
+  if (pread_flush(io) < 0) {
+    io_fail("write");
+  }
+  while (io->oldest != NULL) {
+    evict(io, io->oldest);
+  }
+  free(io->buckets);
+}
+
+static const struct image_io_ops pread_ops = {
+  "pread", pread_get, pread_dirty, pread_read, pread_write, pread_load,
+  pread_flush, pread_close
+};
+
+
+/* io_open opens a disk image with the given backend (IO_MMAP or
+   IO_PREAD), returning NULL with errno set if it can't, so that
+   callers checking many images can report the failure and carry on.
+   With IMAGE_PRIVATE or IMAGE_READONLY nothing written reaches the
+   file.  cache_size is how much IO_PREAD may cache; 0 means
+   DEFAULT_CACHE_SIZE.  The image can be a regular file or a block
+   device, but not a pipe: IO_PREAD has to be able to seek, and so
+   does IO_MMAP. */
+struct image_io *io_open(char *filename, int backend, int mode,
+  size_t cache_size)
+{
+  struct stat statbuf;
+  struct image_io *io;
+  char pathname[MAXPATHLEN+1];
+  off_t size;
+  int saved_errno;
+
+  if (backend == IO_PREAD && mode == IMAGE_PRIVATE) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* If filename isn't an absolute pathname, then we'd better prepend
+     the current working directory to it */
+  if (filename[0] == '/') {
+    strncpy(pathname, filename, MAXPATHLEN);
+    pathname[MAXPATHLEN] = '\0';
+  } else {
+    if (getcwd(pathname, MAXPATHLEN) == NULL) {
+      return NULL;
+    }
+    if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+    strcat(pathname, "/");
+    strcat(pathname, filename);
+  }
+
+  /* find out what it is, and open it for read/write */
+  if (stat(pathname, &statbuf) < 0) {
+    return NULL;
+  }
+  if (!S_ISREG(statbuf.st_mode) && !S_ISBLK(statbuf.st_mode)) {
+    errno = S_ISDIR(statbuf.st_mode) ? EISDIR : EINVAL;
+    return NULL;
+  }
+  io = malloc(sizeof(struct image_io));
+  if (io == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memset(io, 0, sizeof(struct image_io));
+  io->mode = mode;
+  io->fd = open(pathname, mode == IMAGE_READONLY ? O_RDONLY : O_RDWR);
+  if (io->fd < 0) {
+    goto fail;
+  }
+
+  /* stat doesn't know how big a block device is */
+  size = lseek(io->fd, 0, SEEK_END);
+  if (size < 0) {
+    goto fail;
+  }
+  if (size < 512) {
+    /* too small to even hold a boot sector */
+    errno = EINVAL;
+    goto fail;
+  }
+  io->size = size;
+
+  if (backend == IO_PREAD) {
+    io->ops = &pread_ops;
+    io->cache_size = cache_size ? cache_size : DEFAULT_CACHE_SIZE;
+    io->nbuckets = IO_BUCKETS;
+    io->buckets = calloc(io->nbuckets, sizeof(struct io_block *));
+    if (io->buckets == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    return io;
+  }
+
+  /* a private mapping only needs memory for the pages we change, so
+     don't let the kernel refuse one the size of a multi-GB image */
+  io->ops = &mmap_ops;
+  io->map = mmap(NULL, io->size, PROT_READ | PROT_WRITE,
+    mode == IMAGE_SHARED ? MAP_SHARED : MAP_PRIVATE | MAP_NORESERVE,
+    io->fd, 0);
+  if (io->map == MAP_FAILED) {
+    goto fail;
+  }
+  io->owns_map = TRUE;
+  return io;
+
+fail:
+  saved_errno = errno;
+  if (io->fd >= 0) {
+    close(io->fd);
+  }
+  free(io);
+  errno = saved_errno;
+  return NULL;
+}
+
+/* open_image is io_open for the tools that only ever look at one
+   image: if it can't be opened, it says so and exits */
+struct image_io *open_image(char *filename, int backend, int mode,
+  size_t cache_size)
+{
+  struct image_io *io = io_open(filename, backend, mode, cache_size);
+
+  if (io == NULL) {
+    fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+      filename, strerror(errno));
+    exit(1);
+  }
+  return io;
+}
+
+/* io_wrap makes an image out of size bytes already in memory at buf,
+   which stays the caller's */
+struct image_io *io_wrap(uint8_t *buf, size_t size)
+{
+  struct image_io *io = malloc(sizeof(struct image_io));
+
+  if (io == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memset(io, 0, sizeof(struct image_io));
+  io->ops = &mmap_ops;
+  io->fd = -1;
+  io->mode = IMAGE_SHARED;
+  io->size = size;
+  io->map = buf;
+  return io;
+}
+
+/* io_backend turns "mmap" or "pread" into IO_MMAP or IO_PREAD, or
+   returns -1 if it's neither */
+int io_backend(const char *name)
+{
+  if (strcmp(name, mmap_ops.name) == 0) {
+    return IO_MMAP;
+  }
+  if (strcmp(name, pread_ops.name) == 0) {
+    return IO_PREAD;
+  }
+  return -1;
+}
+
+/* io_offset returns where in the image p, from io_get, points */
+uint64_t io_offset(struct image_io *io, const uint8_t *p)
+{
+  struct io_block *block;
+
+  if (io->map != NULL) {
+    return p - io->map;
+  }
+  block = block_holding(io, p);
+  if (block == NULL) {
+    fprintf(stderr, "Changed a block that isn't cached\n");
+    exit(1);
+  }
+  return block->offset + (p - block->data);
+}
+
+/* io_report prints how well the cache did */
+void io_report(struct image_io *io, FILE *out)
+{
+  if (io->map != NULL) {
+    fprintf(out, "%s: mapped, nothing cached\n", io->ops->name);
+    return;
+  }
+  fprintf(out, "%s: %llu hits, %llu misses, %llu write-backs\n",
+    io->ops->name, (unsigned long long)io->hits,
+    (unsigned long long)io->misses, (unsigned long long)io->writebacks);
+}
+
+/* io_close writes back anything still cached, and closes the image */
+void io_close(struct image_io *io)
+{
+  io->ops->close(io);
+  if (io->fd >= 0) {
+    close(io->fd);
+  }
+  free(io);
+}
@@ -0,0 +1,153 @@
+/* how the tools get at a disk image: straight through a memory
+   mapping, or with pread and pwrite through a cache of blocks */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* how io_open opens the image: writes go straight to the file, or
+   stay in a private copy-on-write copy of it, which for
+   IMAGE_READONLY is all we can open the file for.  IO_PREAD has no
+   private copy, so it can't do IMAGE_PRIVATE, and refuses to change a
+   read-only image */
+#define IMAGE_SHARED 0
+#define IMAGE_PRIVATE 1
+#define IMAGE_READONLY 2
+
+/* backends for io_open */
+#define IO_MMAP 0
+#define IO_PREAD 1
+
+/* how much IO_PREAD caches unless told otherwise */
+#define DEFAULT_CACHE_SIZE (1024 * 1024)
+
+struct image_io;
+
+/* what each backend provides.  get returns length bytes of the image
+   starting at offset; dirty says the caller changed length bytes at p,
+   which get returned; read and write copy between the image and a
+   buffer of the caller's, returning -1 with errno set on failure; load
+   copies from a file into the image, returning how much it copied */
+struct image_io_ops {
+  const char *name;
+  uint8_t *(*get)(struct image_io *io, uint64_t offset, size_t length);
+  void (*dirty)(struct image_io *io, const uint8_t *p, size_t length);
+  int (*read)(struct image_io *io, uint64_t offset, void *buf,
+    size_t length);
+  int (*write)(struct image_io *io, uint64_t offset, const void *buf,
+    size_t length);
+  ssize_t (*load)(struct image_io *io, uint64_t offset, int fd,
+    size_t length);
+  int (*flush)(struct image_io *io);
+  void (*close)(struct image_io *io);
+};
+
+/* one block held by the IO_PREAD cache.  Blocks are whatever the
+   callers ask get for -- a directory cluster, the root directory, the
+   FAT -- always starting on a sector boundary */
+struct io_block {
+  uint64_t offset;
+  size_t length;
+  uint8_t *data;
+  size_t dirty_start;         /* the bytes that need writing back; */
+  size_t dirty_end;           /* none if they're equal */
+  struct io_block *hash_next;
+  struct io_block *newer;     /* least recently used list */
+  struct io_block *older;
+};
+
+/* an open disk image.  With IO_MMAP, map is the whole image and a
+   pointer from io_get lasts as long as the image is open (the scan in
+   dos_scandisk relies on this, and on being able to share it between
+   threads).  With IO_PREAD, map is NULL, and a pointer from io_get is
+   only good until the next io_get or io_load.  io_write updates any
+   cached blocks it overlaps, io_load drops them, and io_read sees
+   changes to them that haven't been written back yet */
+struct image_io {
+  const struct image_io_ops *ops;
+  int fd;                     /* -1 for an image in a buffer */
+  int mode;                   /* IMAGE_SHARED, IMAGE_PRIVATE or
+                                 IMAGE_READONLY */
+  uint64_t size;
+  uint8_t *map;
+  int owns_map;               /* unmap it on close */
+  size_t cache_size;          /* IO_PREAD tries to keep no more than
+                                 this many bytes of blocks */
+  size_t cached;
+  struct io_block **buckets;
+  uint32_t nbuckets;
+  struct io_block *newest;
+  struct io_block *oldest;
+  uint64_t hits;              /* io_get found the block cached */
+  uint64_t misses;            /* io_get had to read it */
+  uint64_t writebacks;        /* dirty blocks written to the image */
+};
+
+struct image_io *io_open(char *filename, int backend, int mode,
+  size_t cache_size);
+struct image_io *open_image(char *filename, int backend, int mode,
+  size_t cache_size);
+struct image_io *io_wrap(uint8_t *buf, size_t size);
+int io_backend(const char *name);
+uint64_t io_offset(struct image_io *io, const uint8_t *p);
+void io_report(struct image_io *io, FILE *out);
+void io_close(struct image_io *io);
+
+/* io_get is on every cluster lookup's path, so it's inlined even
+   without optimisation, as in dos.h */
+#ifndef ALWAYS_INLINE
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+#endif
+
+/* io_get returns length bytes of the image starting at offset, for
+   reading or (followed by io_dirty) writing.  Mapped images skip the
+   indirection, so this costs no more than pointer arithmetic */
+static ALWAYS_INLINE uint8_t *io_get(struct image_io *io, uint64_t offset,
+  size_t length)
+{
+  if (io->map != NULL) {
+    return io->map + offset;
+  }
+  return io->ops->get(io, offset, length);
+}
+
+/* io_dirty says length bytes at p, from io_get, have been changed */
+static inline void io_dirty(struct image_io *io, const uint8_t *p,
+  size_t length)
+{
+  if (io->map == NULL) {
+    io->ops->dirty(io, p, length);
+  }
+}
+
+static inline int io_read(struct image_io *io, uint64_t offset,
+  void *buf, size_t length)
+{
+  return io->ops->read(io, offset, buf, length);
+}
+
+static inline int io_write(struct image_io *io, uint64_t offset,
+  const void *buf, size_t length)
+{
+  return io->ops->write(io, offset, buf, length);
+}
+
+/* io_load reads up to length bytes from fd, from wherever it's got to,
+   straight into the image at offset, without a copy in between where
+   the backend can manage it.  Whatever the file runs out before is
+   zero filled.  Returns how many bytes came from the file, or -1 */
+static inline ssize_t io_load(struct image_io *io, uint64_t offset, int fd,
+  size_t length)
+{
+  return io->ops->load(io, offset, fd, length);
+}
+
+static inline int io_flush(struct image_io *io)
+{
+  return io->ops->flush(io);
+}
@@ -0,0 +1,351 @@
+/* the write-ahead journal dos_scandisk keeps its repairs in */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "journal.h"
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  putulong(p, (uint32_t)v);
+  putulong(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  return getulong(p) | (uint64_t)getulong(p + 4) << 32;
+}
+
+/**
+ * Adler-32 of len bytes at p, to spot a journal that was only partly
+ * written.
+ */
+static uint32_t journal_checksum(const uint8_t *p, size_t len) {
+  uint32_t a = 1, b = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    a = (a + p[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return b << 16 | a;
+}
+
+static int compare_ranges(const void *x, const void *y) {
+  const struct image_range *a = x, *b = y;
+  return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+/**
+ * Reads len bytes at offset from fd, however many reads it takes.
+ */
+static int read_fully(int fd, uint8_t *buf, size_t len, off_t offset) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = pread(fd, buf, len, offset);
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/**
+ * Builds a journal of every write noted in fat since it was loaded.
+ * The writes went into a private mapping of the image, so the bytes
+ * they replaced are read back from the file itself through fd, and
+ * the new ones from the mapping.
+ * Overlapping and adjacent writes are merged, and ranges that ended up
+ * unchanged are left out.  Returns -1 with errno set if the file can't
+ * be read.
+ */
+int journal_build(struct journal *journal, struct fat_table *fat, int fd,
+  size_t image_size) {
+  struct image_range *ranges;
+  struct journal_header *header;
+  uint32_t n = 0, i;
+  size_t len;
+  uint8_t *p;
+
+  memset(journal, 0, sizeof(struct journal));
+  journal->image_size = image_size;
+
+  /* sort and merge the ranges, counting up how big the journal is */
+  ranges = malloc((fat->nwrites ? fat->nwrites : 1) * sizeof(struct image_range));
+  if (ranges == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memcpy(ranges, fat->writes, fat->nwrites * sizeof(struct image_range));
+  qsort(ranges, fat->nwrites, sizeof(struct image_range), compare_ranges);
+  for (i = 0; i < fat->nwrites; i++) {
+    struct image_range *last = n > 0 ? &ranges[n - 1] : NULL;
+    if (last != NULL && ranges[i].offset <= last->offset + last->length) {
+      if (ranges[i].offset + ranges[i].length > last->offset + last->length) {
+        last->length = ranges[i].offset + ranges[i].length - last->offset;
+      }
+    } else {
+      ranges[n++] = ranges[i];
+    }
+  }
+  len = sizeof(struct journal_header);
+  for (i = 0; i < n; i++) {
+    len += sizeof(struct journal_record) + 2 * ranges[i].length;
+  }
+
+  journal->buf = malloc(len);
+  if (journal->buf == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  p = journal->buf + sizeof(struct journal_header);
+  for (i = 0; i < n; i++) {
+    struct journal_record *record = (struct journal_record *)p;
+    uint8_t *old = p + sizeof(struct journal_record);
+    uint8_t *new = old + ranges[i].length;
+
+    if (read_fully(fd, old, ranges[i].length, ranges[i].offset) < 0) {
+      free(ranges);
+      journal_free(journal);
+      return -1;
+    }
+    if (io_read(fat->io, ranges[i].offset, new, ranges[i].length) < 0) {
+      free(ranges);
+      journal_free(journal);
+      return -1;
+    }
+    if (memcmp(old, new, ranges[i].length) == 0) {
+      continue;
+    }
+    put_u64(record->jrOffset, ranges[i].offset);
+    putulong(record->jrLength, ranges[i].length);
+    p = new + ranges[i].length;
+    journal->nrecords++;
+  }
+  free(ranges);
+
+  journal->len = p - journal->buf;
+  header = (struct journal_header *)journal->buf;
+  memcpy(header->jhMagic, JOURNAL_MAGIC, 8);
+  put_u64(header->jhImageSize, image_size);
+  putulong(header->jhRecords, journal->nrecords);
+  putulong(header->jhChecksum, journal_checksum(journal->buf
+    + sizeof(struct journal_header), journal->len - sizeof(struct journal_header)));
+  return 0;
+}
+
+/**
+ * Writes the journal to path and waits for it to reach the disk, so
+ * it's safe to start changing the image.  Returns -1 with errno set if
+ * it can't.
+ */
+int journal_write(struct journal *journal, const char *path) {
+  size_t done = 0;
+  ssize_t n;
+  int fd, saved_errno;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  while (done < journal->len) {
+    n = write(fd, journal->buf + done, journal->len - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      goto fail;
+    }
+    done += n;
+  }
+  if (fsync(fd) < 0) {
+    goto fail;
+  }
+  return close(fd);
+
+fail:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+/**
+ * Reads a journal back from path, checking it's complete.  Returns
+ * NULL, or a description of what's wrong with it.
+ */
+const char *journal_read(struct journal *journal, const char *path) {
+  struct journal_header *header;
+  struct stat statbuf;
+  uint32_t i;
+  uint8_t *p, *end;
+  int fd;
+
+  memset(journal, 0, sizeof(struct journal));
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return strerror(errno);
+  }
+  if (fstat(fd, &statbuf) < 0) {
+    close(fd);
+    return strerror(errno);
+  }
+  if (statbuf.st_size < sizeof(struct journal_header)) {
+    close(fd);
+    return "not a repair journal";
+  }
+  journal->len = statbuf.st_size;
+  journal->buf = malloc(journal->len);
+  if (journal->buf == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  if (read_fully(fd, journal->buf, journal->len, 0) < 0) {
+    close(fd);
+    journal_free(journal);
+    return strerror(errno);
+  }
+  close(fd);
+
+  header = (struct journal_header *)journal->buf;
+  if (memcmp(header->jhMagic, JOURNAL_MAGIC, 8) != 0) {
+    journal_free(journal);
+    return "not a repair journal";
+  }
+  if (getulong(header->jhChecksum) != journal_checksum(journal->buf
+      + sizeof(struct journal_header), journal->len - sizeof(struct journal_header))) {
+    journal_free(journal);
+    return "journal is incomplete or damaged";
+  }
+  journal->image_size = get_u64(header->jhImageSize);
+  journal->nrecords = getulong(header->jhRecords);
+
+  /* make sure the records fit, so journal_apply can trust them */
+  p = journal->buf + sizeof(struct journal_header);
+  end = journal->buf + journal->len;
+  for (i = 0; i < journal->nrecords; i++) {
+    struct journal_record *record = (struct journal_record *)p;
+    uint64_t offset, length;
+    if (end - p < sizeof(struct journal_record)) {
+      break;
+    }
+    offset = get_u64(record->jrOffset);
+    length = getulong(record->jrLength);
+    if ((end - p - sizeof(struct journal_record)) / 2 < length
+        || offset > journal->image_size || length > journal->image_size - offset) {
+      break;
+    }
+    p += sizeof(struct journal_record) + 2 * length;
+  }
+  if (i < journal->nrecords || p != end) {
+    journal_free(journal);
+    return "journal is incomplete or damaged";
+  }
+  return NULL;
+}
+
+/**
+ * Moves the image open on fd from one side of the journal to the other
+ * (direction is JOURNAL_REDO or JOURNAL_UNDO).  Every byte is checked
+ * before anything is written: each one has to hold either its old or
+ * its new value, so a change that was only partly made is finished,
+ * but an image that's been changed some other way since is left alone.
+ * The changes go into a shared mapping of the image and reach the disk
+ * with a single msync.  Returns the number of records that changed
+ * anything, or -1 after explaining to err why it couldn't.
+ */
+int journal_apply(struct journal *journal, int fd, int direction,
+  const char *image, FILE *err) {
+  off_t size;
+  uint8_t *image_buf, *p;
+  uint32_t i, changed = 0;
+  size_t j;
+  int pass;
+
+  /* stat says a block device holds 0 bytes, so ask lseek as io.c does */
+  size = lseek(fd, 0, SEEK_END);
+  if (size < 0) {
+    fprintf(err, "Cannot read disk image file %s: %s\n", image, strerror(errno));
+    return -1;
+  }
+  if (size != journal->image_size) {
+    fprintf(err, "Journal is for an image of %llu bytes, but %s is %llu bytes\n",
+      (unsigned long long)journal->image_size, image,
+      (unsigned long long)size);
+    return -1;
+  }
+  if (journal->nrecords == 0) {
+    return 0;
+  }
+  image_buf = mmap(NULL, journal->image_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED, fd, 0);
+  if (image_buf == MAP_FAILED) {
+    fprintf(err, "Cannot map disk image file %s: %s\n", image, strerror(errno));
+    return -1;
+  }
+
+  /* check everything on the first pass, write on the second */
+  for (pass = 0; pass < 2; pass++) {
+    p = journal->buf + sizeof(struct journal_header);
+    for (i = 0; i < journal->nrecords; i++) {
+      struct journal_record *record = (struct journal_record *)p;
+      uint64_t offset = get_u64(record->jrOffset);
+      uint32_t length = getulong(record->jrLength);
+      uint8_t *old = p + sizeof(struct journal_record);
+      uint8_t *new = old + length;
+      uint8_t *from = direction == JOURNAL_UNDO ? new : old;
+      uint8_t *to = direction == JOURNAL_UNDO ? old : new;
+
+      p = new + length;
+      if (pass == 1) {
+        if (memcmp(image_buf + offset, to, length) != 0) {
+          memcpy(image_buf + offset, to, length);
+          changed++;
+        }
+        continue;
+      }
+      for (j = 0; j < length; j++) {
+        if (image_buf[offset + j] != from[j] && image_buf[offset + j] != to[j]) {
+          fprintf(err, "%s has changed at offset %llu since the journal was written\n",
+            image, (unsigned long long)(offset + j));
+          munmap(image_buf, journal->image_size);
+          return -1;
+        }
+      }
+    }
+  }
+
+  if (changed > 0 && msync(image_buf, journal->image_size, MS_SYNC) < 0) {
+    fprintf(err, "Cannot write disk image file %s: %s\n", image, strerror(errno));
+    munmap(image_buf, journal->image_size);
+    return -1;
+  }
+  munmap(image_buf, journal->image_size);
+  return changed;
+}
+
+void journal_free(struct journal *journal) {
+  free(journal->buf);
+  journal->buf = NULL;
+}
@@ -0,0 +1,48 @@
+/* the write-ahead journal dos_scandisk keeps its repairs in */
+
+#include <stdio.h>
+
+#define JOURNAL_MAGIC "SCANJRNL"
+
+/**
+ * How a journal file starts.  Like the BPB, everything is little-endian
+ * byte arrays, so a journal means the same thing on any machine.
+ */
+struct journal_header {
+  uint8_t jhMagic[8];         /* JOURNAL_MAGIC */
+  uint8_t jhImageSize[8];     /* length of the image it belongs to */
+  uint8_t jhRecords[4];       /* number of records that follow */
+  uint8_t jhChecksum[4];      /* of everything after the header */
+};
+
+/**
+ * One change to the image.  The record is followed by jrLength bytes
+ * as they were before the repair, then jrLength bytes as they are
+ * after it.
+ */
+struct journal_record {
+  uint8_t jrOffset[8];
+  uint8_t jrLength[4];
+};
+
+/**
+ * A journal read into (or built in) memory.
+ */
+struct journal {
+  uint8_t *buf;               /* the whole file: header, then records */
+  size_t len;
+  uint64_t image_size;
+  uint32_t nrecords;
+};
+
+/* which way journal_apply moves the image */
+#define JOURNAL_REDO 0        /* from the old bytes to the new */
+#define JOURNAL_UNDO 1        /* from the new bytes back to the old */
+
+int journal_build(struct journal *journal, struct fat_table *fat, int fd,
+  size_t image_size);
+int journal_write(struct journal *journal, const char *path);
+const char *journal_read(struct journal *journal, const char *path);
+int journal_apply(struct journal *journal, int fd, int direction,
+  const char *image, FILE *err);
+void journal_free(struct journal *journal);
@@ -0,0 +1,475 @@
+/* reads the clusters of a file's chain in order, with reads of the
+   clusters further along already in flight */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "reader.h"
+
+/* io_uring is driven with the raw system calls, so there's nothing
+   extra to link against; anywhere it isn't there, ring_open just
+   fails and the reader falls back to io_read */
+#if defined(__linux__) && defined(__NR_io_uring_setup) \
+  && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define READER_HAVE_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifdef READER_HAVE_URING
+
+/* the submission and completion rings, shared with the kernel */
+struct reader_ring {
+  int fd;
+  uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  uint32_t *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+  uint32_t to_submit;         /* queued since the last io_uring_enter */
+};
+
+static struct reader_ring *ring_open(uint32_t entries)
+{
+  struct io_uring_params params;
+  struct reader_ring *ring;
+  uint8_t *sq, *cq;
+
+  ring = malloc(sizeof(struct reader_ring));
+  if (ring == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memset(ring, 0, sizeof(struct reader_ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    /* too old a kernel, or not allowed */
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_map_size = params.sq_off.array
+    + params.sq_entries * sizeof(uint32_t);
+  ring->cq_map_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    if (ring->cq_map_size > ring->sq_map_size) {
+      ring->sq_map_size = ring->cq_map_size;
+    }
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    goto fail;
+  }
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    ring->cq_map = ring->sq_map;
+  } else {
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      munmap(ring->sq_map, ring->sq_map_size);
+      goto fail;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_map != ring->sq_map) {
+      munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    goto fail;
+  }
+
+  sq = ring->sq_map;
+  ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+  ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+  ring->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+  cq = ring->cq_map;
+  ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+  ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+  ring->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return ring;
+
+fail:
+  close(ring->fd);
+  free(ring);
+  return NULL;
+}
+
+static void ring_close(struct reader_ring *ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_size);
+  }
+  munmap(ring->sq_map, ring->sq_map_size);
+  close(ring->fd);
+  free(ring);
+}
+
+/* ring_queue adds a read of the slot's clusters to the submission
+   ring; nothing reaches the kernel until ring_enter */
+static void ring_queue(struct cluster_reader *r, uint32_t index)
+{
+  struct reader_ring *ring = r->ring;
+  struct reader_slot *slot = &r->slots[index];
+  uint32_t tail = *ring->sq_tail;
+  uint32_t i = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[i];
+
+  slot->iov.iov_base = slot->buf;
+  slot->iov.iov_len = slot->length;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = r->io->fd;
+  sqe->off = cluster_offset(slot->cluster, r->bpb);
+  sqe->addr = (uintptr_t)&slot->iov;
+  sqe->len = 1;
+  sqe->user_data = index;
+  ring->sq_array[i] = i;
+  /* the kernel mustn't see the new tail before the entry */
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  r->inflight++;
+}
+
+/* ring_enter submits whatever's been queued, and if wait is set,
+   waits for at least one read to finish */
+static int ring_enter(struct reader_ring *ring, int wait)
+{
+  int n;
+
+  if (ring->to_submit == 0 && !wait) {
+    return 0;
+  }
+  do {
+    n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0,
+      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return -1;
+  }
+  ring->to_submit -= n < ring->to_submit ? n : ring->to_submit;
+  return 0;
+}
+
+/* ring_reap marks every finished read's slot done */
+static void ring_reap(struct cluster_reader *r)
+{
+  struct reader_ring *ring = r->ring;
+  uint32_t head = *ring->cq_head;
+  uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    struct reader_slot *slot = &r->slots[cqe->user_data];
+
+    if (cqe->res < 0) {
+      slot->error = -cqe->res;
+    } else if (cqe->res < slot->length) {
+      /* reads only come up short at the end of the image */
+      memset(slot->buf + cqe->res, 0, slot->length - cqe->res);
+    }
+    slot->done = TRUE;
+    r->inflight--;
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+struct reader_ring {
+  int unused;
+};
+
+static struct reader_ring *ring_open(uint32_t entries)
+{
+  return NULL;
+}
+
+static void ring_close(struct reader_ring *ring)
+{
+}
+
+static void ring_queue(struct cluster_reader *r, uint32_t index)
+{
+}
+
+static int ring_enter(struct reader_ring *ring, int wait)
+{
+  return 0;
+}
+
+static void ring_reap(struct cluster_reader *r)
+{
+}
+
+#endif
+
+/* next_extent takes the next run of consecutive clusters off the
+   chain, no more than r->max_extent bytes of it, checking each cluster
+   number the way copy_out_file always has.  It says where the run
+   starts, how many clusters it has and how many bytes of them the file
+   uses; returns FALSE if the chain has nothing more to give */
+static int next_extent(struct cluster_reader *r, uint32_t *first,
+  uint32_t *count, uint32_t *length)
+{
+  uint32_t cluster_size = bpb_geometry(r->bpb)->cluster_size;
+  uint32_t cluster, bytes;
+
+  *count = 0;
+  *length = 0;
+  while (!r->chain_done && *length < r->max_extent) {
+    cluster = r->next_cluster;
+    if (cluster == 0) {
+      snprintf(r->error, sizeof(r->error), "Bad file termination");
+      r->chain_done = TRUE;
+      break;
+    } else if (is_end_of_file(cluster)) {
+      r->chain_done = TRUE;
+      break;
+    } else if (cluster >= r->fat->nclusters) {
+      snprintf(r->error, sizeof(r->error),
+        "Bad cluster number %u in file", cluster);
+      r->chain_done = TRUE;
+      break;
+    } else if (r->steps >= r->fat->max_chain) {
+      snprintf(r->error, sizeof(r->error),
+        "File is longer than %u clusters", r->fat->max_chain);
+      r->chain_done = TRUE;
+      break;
+    } else if (*count > 0 && cluster != *first + *count) {
+      /* the run ends here; this cluster starts the next one */
+      break;
+    }
+
+    if (*count == 0) {
+      *first = cluster;
+    }
+    r->steps++;
+    (*count)++;
+    bytes = r->left < cluster_size ? r->left : cluster_size;
+    *length += bytes;
+    r->left -= bytes;
+    if (r->left == 0) {
+      r->chain_done = TRUE;
+    } else {
+      r->next_cluster = fat_get(r->fat, cluster);
+    }
+  }
+  return *count > 0;
+}
+
+/* fill queues reads of the next runs of clusters in the chain until
+   depth are waiting or the chain runs out */
+static void fill(struct cluster_reader *r)
+{
+  uint32_t index;
+  struct reader_slot *slot;
+
+  while (!r->chain_done && r->queued < r->depth) {
+    index = (r->head + r->queued) % r->depth;
+    slot = &r->slots[index];
+    if (!next_extent(r, &slot->cluster, &slot->count, &slot->length)) {
+      break;
+    }
+    slot->done = FALSE;
+    slot->error = 0;
+    if (r->ring != NULL) {
+      ring_queue(r, index);
+    } else if (r->io->fd >= 0 && r->queued > 0) {
+      /* it'll be read soon; start the kernel on it now */
+      posix_fadvise(r->io->fd, cluster_offset(slot->cluster, r->bpb),
+        slot->length, POSIX_FADV_WILLNEED);
+    }
+    r->queued++;
+  }
+  if (r->ring != NULL && ring_enter(r->ring, FALSE) < 0) {
+    snprintf(r->error, sizeof(r->error), "Cannot read disk image: %s",
+      strerror(errno));
+    r->chain_done = TRUE;
+  }
+}
+
+/* reader_start gets ready to read bytes bytes of the chain starting
+   at cluster.  Consecutive clusters are read together, up to
+   READER_MAX_EXTENT bytes at a time, and depth is how many of those
+   reads to have queued at once; 0 means read them one at a time
+   without io_uring.  Images that aren't a file (io_wrap) are always
+   read with io_read. */
+void reader_start(struct cluster_reader *r, struct image_io *io,
+  struct bpb710 *bpb, struct fat_table *fat, uint32_t cluster,
+  uint32_t bytes, uint32_t depth)
+{
+  uint32_t cluster_size = bpb_geometry(bpb)->cluster_size;
+  uint32_t i;
+
+  memset(r, 0, sizeof(struct cluster_reader));
+  r->io = io;
+  r->bpb = bpb;
+  r->fat = fat;
+  r->next_cluster = cluster;
+  r->left = bytes;
+  r->chain_done = bytes == 0;
+
+  /* whole clusters, and no more of them than the file has */
+  r->max_extent = READER_MAX_EXTENT - READER_MAX_EXTENT % cluster_size;
+  if (bytes < r->max_extent) {
+    r->max_extent = (bytes + cluster_size - 1) / cluster_size * cluster_size;
+  }
+  if (r->max_extent == 0) {
+    r->max_extent = cluster_size;
+  }
+
+  if (depth > 0 && io->fd >= 0) {
+    r->ring = ring_open(depth);
+  }
+  r->depth = depth > 0 ? depth : 1;
+  r->slots = calloc(r->depth, sizeof(struct reader_slot));
+  if (r->slots == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < r->depth; i++) {
+    r->slots[i].buf = malloc(r->max_extent);
+    if (r->slots[i].buf == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  fill(r);
+}
+
+/* reader_walk gets ready to hand out the same chain as runs of
+   consecutive clusters with reader_extent, for a caller that moves
+   the data itself and so needs neither buffers nor reads.  A run can
+   be as long as the file */
+void reader_walk(struct cluster_reader *r, struct image_io *io,
+  struct bpb710 *bpb, struct fat_table *fat, uint32_t cluster,
+  uint32_t bytes)
+{
+  memset(r, 0, sizeof(struct cluster_reader));
+  r->io = io;
+  r->bpb = bpb;
+  r->fat = fat;
+  r->next_cluster = cluster;
+  r->left = bytes;
+  r->chain_done = bytes == 0;
+  r->max_extent = UINT32_MAX;
+}
+
+/* reader_extent returns the next run of the file from reader_walk:
+   where in the image it is, and how many bytes of it the file uses.
+   Returns FALSE at the end of the file, or if it can't go on, in which
+   case r->error says why. */
+int reader_extent(struct cluster_reader *r, uint64_t *offset,
+  uint32_t *length)
+{
+  uint32_t first, count;
+
+  if (!next_extent(r, &first, &count, length)) {
+    return FALSE;
+  }
+  *offset = cluster_offset(first, r->bpb);
+  r->clusters += count;
+  r->extents++;
+  return TRUE;
+}
+
+/* reader_next returns the next run of clusters of the file, with how
+   many bytes of it the file uses in *length.  It stays valid until the
+   next call.  Returns NULL at the end of the file, or if it can't go
+   on, in which case r->error says why. */
+const uint8_t *reader_next(struct cluster_reader *r, uint32_t *length)
+{
+  struct reader_slot *slot;
+
+  if (r->handed_out) {
+    /* the caller's finished with the last one, so its slot can be
+       used for a run further on */
+    r->handed_out = FALSE;
+    r->head = (r->head + 1) % r->depth;
+    r->queued--;
+    fill(r);
+  }
+  if (r->queued == 0) {
+    return NULL;
+  }
+
+  slot = &r->slots[r->head];
+  if (r->ring != NULL) {
+    ring_reap(r);
+    while (!slot->done) {
+      if (ring_enter(r->ring, TRUE) < 0) {
+        snprintf(r->error, sizeof(r->error), "Cannot read disk image: %s",
+          strerror(errno));
+        return NULL;
+      }
+      ring_reap(r);
+    }
+  } else if (io_read(r->io, cluster_offset(slot->cluster, r->bpb), slot->buf,
+      slot->length) < 0) {
+    slot->error = errno;
+  }
+  if (slot->error != 0) {
+    /* this overrides any problem further along the chain */
+    snprintf(r->error, sizeof(r->error), "Cannot read disk image: %s",
+      strerror(slot->error));
+    r->chain_done = TRUE;
+    return NULL;
+  }
+  r->handed_out = TRUE;
+  r->clusters += slot->count;
+  r->extents++;
+  *length = slot->length;
+  return slot->buf;
+}
+
+/* reader_method says how the clusters are being read */
+const char *reader_method(struct cluster_reader *r)
+{
+  return r->ring != NULL ? "io_uring" : "pread";
+}
+
+/* reader_end waits for any reads still in flight, which may be into
+   its buffers, and frees everything */
+void reader_end(struct cluster_reader *r)
+{
+  uint32_t i;
+
+  if (r->ring != NULL) {
+    while (r->inflight > 0) {
+      ring_reap(r);
+      if (r->inflight > 0 && ring_enter(r->ring, TRUE) < 0) {
+        break;
+      }
+    }
+    ring_close(r->ring);
+  }
+  for (i = 0; i < r->depth; i++) {
+    free(r->slots[i].buf);
+  }
+  free(r->slots);
+}
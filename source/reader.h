@@ -0,0 +1,63 @@
+/* reads the clusters of a file's chain in order, with reads of the
+   clusters further along already in flight */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* how many reads dos_cp keeps in flight unless told otherwise */
+#define READER_DEFAULT_DEPTH 32
+
+/* the most one read covers, when the chain has that many consecutive
+   clusters; rounded down to whole clusters */
+#define READER_MAX_EXTENT (128 * 1024)
+
+/* one run of consecutive clusters being read */
+struct reader_slot {
+  uint8_t *buf;
+  uint32_t cluster;           /* the first of them */
+  uint32_t count;
+  uint32_t length;            /* bytes of them the file uses */
+  struct iovec iov;           /* for the io_uring read */
+  int done;                   /* the read has finished */
+  int error;                  /* and failed, with this errno */
+};
+
+struct reader_ring;
+
+/* walks the FAT chain ahead of whoever's reading the file, queueing
+   up to depth reads, each of a run of consecutive clusters.  With
+   io_uring they're all in flight at once; without it, they're read one
+   at a time with io_read, and the kernel is told about the ones coming
+   up so it can read them ahead */
+struct cluster_reader {
+  struct image_io *io;
+  struct bpb710 *bpb;
+  struct fat_table *fat;
+  uint32_t next_cluster;      /* the next one to queue */
+  uint32_t left;              /* bytes of the file not queued yet */
+  uint32_t steps;             /* clusters queued, for max_chain */
+  uint32_t max_extent;        /* most bytes a run can have */
+  int chain_done;             /* nothing more to queue */
+  char error[80];             /* why the file ended early, or "" */
+  struct reader_slot *slots;  /* a ring of depth slots */
+  uint32_t depth;
+  uint32_t head;              /* slot to hand out next */
+  uint32_t queued;            /* slots queued but not handed out */
+  uint32_t inflight;          /* io_uring reads not finished */
+  int handed_out;             /* the caller has slots[head] */
+  struct reader_ring *ring;   /* NULL if reading synchronously */
+  uint64_t clusters;          /* handed out so far */
+  uint64_t extents;           /* and the runs they were in */
+};
+
+void reader_start(struct cluster_reader *r, struct image_io *io,
+  struct bpb710 *bpb, struct fat_table *fat, uint32_t cluster,
+  uint32_t bytes, uint32_t depth);
+const uint8_t *reader_next(struct cluster_reader *r, uint32_t *length);
+void reader_walk(struct cluster_reader *r, struct image_io *io,
+  struct bpb710 *bpb, struct fat_table *fat, uint32_t cluster,
+  uint32_t bytes);
+int reader_extent(struct cluster_reader *r, uint64_t *offset,
+  uint32_t *length);
+const char *reader_method(struct cluster_reader *r);
+void reader_end(struct cluster_reader *r);
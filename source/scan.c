@@ -0,0 +1,829 @@
+/* the directory-tree scan behind dos_scandisk */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "scan.h"
+
+/**
+ * Removes padding from a given string
+ */
+void removePadding(char *string, u_int8_t length) {
+  int i;
+  for(i = length; i > 0; i--) {
+    if(string[i] == ' ') {
+      string[i] = '\0';
+    } else {
+      break;
+    }
+  }
+}
+
+/**
+ * Allocates the per-cluster reference maps for a scan whose
+ * image, bpb and fat are already set up.
+ */
+void scan_init(struct scan *scan) {
+  uint32_t nwords = (scan->fat->nclusters + 63) / 64;
+
+  scan->ref_map = calloc(nwords, sizeof(uint64_t));
+  scan->shared_map = calloc(nwords, sizeof(uint64_t));
+  scan->extra_refs = NULL;
+  scan->dir_map = calloc(nwords, sizeof(uint64_t));
+  if (scan->ref_map == NULL || scan->shared_map == NULL || scan->dir_map == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+}
+
+/**
+ * Frees everything scan_init and the scan itself allocated.
+ */
+void scan_free(struct scan *scan) {
+  free(scan->ref_map);
+  free(scan->shared_map);
+  free(scan->extra_refs);
+  free(scan->dir_map);
+  free(scan->files);
+}
+
+/**
+ * Returns how many chains go through cluster, as far as 255.
+ */
+uint32_t cluster_refs(struct scan *scan, uint32_t cluster) {
+  if (!map_test(scan->ref_map, cluster)) {
+    return 0;
+  }
+  if (!map_test(scan->shared_map, cluster)) {
+    return 1;
+  }
+  return 2 + (scan->extra_refs != NULL ? scan->extra_refs[cluster] : 0);
+}
+
+/**
+ * Takes one chain off a cluster more than one goes through, when a
+ * repair cuts it loose.
+ */
+void unref_cluster(struct scan *scan, uint32_t cluster) {
+  if (scan->extra_refs != NULL && scan->extra_refs[cluster] > 0) {
+    scan->extra_refs[cluster]--;
+  } else {
+    scan->shared_map[cluster / 64] &= ~((uint64_t)1 << (cluster % 64));
+  }
+}
+
+/**
+ * Counts a third or later chain through cluster. Hardly any image has
+ * one, so the counts aren't allocated until one turns up; whichever
+ * thread gets there first installs them.
+ */
+static void count_extra_ref(struct scan *scan, uint32_t cluster) {
+  uint8_t *extra = __atomic_load_n(&scan->extra_refs, __ATOMIC_ACQUIRE);
+  uint8_t *fresh = NULL, refs;
+
+  if (extra == NULL) {
+    fresh = calloc(scan->fat->nclusters, sizeof(uint8_t));
+    if (fresh == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    if (__atomic_compare_exchange_n(&scan->extra_refs, &extra, fresh, false,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      extra = fresh;
+    } else {
+      free(fresh);
+    }
+  }
+  refs = __atomic_load_n(&extra[cluster], __ATOMIC_RELAXED);
+  while (refs < 253 && !__atomic_compare_exchange_n(&extra[cluster], &refs,
+      refs + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/**
+ * Allocates a map of the clusters a walk along a chain has been
+ * through, one bit per cluster.  Every thread has its own, so walks
+ * running at the same time can't disturb each other.
+ */
+uint64_t *walk_map_new(struct scan *scan) {
+  uint64_t *visited = calloc((scan->fat->nclusters + 63) / 64, sizeof(uint64_t));
+
+  if (visited == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  return visited;
+}
+
+/**
+ * Clears the bits a walk of length clusters from start set, ready for
+ * the next walk.  The FAT doesn't change during the scan, so going
+ * along the chain again finds exactly the same clusters.
+ */
+static void end_walk(struct scan *scan, uint64_t *visited, uint32_t start,
+    uint32_t length) {
+  uint32_t cluster = start;
+
+  while (length-- > 0) {
+    visited[cluster / 64] &= ~((uint64_t)1 << (cluster % 64));
+    cluster = fat_get(scan->fat, cluster);
+  }
+}
+
+/**
+ * Records that the walk using visited has reached cluster, and counts
+ * one more chain through it.  Returns false, counting nothing, if this
+ * walk has been here before, which means the chain loops.  Several scan
+ * threads may reach the same cluster, so the reference maps are updated
+ * atomically; visited is this thread's alone.
+ */
+static inline bool claim_cluster(struct scan *scan, uint64_t *visited, uint32_t cluster) {
+  uint64_t bit = (uint64_t)1 << (cluster % 64);
+
+  if ((visited[cluster / 64] & bit) != 0) {
+    return false;
+  }
+  visited[cluster / 64] |= bit;
+  if ((__atomic_fetch_or(&scan->ref_map[cluster / 64], bit, __ATOMIC_RELAXED) & bit) != 0
+      && (__atomic_fetch_or(&scan->shared_map[cluster / 64], bit, __ATOMIC_RELAXED) & bit) != 0) {
+    count_extra_ref(scan, cluster);
+  }
+  return true;
+}
+
+/**
+ * Marks every cluster in the chain starting at cluster as referenced,
+ * and returns the length of the chain, stopping if it loops.  visited
+ * is the calling thread's walk map.
+ */
+uint32_t mark_chain(struct scan *scan, uint64_t *visited, uint32_t cluster) {
+  struct fat_table *fat = scan->fat;
+  uint32_t start = cluster;
+  uint32_t length = 0;
+
+  while (cluster >= CLUST_FIRST && cluster < fat->nclusters
+      && length < fat->max_chain && claim_cluster(scan, visited, cluster)) {
+    length++;
+    cluster = fat_get(fat, cluster);
+    if (is_end_of_file(cluster)) {
+      break;
+    }
+  }
+  end_walk(scan, visited, start, length);
+  return length;
+}
+
+/**
+ * Walks a file's chain once: marks its clusters as referenced, and
+ * records how long the chain is, where it ought to end, and where it
+ * loops back on itself if it does.
+ */
+static void scan_file(struct scan *scan, uint64_t *visited, struct direntry *dirent,
+    char *name, char *extension, struct file_record *file) {
+  struct fat_table *fat = scan->fat;
+  uint32_t cluster_size = scan->bpb->bpbBytesPerSec * scan->bpb->bpbSecPerClust;
+
+  file->dirent = dirent;
+  strcpy(file->name, name);
+  strcpy(file->extension, extension);
+  file->size = getulong(dirent->deFileSize);
+  file->fat_clusters = 0;
+  file->last_cluster = 0;
+  file->loop_cluster = 0;
+
+  uint32_t size_in_clusters = (file->size + cluster_size - 1) / cluster_size;
+  uint32_t cluster = dirent_start(dirent, scan->fat);
+  uint32_t start = cluster;
+  uint32_t previous = 0;
+  while (cluster >= CLUST_FIRST && cluster < fat->nclusters
+      && file->fat_clusters < fat->max_chain) {
+    if (!claim_cluster(scan, visited, cluster)) {
+      file->loop_cluster = previous;
+      break;
+    }
+    file->fat_clusters++;
+    if (file->fat_clusters == size_in_clusters) {
+      file->last_cluster = cluster;
+    }
+    uint32_t next = fat_get(fat, cluster);
+    if (is_end_of_file(next)) {
+      break;
+    } else if (next == CLUST_FREE) {
+      fprintf(scan->err, "Bad file termination\n");
+      break;
+    }
+    previous = cluster;
+    cluster = next;
+  }
+  end_walk(scan, visited, start, file->fat_clusters);
+}
+
+/**
+ * Appends a record to the scan's list of files, and returns it.
+ */
+static struct file_record *add_file_record(struct scan *scan) {
+  if (scan->nfiles == scan->files_size) {
+    scan->files_size = scan->files_size ? scan->files_size * 2 : 64;
+    scan->files = realloc(scan->files, scan->files_size * sizeof(struct file_record));
+    if (scan->files == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  return &scan->files[scan->nfiles++];
+}
+
+/**
+ * Works out what to do with a directory slot, filling in its name and
+ * extension without the padding.
+ */
+int classify_entry(struct direntry *dirent, char *name, char *extension) {
+  if (dirent->deName[0] == SLOT_DELETED) {
+    return ENTRY_SKIP;
+  }
+
+  name[8] = ' ';
+  extension[3] = ' ';
+  memcpy(name, &(dirent->deName[0]), 8);
+  memcpy(extension, dirent->deExtension, 3);
+  removePadding(name, 8);
+  removePadding(extension, 3);
+
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return ENTRY_SKIP;
+  } else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
+    return ENTRY_SKIP;
+  } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+    return ENTRY_DIR;
+  }
+  return ENTRY_FILE;
+}
+
+/**
+ * Visits every entry in the directory tree, marking directory and file
+ * clusters as referenced.  The walk keeps its own stack of open
+ * directories, so a deep or looping tree can't exhaust ours.
+ */
+void scan_tree(struct scan *scan) {
+  uint64_t *visited = walk_map_new(scan);
+  struct tree_walk walk;
+  struct direntry *dirent;
+
+  /* a FAT-32 root directory has a chain of its own */
+  if (scan->bpb->bpbRootClust != 0) {
+    mark_chain(scan, visited, scan->bpb->bpbRootClust);
+  }
+  tree_walk_start(&walk, MSDOSFSROOT, scan->max_depth, scan->io, scan->bpb, scan->fat);
+  while ((dirent = tree_walk_next(&walk)) != NULL) {
+    char name[9], extension[4];
+
+    switch (classify_entry(dirent, name, extension)) {
+    case ENTRY_DIR: {
+      uint32_t cluster = dirent_start(dirent, scan->fat);
+      /* the directory's own clusters, including any after the last
+         entry in use */
+      mark_chain(scan, visited, cluster);
+      switch (tree_walk_descend(&walk, cluster)) {
+      case WALK_TOO_DEEP:
+        fprintf(scan->err, "Directory %s is nested more than %u deep, not scanning it\n",
+          name, scan->max_depth);
+        break;
+      case WALK_LOOP:
+        fprintf(scan->err, "Directory %s leads to a directory already scanned, not scanning it again\n",
+          name);
+        break;
+      }
+      break;
+    }
+    case ENTRY_FILE:
+      scan_file(scan, visited, dirent, name, extension, add_file_record(scan));
+      break;
+    }
+  }
+  tree_walk_end(&walk);
+  free(visited);
+}
+
+/**
+ * Orders cross-links by cluster, then by directory entry.
+ */
+static int compare_cross_links(const void *a, const void *b) {
+  const struct cross_link *x = a, *y = b;
+  if (x->cluster != y->cluster) {
+    return x->cluster < y->cluster ? -1 : 1;
+  }
+  return x->dirent < y->dirent ? -1 : x->dirent > y->dirent;
+}
+
+/**
+ * Finds which files and directories share clusters, once a scan has
+ * counted more than one chain through some of them.  Every chain in
+ * the tree is walked again up to the first shared cluster on it, so
+ * this is only worth calling if there are any.  The cross-links come
+ * back sorted by cluster, one per directory entry, and the number of
+ * them is returned.
+ */
+uint32_t find_cross_links(struct scan *scan, struct cross_link **links) {
+  struct fat_table *fat = scan->fat;
+  struct tree_walk walk;
+  struct direntry *dirent;
+  uint64_t *visited = walk_map_new(scan);
+  uint32_t nlinks = 0, size = 0, i, j;
+
+  *links = NULL;
+  tree_walk_start(&walk, MSDOSFSROOT, scan->max_depth, scan->io, scan->bpb, fat);
+  while ((dirent = tree_walk_next(&walk)) != NULL) {
+    char name[9], extension[4];
+    int kind = classify_entry(dirent, name, extension);
+    if (kind == ENTRY_SKIP) {
+      continue;
+    }
+
+    uint32_t start = dirent_start(dirent, scan->fat);
+    uint32_t cluster = start;
+    uint32_t length = 0;
+    while (cluster >= CLUST_FIRST && cluster < fat->nclusters
+        && length < fat->max_chain && !map_test(visited, cluster)) {
+      visited[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+      length++;
+      if (map_test(scan->shared_map, cluster)) {
+        if (nlinks == size) {
+          size = size ? size * 2 : 16;
+          *links = realloc(*links, size * sizeof(struct cross_link));
+          if (*links == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+          }
+        }
+        (*links)[nlinks].cluster = cluster;
+        (*links)[nlinks].dirent = dirent;
+        nlinks++;
+        break;
+      }
+      cluster = fat_get(fat, cluster);
+      if (is_end_of_file(cluster)) {
+        break;
+      }
+    }
+    end_walk(scan, visited, start, length);
+
+    if (kind == ENTRY_DIR) {
+      tree_walk_descend(&walk, start);
+    }
+  }
+  tree_walk_end(&walk);
+  free(visited);
+
+  /* a looping directory tree brings us back to the same entries, so
+     drop the repeats */
+  qsort(*links, nlinks, sizeof(struct cross_link), compare_cross_links);
+  for (i = 0, j = 0; i < nlinks; i++) {
+    if (j == 0 || compare_cross_links(&(*links)[j - 1], &(*links)[i]) != 0) {
+      (*links)[j++] = (*links)[i];
+    }
+  }
+  return j;
+}
+
+/*
+ * The parallel scan.  Each directory is a task: scanning it walks the
+ * chains of all its files, and queues a new task for each
+ * subdirectory.  Tasks record their entries in order, with a pointer
+ * to the child task where a subdirectory was, so once every task is
+ * done the file records can be put back in exactly the order
+ * scan_tree would have produced them.
+ */
+
+struct dir_item {
+  bool is_dir;
+  uint32_t cluster;           /* where the subdirectory starts */
+  struct dir_task *child;     /* its task, or NULL if another entry
+                                 got to queue the directory first */
+  struct file_record file;    /* the file, or just the subdirectory's
+                                 name */
+};
+
+struct dir_task {
+  uint32_t cluster;
+  uint32_t depth;
+  struct dir_item *items;
+  uint32_t nitems;
+  uint32_t size;
+};
+
+/**
+ * A worker's queue of tasks.  The owner pushes and pops at the tail,
+ * idle workers steal the oldest task from the head.
+ */
+struct task_deque {
+  pthread_mutex_t lock;
+  struct dir_task **tasks;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t size;
+};
+
+struct scan_pool {
+  struct scan *scan;
+  struct task_deque *deques;
+  int nworkers;
+  pthread_mutex_t lock;       /* guards the counts below */
+  pthread_cond_t wake;        /* signalled when a task is queued or
+                                 the last one finishes */
+  int queued;                 /* tasks in the deques */
+  int pending;                /* tasks queued or running */
+};
+
+struct scan_worker {
+  struct scan_pool *pool;
+  int id;
+  uint64_t *visited;          /* this thread's walk map */
+};
+
+static void push_task(struct scan_pool *pool, int id, struct dir_task *task) {
+  struct task_deque *d = &pool->deques[id];
+
+  pthread_mutex_lock(&pool->lock);
+  pool->queued++;
+  pool->pending++;
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->size) {
+    if (d->head > 0) {
+      memmove(d->tasks, d->tasks + d->head, (d->tail - d->head) * sizeof(struct dir_task *));
+      d->tail -= d->head;
+      d->head = 0;
+    } else {
+      d->size = d->size ? d->size * 2 : 64;
+      d->tasks = realloc(d->tasks, d->size * sizeof(struct dir_task *));
+      if (d->tasks == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+    }
+  }
+  d->tasks[d->tail++] = task;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/**
+ * Takes a task from a deque: the newest if it's our own, the oldest
+ * if we're stealing.  Returns NULL if the deque is empty.
+ */
+static struct dir_task *take_task(struct task_deque *d, int steal) {
+  struct dir_task *task = NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->tail > d->head) {
+    task = steal ? d->tasks[d->head++] : d->tasks[--d->tail];
+    if (d->head == d->tail) {
+      d->head = d->tail = 0;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+static struct dir_item *add_dir_item(struct dir_task *task) {
+  if (task->nitems == task->size) {
+    task->size = task->size ? task->size * 2 : 16;
+    task->items = realloc(task->items, task->size * sizeof(struct dir_item));
+    if (task->items == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  return &task->items[task->nitems++];
+}
+
+static struct dir_task *new_dir_task(uint32_t cluster, uint32_t depth) {
+  struct dir_task *task = calloc(1, sizeof(struct dir_task));
+  if (task == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  task->cluster = cluster;
+  task->depth = depth;
+  return task;
+}
+
+/**
+ * Returns the bit that stands for the directory starting at cluster in
+ * a one-bit-per-cluster map: the FAT-32 root directory's cluster for
+ * MSDOSFSROOT, and bit 0 for the FAT-12/16 root.  Numbers that aren't
+ * clusters at all read as empty directories, and give nclusters, which
+ * has no bit.
+ */
+static uint32_t dir_bit(struct scan *scan, uint32_t cluster) {
+  if (cluster == MSDOSFSROOT) {
+    cluster = bpb_geometry(scan->bpb)->root_cluster;
+  }
+  if (cluster >= scan->fat->nclusters || (cluster != MSDOSFSROOT && cluster < CLUST_FIRST)) {
+    return scan->fat->nclusters;
+  }
+  return cluster;
+}
+
+/**
+ * Claims the directory starting at cluster for the thread about to
+ * queue it.  Returns false if some thread got to it first, so however
+ * the directory tree loops, each directory is scanned once.
+ */
+static bool claim_dir(struct scan *scan, uint32_t cluster) {
+  uint32_t i = dir_bit(scan, cluster);
+  uint64_t bit = (uint64_t)1 << (i % 64);
+
+  if (i == scan->fat->nclusters) {
+    return true;
+  }
+  return (__atomic_fetch_or(&scan->dir_map[i / 64], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+
+/**
+ * Scans one directory, queueing its subdirectories on our own deque.
+ */
+static void run_dir_task(struct scan_pool *pool, struct scan_worker *worker,
+    struct dir_task *task) {
+  struct scan *scan = pool->scan;
+  struct dir_iter it;
+  struct direntry *dirent;
+
+  dir_iter_start(&it, task->cluster, scan->io, scan->bpb, scan->fat);
+  while ((dirent = dir_iter_next(&it, scan->io, scan->bpb, scan->fat)) != NULL) {
+    char name[9], extension[4];
+    struct dir_item *item;
+
+    switch (classify_entry(dirent, name, extension)) {
+    case ENTRY_DIR: {
+      uint32_t cluster = dirent_start(dirent, scan->fat);
+      mark_chain(scan, worker->visited, cluster);
+      if (task->depth + 1 > scan->max_depth) {
+        fprintf(scan->err, "Directory %s is nested more than %u deep, not scanning it\n",
+          name, scan->max_depth);
+        break;
+      }
+      item = add_dir_item(task);
+      item->is_dir = true;
+      item->cluster = cluster;
+      strcpy(item->file.name, name);
+      if (claim_dir(scan, cluster)) {
+        item->child = new_dir_task(cluster, task->depth + 1);
+        push_task(pool, worker->id, item->child);
+      } else {
+        item->child = NULL;
+      }
+      break;
+    }
+    case ENTRY_FILE:
+      item = add_dir_item(task);
+      item->is_dir = false;
+      item->child = NULL;
+      scan_file(scan, worker->visited, dirent, name, extension, &item->file);
+      break;
+    }
+  }
+}
+
+static void *scan_worker_main(void *arg) {
+  struct scan_worker *worker = arg;
+  struct scan_pool *pool = worker->pool;
+  struct dir_task *task;
+  int i, done;
+
+  while (1) {
+    task = take_task(&pool->deques[worker->id], 0);
+    for (i = 1; task == NULL && i < pool->nworkers; i++) {
+      task = take_task(&pool->deques[(worker->id + i) % pool->nworkers], 1);
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (task != NULL) {
+      pool->queued--;
+      pthread_mutex_unlock(&pool->lock);
+      run_dir_task(pool, worker, task);
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->pending == 0) {
+        pthread_cond_broadcast(&pool->wake);
+      }
+      pthread_mutex_unlock(&pool->lock);
+      continue;
+    }
+    /* sleep until there's something to steal, or until nothing is
+       queued or running that could queue more */
+    while (pool->queued == 0 && pool->pending > 0) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    done = pool->pending == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (done) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static int compare_tasks(const void *a, const void *b) {
+  uint32_t x = (*(struct dir_task * const *)a)->cluster;
+  uint32_t y = (*(struct dir_task * const *)b)->cluster;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Lists every task in the tree below root, sorted by the cluster each
+ * directory starts at, so collect_dir_tasks can find the one that
+ * scanned a directory some other entry leads to.  Only tasks for real
+ * clusters can be looked up, and there's only one of each.  Each task's
+ * cluster is replaced by its dir_bit along the way.
+ */
+static struct dir_task **list_dir_tasks(struct scan *scan, struct dir_task *root,
+    uint32_t *ntasks) {
+  struct dir_task **tasks;
+  uint32_t n = 1, size = 16, i, j;
+
+  tasks = malloc(size * sizeof(struct dir_task *));
+  if (tasks == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  tasks[0] = root;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < tasks[i]->nitems; j++) {
+      if (tasks[i]->items[j].child == NULL) {
+        continue;
+      }
+      if (n == size) {
+        size *= 2;
+        tasks = realloc(tasks, size * sizeof(struct dir_task *));
+        if (tasks == NULL) {
+          fprintf(stderr, "Out of memory\n");
+          exit(1);
+        }
+      }
+      tasks[n++] = tasks[i]->items[j].child;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    tasks[i]->cluster = dir_bit(scan, tasks[i]->cluster);
+  }
+  qsort(tasks, n, sizeof(struct dir_task *), compare_tasks);
+  *ntasks = n;
+  return tasks;
+}
+
+/**
+ * Puts the file records from the finished tasks into scan->files in
+ * directory-tree order, and frees the tasks.  Which of two
+ * entries leading to the same directory got to queue it depends on
+ * the threads, so the directory's records go wherever the entry
+ * scan_tree would have followed comes, and the other entries are
+ * reported here, in the same order scan_tree would.
+ */
+static void collect_dir_tasks(struct scan *scan, struct dir_task *root) {
+  struct dir_task **stack, **tasks, key, *want = &key, **found;
+  uint64_t *collected;
+  uint32_t *next, depth = 0, size = 16, ntasks, i;
+
+  tasks = list_dir_tasks(scan, root, &ntasks);
+  stack = malloc(size * sizeof(struct dir_task *));
+  next = malloc(size * sizeof(uint32_t));
+  collected = walk_map_new(scan);
+  if (stack == NULL || next == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  i = dir_bit(scan, MSDOSFSROOT);
+  collected[i / 64] |= (uint64_t)1 << (i % 64);
+  stack[0] = root;
+  next[0] = 0;
+  depth = 1;
+  while (depth > 0) {
+    struct dir_task *task = stack[depth - 1];
+    if (next[depth - 1] == task->nitems) {
+      depth--;
+      continue;
+    }
+    struct dir_item *item = &task->items[next[depth - 1]++];
+    if (!item->is_dir) {
+      *add_file_record(scan) = item->file;
+      continue;
+    }
+    i = dir_bit(scan, item->cluster);
+    if (i < scan->fat->nclusters) {
+      if (map_test(collected, i)) {
+        fprintf(scan->err, "Directory %s leads to a directory already scanned, not scanning it again\n",
+          item->file.name);
+        continue;
+      }
+      collected[i / 64] |= (uint64_t)1 << (i % 64);
+      if (item->child == NULL) {
+        /* the entry that queued it comes later in the tree */
+        key.cluster = i;
+        found = bsearch(&want, tasks, ntasks, sizeof(struct dir_task *), compare_tasks);
+        item->child = *found;
+      }
+    }
+    if (depth == size) {
+      size *= 2;
+      stack = realloc(stack, size * sizeof(struct dir_task *));
+      next = realloc(next, size * sizeof(uint32_t));
+      if (stack == NULL || next == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+    }
+    stack[depth] = item->child;
+    next[depth] = 0;
+    depth++;
+  }
+  for (i = 0; i < ntasks; i++) {
+    free(tasks[i]->items);
+    free(tasks[i]);
+  }
+  free(stack);
+  free(next);
+  free(collected);
+  free(tasks);
+}
+
+/**
+ * Does the same as scan_tree, spreading the directories over nthreads
+ * threads that steal work from each other.  The FAT isn't changed
+ * while this runs, each walk finds loops with its own thread's map, and
+ * the reference counts only ever go up, so the result is the same as
+ * scan_tree's whatever order the chains are walked in.
+ */
+void scan_tree_parallel(struct scan *scan, int nthreads) {
+  struct scan_pool pool;
+  struct scan_worker *workers;
+  pthread_t *threads;
+  struct dir_task *root;
+  int i;
+
+  if (nthreads <= 1) {
+    scan_tree(scan);
+    return;
+  }
+
+  pool.scan = scan;
+  pool.nworkers = nthreads;
+  pool.queued = 0;
+  pool.pending = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  pool.deques = calloc(nthreads, sizeof(struct task_deque));
+  workers = calloc(nthreads, sizeof(struct scan_worker));
+  threads = calloc(nthreads, sizeof(pthread_t));
+  if (pool.deques == NULL || workers == NULL || threads == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    workers[i].pool = &pool;
+    workers[i].id = i;
+    workers[i].visited = walk_map_new(scan);
+  }
+  if (scan->bpb->bpbRootClust != 0) {
+    mark_chain(scan, workers[0].visited, scan->bpb->bpbRootClust);
+  }
+  memset(scan->dir_map, 0, (scan->fat->nclusters + 63) / 64 * sizeof(uint64_t));
+  claim_dir(scan, MSDOSFSROOT);
+  root = new_dir_task(MSDOSFSROOT, 0);
+  push_task(&pool, 0, root);
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, scan_worker_main, &workers[i]) != 0) {
+      fprintf(stderr, "Cannot create scan thread\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  collect_dir_tasks(scan, root);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_destroy(&pool.deques[i].lock);
+    free(pool.deques[i].tasks);
+    free(workers[i].visited);
+  }
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.wake);
+  free(pool.deques);
+  free(workers);
+  free(threads);
+}
@@ -0,0 +1,79 @@
+/* the directory-tree scan behind dos_scandisk */
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/**
+ * Everything the scan learns about one file in the directory tree.
+ */
+struct file_record {
+  struct direntry *dirent;
+  char name[9];
+  char extension[4];
+  uint32_t size;              /* size in bytes, from the dirent */
+  uint32_t fat_clusters;      /* length of its chain in the FAT */
+  uint32_t last_cluster;      /* where the chain should end going by
+                                 size, or 0 if it's too short */
+  uint32_t loop_cluster;      /* the cluster whose next entry loops
+                                 back into the chain, or 0 */
+};
+
+/**
+ * A file or directory whose chain runs into clusters that another
+ * chain uses too, and the first of them it reaches.
+ */
+struct cross_link {
+  uint32_t cluster;
+  struct direntry *dirent;
+};
+
+/**
+ * State for scanning one image.  scan_tree visits every dirent and
+ * walks every chain exactly once, and the report and repair phases
+ * work from what it recorded rather than going back to the image.
+ */
+struct scan {
+  struct image_io *io;
+  struct bpb710 *bpb;
+  struct fat_table *fat;
+  uint64_t *ref_map;          /* one bit per cluster, set once a chain
+                                 goes through it */
+  uint64_t *shared_map;       /* and once a second chain does: a
+                                 cross-link */
+  uint8_t *extra_refs;        /* chains beyond two through each
+                                 cluster, stopping at 253; NULL until
+                                 some cluster has three */
+  uint64_t *dir_map;          /* one bit per cluster, set once the
+                                 parallel scan has queued the directory
+                                 starting there; bit 0 is the FAT-12/16
+                                 root directory */
+  struct file_record *files;  /* in directory-tree order */
+  uint32_t nfiles;
+  uint32_t files_size;
+  uint32_t max_depth;
+  FILE *out;                  /* where the report goes */
+  FILE *err;                  /* and warnings about the image */
+};
+
+/**
+ * Returns whether cluster's bit is set in a one-bit-per-cluster map.
+ */
+static inline bool map_test(const uint64_t *map, uint32_t cluster) {
+  return (map[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+#define ENTRY_SKIP 0
+#define ENTRY_DIR 1
+#define ENTRY_FILE 2
+
+void removePadding(char *string, u_int8_t length);
+void scan_init(struct scan *scan);
+void scan_free(struct scan *scan);
+uint32_t cluster_refs(struct scan *scan, uint32_t cluster);
+void unref_cluster(struct scan *scan, uint32_t cluster);
+int classify_entry(struct direntry *dirent, char *name, char *extension);
+uint64_t *walk_map_new(struct scan *scan);
+uint32_t mark_chain(struct scan *scan, uint64_t *visited, uint32_t cluster);
+uint32_t find_cross_links(struct scan *scan, struct cross_link **links);
+void scan_tree(struct scan *scan);
+void scan_tree_parallel(struct scan *scan, int nthreads);